@@ -1,8 +1,9 @@
 # this program runs on an Adafruit Circuit Python Express board and turns on the onboard IR led when a button is pressed
+# button B sends bursts of light for finding the direction of the remote, button A sends a NEC command that the clock decodes
 import time
 from adafruit_circuitplayground.express import cpx
 
-# import adafruit_irremote
+import adafruit_irremote
 import pulseio
 import board
 import array
@@ -10,6 +11,19 @@ import array
 # Create a 'pulseio' output, to send infrared signals on the IR transmitter @ 38KHz
 pulseout = pulseio.PulseOut(board.IR_TX, frequency=38000, duty_cycle=2 ** 7) # duty_cycle reduced from normal for dimmer light to reduce reflection off walls
 
+# NEC timings in microseconds, the same as NecDecoder in src/ir_remote.h
+nec = adafruit_irremote.GenericTransmit(header=[9000, 4500], one=[562, 1687], zero=[562, 562], trail=562)
+NEC_ADDRESS = 0x00
+NEC_COMMAND = 0x45
+
+
+def nec_bytes(address, command):
+    # GenericTransmit sends each byte most significant bit first, NEC sends the least significant bit first
+    def reverse(byte):
+        return int("{:08b}".format(byte)[::-1], 2)
+    return [reverse(b) for b in (address, ~address & 0xFF, command, ~command & 0xFF)]
+
+
 while True:
     if cpx.button_b:
         cpx.red_led = True
@@ -17,3 +31,8 @@ while True:
             pulseout.send(array.array("H", [1000, 1500]))
         cpx.red_led = False
         time.sleep(0.5)
+    if cpx.button_a:
+        cpx.red_led = True
+        nec.transmit(pulseout, nec_bytes(NEC_ADDRESS, NEC_COMMAND))
+        cpx.red_led = False
+        time.sleep(0.5)
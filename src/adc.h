@@ -0,0 +1,53 @@
+/**
+ * adc.h contains a non-blocking replacement for analogRead() on one pin: a conversion is started, and ADC_Handler gets the result
+ * when it is ready instead of the CPU waiting for it (analogRead() waits for two conversions, almost a millisecond with the core's settings).
+ */
+#ifndef ADC_H
+#define ADC_H
+#include <Arduino.h>
+
+/**
+ * @brief  Call this on startup, makes the ADC convert pin and interrupt when each conversion is done. The ADC stays enabled.
+ * @note   Uses the resolution, reference and prescaler that Arduino's init() set, so results are in the same units as analogRead().
+ *      analogRead() can't be used on other pins afterwards, it disables the ADC and changes the input.
+ * @param  pin: Arduino pin number of an analog input, ex: A1
+ * @param  priority: NVIC priority of ADC_Handler
+ */
+void setupAdcInterrupt(byte pin, uint8_t priority)
+{
+    analogRead(pin); // lets the core switch the pin to its analog function
+    ADC->CTRLA.bit.ENABLE = 0;
+    while (ADC->STATUS.bit.SYNCBUSY)
+        ;
+    ADC->INPUTCTRL.bit.MUXPOS = g_APinDescription[pin].ulADCChannelNumber;
+    while (ADC->STATUS.bit.SYNCBUSY)
+        ;
+    ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+    ADC->INTENSET.reg = ADC_INTENSET_RESRDY;
+    ADC->CTRLA.bit.ENABLE = 1;
+    while (ADC->STATUS.bit.SYNCBUSY)
+        ;
+    NVIC_SetPriority(ADC_IRQn, priority);
+    NVIC_EnableIRQ(ADC_IRQn);
+}
+
+/**
+ * @brief  starts a conversion, ADC_Handler runs when it is done. Safe to call while one is running (it starts over).
+ */
+void startAdcConversion()
+{
+    ADC->SWTRIG.reg = ADC_SWTRIG_START;
+}
+
+/**
+ * @brief  call from ADC_Handler, clears the interrupt
+ * @retval the result of the conversion that just finished
+ */
+uint16_t readAdcResult()
+{
+    uint16_t result = ADC->RESULT.reg;
+    ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+    return result;
+}
+
+#endif // ADC_H
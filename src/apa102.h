@@ -0,0 +1,76 @@
+/**
+ * apa102.h contains a column of pixels stored in the format that is sent to the APA102 LEDs,
+ * so an image can be encoded once when it is drawn and then sent without FastLED having to scale and serialize it again every column.
+ * The functions are inline because font.cpp includes this file as well as src.ino.
+ */
+#ifndef APA102_H
+#define APA102_H
+#include <Arduino.h>
+#include <FastLED.h>
+#include <SPI.h>
+
+const uint8_t APA102_LEDS = 8; // number of LEDs in one column
+const uint8_t APA102_BRIGHTNESS = 0xE0 | 0x1F; // 3 bit header and 5 bit global brightness, FastLED always sends full global brightness
+const uint8_t APA102_COLUMN_BYTES = 4 + 4 * APA102_LEDS + 4; // start frame, one word per LED, end frame
+
+/**
+ * @brief  The exact bytes FastLED 3.5.0's FastLED.addLeds<APA102, data, clock, BGR> sends for one column of LEDs (with brightness 255 and dithering off).
+ * @note   4 bytes of 0x00 start frame, then for each LED APA102_BRIGHTNESS, blue, green, red, then an end frame of 0xFF 0x00 0x00 0x00.
+ *      testApa102Encoding() compares it against fastLedApa102Bytes(), a copy of FastLED's APA102Controller::showPixels().
+ *      The constructor fills in the frames and sets every LED to off, after that only the color bytes ever change.
+ */
+struct Apa102Column {
+    uint8_t bytes[APA102_COLUMN_BYTES];
+
+    Apa102Column()
+    {
+        memset(bytes, 0, sizeof(bytes));
+        for (uint8_t i = 0; i < APA102_LEDS; i++) {
+            bytes[4 + 4 * i] = APA102_BRIGHTNESS;
+        }
+        bytes[APA102_COLUMN_BYTES - 4] = 0xFF;
+    }
+    /**
+     * @brief  sets the color of one LED, 0 is the top of the column
+     */
+    void set(uint8_t led, const CRGB& color)
+    {
+        uint8_t* word = &bytes[4 + 4 * led];
+        word[1] = color.b;
+        word[2] = color.g;
+        word[3] = color.r;
+    }
+};
+
+/**
+ * @brief  encodes a column of pixels into the bytes that will be sent to the LEDs
+ * @param  pixels: APA102_LEDS colors, 0 is the top of the column
+ * @param  column: encoded column to write
+ */
+inline void encodeApa102Column(const CRGB pixels[APA102_LEDS], Apa102Column& column)
+{
+    for (uint8_t i = 0; i < APA102_LEDS; i++) {
+        column.set(i, pixels[i]);
+    }
+}
+
+/**
+ * @brief  Call this on startup to take over the LED data and clock pins with the hardware SPI (SPI's MOSI and SCK are pins 8 and 9 on the MKR1000)
+ */
+inline void setupApa102()
+{
+    SPI.begin();
+    SPI.beginTransaction(SPISettings(12000000, MSBFIRST, SPI_MODE0)); // one column (40 bytes) takes about 30 microseconds to send
+}
+
+/**
+ * @brief  sends an encoded column to the LEDs, safe to call from an ISR
+ */
+inline void showApa102Column(const Apa102Column& column)
+{
+    for (uint8_t i = 0; i < APA102_COLUMN_BYTES; i++) {
+        SPI.transfer(column.bytes[i]);
+    }
+}
+
+#endif // APA102_H
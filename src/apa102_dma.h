@@ -0,0 +1,113 @@
+/**
+ * apa102_dma.h contains an output engine that sends encoded APA102 columns to the LEDs with the DMA controller.
+ * Each TC3 compare match is routed through the event system to a DMA channel, which sends the next column over SPI (SERCOM1)
+ * and then suspends itself until the next compare match, so the CPU doesn't send any bytes.
+ * TC3_Handler still runs once per column to move the compare value to the next column (see timer.h), a few microseconds each.
+ */
+#ifndef APA102_DMA_H
+#define APA102_DMA_H
+#include "apa102.h"
+#include <Arduino.h>
+
+const uint8_t APA102_DMA_CHANNEL = 0;
+const uint8_t APA102_EVSYS_CHANNEL = 0;
+
+// the DMAC reads each channel's first descriptor from here, and saves a suspended channel's progress to the write back section
+DmacDescriptor apa102_dma_base_descriptors[APA102_DMA_CHANNEL + 1] __attribute__((aligned(16)));
+DmacDescriptor apa102_dma_writeback_descriptors[APA102_DMA_CHANNEL + 1] __attribute__((aligned(16)));
+
+/**
+ * @brief  Sends the columns of one of three images (ex: a TripleBuffer) to the LEDs, one column per TC3 compare match.
+ * @note   Every image gets a circular chain of DMA descriptors, one per column, built once in setup().
+ *      Starting an image from any column is then a copy of one descriptor, so start() is O(1) and safe to call from the beam break ISR.
+ *      The chains use 16 bytes of RAM per column per image.
+ *      Every compare match resumes the channel, so columns longer than the 16 bit counter (which timer.h splits into several compares,
+ *      at under 0.13 rotations per second) would be sent early, that is far below the speeds the RUNNING state allows.
+ * @param  width: number of columns in each image
+ */
+template <int width>
+class Apa102Dma {
+    DmacDescriptor chains[3][width] __attribute__((aligned(16)));
+    uint8_t lead_in_byte; // copied onto itself by the descriptor that waits for the first compare match
+
+public:
+    /**
+     * @brief  Call this on startup, after setupApa102() and setupTimer(). Doesn't send anything until start() is called.
+     * @param  images: the three images that will be displayed, each with width columns
+     */
+    void setup(const Apa102Column* const images[3])
+    {
+        for (uint8_t i = 0; i < 3; i++) {
+            for (int c = 0; c < width; c++) {
+                DmacDescriptor& descriptor = chains[i][c];
+                descriptor.BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BLOCKACT_SUSPEND | DMAC_BTCTRL_BEATSIZE_BYTE | DMAC_BTCTRL_SRCINC;
+                descriptor.BTCNT.reg = APA102_COLUMN_BYTES;
+                descriptor.SRCADDR.reg = (uint32_t)(images[i][c].bytes + APA102_COLUMN_BYTES); // with SRCINC, SRCADDR is the end of the block
+                descriptor.DSTADDR.reg = (uint32_t)&SERCOM1->SPI.DATA.reg; // SPI uses SERCOM1 on the MKR1000
+                descriptor.DESCADDR.reg = (uint32_t)&chains[i][(c + 1) % width]; // after the last column, wrap around to the first
+            }
+        }
+
+        PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+        PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+        PM->APBCMASK.reg |= PM_APBCMASK_EVSYS;
+
+        DMAC->CTRL.reg &= ~DMAC_CTRL_DMAENABLE;
+        DMAC->BASEADDR.reg = (uint32_t)apa102_dma_base_descriptors;
+        DMAC->WRBADDR.reg = (uint32_t)apa102_dma_writeback_descriptors;
+        DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xF);
+
+        // each byte is written when the SPI data register is empty, and a TC3 event resumes the channel after every column
+        DMAC->CHID.reg = DMAC_CHID_ID(APA102_DMA_CHANNEL);
+        DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+        DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+        while (DMAC->CHCTRLA.bit.SWRST)
+            ;
+        DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) | DMAC_CHCTRLB_TRIGSRC(SERCOM1_DMAC_ID_TX) | DMAC_CHCTRLB_TRIGACT_BEAT | DMAC_CHCTRLB_EVIE | DMAC_CHCTRLB_EVACT_RESUME;
+
+        // route TC3's match/compare 0 event (one per column) to the DMA channel
+        GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(GCLK_CLKCTRL_ID_EVSYS_0_Val + APA102_EVSYS_CHANNEL) | GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN(0);
+        while (GCLK->STATUS.bit.SYNCBUSY)
+            ;
+        EVSYS->USER.reg = EVSYS_USER_USER(EVSYS_ID_USER_DMAC_CH_0 + APA102_DMA_CHANNEL) | EVSYS_USER_CHANNEL(APA102_EVSYS_CHANNEL + 1); // USER.CHANNEL is the event channel + 1
+        EVSYS->CHANNEL.reg = EVSYS_CHANNEL_CHANNEL(APA102_EVSYS_CHANNEL) | EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_TC3_MCX_0) | EVSYS_CHANNEL_PATH_RESYNCHRONIZED | EVSYS_CHANNEL_EDGSEL_RISING_EDGE;
+        TC3->COUNT16.CTRLA.reg &= ~TC_CTRLA_ENABLE; // EVCTRL can only be written while TC3 is disabled
+        while (TC3->COUNT16.STATUS.bit.SYNCBUSY)
+            ;
+        TC3->COUNT16.EVCTRL.reg |= TC_EVCTRL_MCEO0;
+        TC3->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+        while (TC3->COUNT16.STATUS.bit.SYNCBUSY)
+            ;
+    }
+    /**
+     * @brief  starts sending an image from a given column at the next TC3 compare match, and one more column at each match after it. O(1)
+     * @note   Nothing is sent right away, so the first column goes out when TC3_Handler would have shown it without APA102_DMA.
+     *      The channel starts with a descriptor that copies a byte onto itself and suspends, the first compare match resumes it into the chain.
+     * @param  image: [0, 3) which image to send, ex: TripleBuffer::displayIndex()
+     * @param  first_column: [0, width) column of the image to send first
+     */
+    void start(uint8_t image, int first_column)
+    {
+        stop();
+        DmacDescriptor& base = apa102_dma_base_descriptors[APA102_DMA_CHANNEL];
+        base.BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BLOCKACT_SUSPEND | DMAC_BTCTRL_BEATSIZE_BYTE; // neither address increments
+        base.BTCNT.reg = 1;
+        base.SRCADDR.reg = (uint32_t)&lead_in_byte;
+        base.DSTADDR.reg = (uint32_t)&lead_in_byte;
+        base.DESCADDR.reg = (uint32_t)&chains[image][first_column];
+        DMAC->CHID.reg = DMAC_CHID_ID(APA102_DMA_CHANNEL);
+        DMAC->CHCTRLA.reg |= DMAC_CHCTRLA_ENABLE;
+    }
+    /**
+     * @brief  stops sending columns, the column that is being sent may be cut short
+     */
+    void stop()
+    {
+        DMAC->CHID.reg = DMAC_CHID_ID(APA102_DMA_CHANNEL);
+        DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+        while (DMAC->CHCTRLA.bit.ENABLE)
+            ;
+    }
+};
+
+#endif // APA102_DMA_H
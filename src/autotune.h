@@ -0,0 +1,166 @@
+/**
+ * autotune.h contains a relay feedback (Åström–Hägglund) auto-tuner for the motor's PID.
+ * Instead of PID, a relay switches the motor between two duty cycles whenever the speed crosses the setpoint, which makes the speed oscillate
+ * at the ultimate period of the loop. The ultimate gain follows from how far the speed swings, and the PI gains from both.
+ */
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+#include "pid.h"
+#include <Arduino.h>
+
+/**
+ * @brief  Runs a relay experiment and calculates Tyreus–Luyben PI gains from it (less overshoot and ripple than Ziegler–Nichols).
+ * @note   update() is meant to be called from updateFSM() every loop, the speed should already be close to the setpoint when start() is called.
+ */
+class RelayTuner {
+public:
+    static const uint8_t SKIP_CYCLES = 1; // the first oscillation starts from wherever the speed was, so it isn't measured
+    static const uint8_t MEASURE_CYCLES = 4; // oscillations averaged for the result
+
+private:
+    int32_t setpoint;
+    int32_t bias;
+    int32_t amplitude;
+    int32_t hysteresis;
+    unsigned long timeout;
+
+    bool running;
+    bool measured;
+    bool high; // the relay output is bias + amplitude
+    unsigned long start_micros;
+    unsigned long last_rise_micros;
+    uint8_t rises;
+    int32_t cycle_max;
+    int32_t cycle_min;
+    uint32_t period_sum;
+    uint32_t min_period;
+    uint32_t max_period;
+    int64_t swing_sum; // sum of the peak to peak swings of the input
+
+public:
+    RelayTuner()
+    {
+        running = false;
+        measured = false;
+    }
+    /**
+     * @brief  starts a new experiment
+     * @param  _setpoint: input the relay switches around
+     * @param  _bias: output in the middle of the relay, ex: the output of PID at the setpoint
+     * @param  _amplitude: the relay outputs _bias + _amplitude below the setpoint and _bias - _amplitude above it
+     * @param  _hysteresis: the input has to be this far past the setpoint to switch, more than the noise of the input but much less than the swing
+     * @param  _timeout: in microseconds, the experiment fails if it hasn't measured every cycle by then
+     * @param  micros: the current time
+     */
+    void start(int32_t _setpoint, int32_t _bias, int32_t _amplitude, int32_t _hysteresis, unsigned long _timeout, unsigned long micros)
+    {
+        setpoint = _setpoint;
+        bias = _bias;
+        amplitude = _amplitude;
+        hysteresis = _hysteresis;
+        timeout = _timeout;
+        running = true;
+        measured = false;
+        high = true;
+        start_micros = micros;
+        rises = 0;
+        period_sum = 0;
+        min_period = UINT32_MAX;
+        max_period = 0;
+        swing_sum = 0;
+        cycle_max = INT32_MIN;
+        cycle_min = INT32_MAX;
+    }
+    /**
+     * @brief  Call this every loop while the experiment runs
+     * @param  input: (int32_t) the measurement
+     * @param  micros: (unsigned long) a value that increases steadily at a rate of one million per second.
+     * @retval (int32_t) output for the motor, bias once the experiment is over
+     */
+    int32_t update(int32_t input, unsigned long micros)
+    {
+        if (!running) {
+            return bias;
+        }
+        if (micros - start_micros > timeout) {
+            running = false;
+            return bias;
+        }
+        cycle_max = max(cycle_max, input);
+        cycle_min = min(cycle_min, input);
+        if (high && input > setpoint + hysteresis) {
+            high = false;
+        } else if (!high && input < setpoint - hysteresis) { // a full oscillation ends each time the relay switches up
+            high = true;
+            if (rises > SKIP_CYCLES) {
+                uint32_t period = micros - last_rise_micros;
+                period_sum += period;
+                min_period = min(min_period, period);
+                max_period = max(max_period, period);
+                swing_sum += cycle_max - cycle_min;
+            }
+            if (rises == SKIP_CYCLES + MEASURE_CYCLES) {
+                running = false;
+                measured = max_period <= min_period + min_period / 2 && swing_sum > 0; // an oscillation that doesn't repeat isn't the ultimate period
+                return bias;
+            }
+            rises++;
+            last_rise_micros = micros;
+            cycle_max = input;
+            cycle_min = input;
+        }
+        return high ? bias + amplitude : bias - amplitude;
+    }
+    /**
+     * @brief  true until the experiment succeeds, fails, or times out
+     */
+    bool isRunning()
+    {
+        return running;
+    }
+    /**
+     * @brief  true if the last experiment finished and measured a steady oscillation, so gains() can be used
+     */
+    bool succeeded()
+    {
+        return measured;
+    }
+    /**
+     * @brief  average period of the oscillation in microseconds (the ultimate period), 0 if the experiment didn't succeed
+     */
+    uint32_t ultimatePeriod()
+    {
+        return measured ? period_sum / MEASURE_CYCLES : 0;
+    }
+    /**
+     * @brief  ultimate gain 4 * amplitude / (pi * half the swing), with q fraction bits, 0 if the experiment didn't succeed
+     */
+    int32_t ultimateGain(uint8_t q)
+    {
+        if (!measured) {
+            return 0;
+        }
+        int64_t half_swing_sum = swing_sum / 2; // MEASURE_CYCLES times the average half swing
+        return constrain(((int64_t)4 * amplitude * MEASURE_CYCLES << q) * 10000 / (31416 * half_swing_sum), (int64_t)0, (int64_t)INT32_MAX);
+    }
+    /**
+     * @brief  base with the p and i terms replaced by the Tyreus–Luyben PI gains: Kp = Ku / 3.2, Ti = 2.2 * Tu
+     * @param  base: gains to copy k, f, d and below_input from, an entry with i = 0 keeps i = 0
+     * @param  q: fraction bits of the gains, like the q of FixedPid
+     */
+    PidGains gains(const PidGains& base, uint8_t q)
+    {
+        PidGains tuned = base;
+        if (!measured) {
+            return tuned;
+        }
+        int64_t p = (int64_t)ultimateGain(q) * 10 / 32;
+        tuned.p = p;
+        if (base.i != 0) {
+            tuned.i = constrain(p * 10000000 / (22 * (int64_t)ultimatePeriod()), (int64_t)1, (int64_t)INT32_MAX); // per second
+        }
+        return tuned;
+    }
+};
+
+#endif // AUTOTUNE_H
@@ -1,165 +1,141 @@
 /**
- * This file contains functions for connecting to the internet over WiFi,
- * retrieving the current time from an api,
- * and creating a string representing the current time that updates as time passes
- * without further wifi connections being necessary.
+ * This file contains the clock's connection to the internet over WiFi, which TimeSync (time_sync.h) uses to get the time from an SNTP server
+ * or the worldtimeapi.org API in the background, and the string representing the current time that is displayed.
  */
 #ifndef CLOCK_TIME_H
 #define CLOCK_TIME_H
+#include "rtc.h"
+#include "time_of_day.h"
+#include "time_sync.h"
+#include "watchdog.h"
 #include <Arduino.h>
 #include <WiFi101.h>
-
-WiFiClient client;
-
-char buffer[5000];
-char startTimeBuf[20];
-char timeBuf[40];
-int timeSinceStart;
+#include <WiFiUdp.h>
 
 char ssid[] = "router"; // network SSID (name)
 char pass[] = "password"; // for networks that require a password
-int status = WL_IDLE_STATUS; // the WiFi radio's status
+const unsigned long wifi_connect_timeout = 10000; // milliseconds WiFi.begin() waits for the network
+const uint16_t ntp_local_port = 2390; // UDP port the SNTP replies come back to
 
 /**
- * @brief  attempts to connect to the worldtimeapi.org website
- * @retval true if connection successful, false if unsuccessful
+ * @brief  WiFi101 as the network of TimeSync
+ * @note   WiFi.begin(), WiFi.hostByName() and WiFiClient::connect() wait for the WINC1500, so the watchdog is stopped while they run.
+ *      TimeSync only calls them when loop() says it can block. begin() has to run before the watchdog is started.
  */
-bool connect_to_webpage()
-{
-    Serial.println("Attempting to connect to webpage");
-    if (client.connect("worldtimeapi.org", 80)) {
-        Serial.println("Connected to server");
-        client.println("GET /api/timezone/America/New_York HTTP/1.1");
-        client.println("Host: worldtimeapi.org");
-        client.println("Connection: close");
-        client.println();
-        return true;
-    } else {
-        Serial.println("Failed to fetch webpage");
-        return false;
-    }
-}
+class WiFi101Net {
+    WiFiUDP udp;
+    WiFiClient client;
+    bool udp_started;
 
-/**
- * @brief  connects to a wifi network, call on startup
- */
-void setup_wifi()
-{
-    // attempt to connect to WiFi network:
-    while (status != WL_CONNECTED) {
-        Serial.print("Attempting to connect to: ");
-        Serial.println(ssid);
-        status = WiFi.begin(ssid, pass);
-        delay(10000);
+public:
+    WiFi101Net()
+    {
+        udp_started = false;
     }
-    Serial.println("Connected!");
-    bool connected = false;
-    while (!connected) {
-        if (connect_to_webpage()) {
-            Serial.println("fetched webpage");
-            connected = true;
-        } else {
-            Serial.println("failed to fetch webpage");
-        }
-        Serial.println();
+    /**
+     * @brief  starts the WINC1500, call on startup before setupWatchdog()
+     * @note   WiFi101 resets the chip and waits for its firmware to boot on the first call into it, a few hundred milliseconds,
+     *      longer than the watchdog's timeout. After that, WiFi.status() in connected() only handles the chip's events.
+     */
+    void begin()
+    {
+        WiFi.status();
     }
-}
-
-/**
- * @brief
- * @retval true if string containing time has been stored
- */
-bool read_webpage()
-{
-    int len = client.available();
-    if (len == 0) {
-        return false;
+    bool connected()
+    {
+        return WiFi.status() == WL_CONNECTED;
+    }
+    bool connect()
+    {
+        suspendWatchdog();
+        WiFi.setTimeout(wifi_connect_timeout);
+        bool result = WiFi.begin(ssid, pass) == WL_CONNECTED;
+        resumeWatchdog();
+        return result;
     }
-    memset(buffer, 0x0, sizeof(buffer));
-    unsigned int index = 0;
-    while (client.available()) {
-        char c = client.read(); // read data from webpage
-        buffer[index] = c;
-        if (index < sizeof(buffer) - 1) { // prevent buffer overflow
-            index++;
+    uint32_t resolve(const char* host)
+    {
+        IPAddress ip;
+        suspendWatchdog();
+        bool result = WiFi.hostByName(host, ip) == 1;
+        resumeWatchdog();
+        return result ? (uint32_t)ip : 0;
+    }
+    bool sendUdp(uint32_t ip, uint16_t port, const uint8_t* data, uint8_t length)
+    {
+        if (!udp_started) {
+            udp_started = udp.begin(ntp_local_port);
         }
+        return udp_started && udp.beginPacket(IPAddress(ip), port) && udp.write(data, length) == length && udp.endPacket();
     }
-    timeSinceStart = millis();
-    Serial.println("Content received");
-    if (index > 0) {
-        Serial.println();
-        noInterrupts();
-        char* response = strstr(buffer, "datetime");
-        if (response) {
-            memset(startTimeBuf, 0x0, sizeof(startTimeBuf));
-            int i = 22;
-            int k = 0;
-            while (i <= 29) { // read the part of the response containing the time into a smaller buffer
-                startTimeBuf[k] = response[i];
-                i++;
-                k++;
-            }
-        } else {
-            return false; // "datetime" not found in response
+    int receiveUdp(uint8_t* data, uint8_t size)
+    {
+        if (udp.parsePacket() <= 0) {
+            return 0;
         }
-        interrupts();
-        delay(500); // don't spam the API too fast if webpage_read takes more than one attempt
-    } else {
-        return false; // no data read; index==0
+        return udp.read(data, size);
     }
-    return true;
-}
+    bool openTcp(const char* host, uint16_t port)
+    {
+        suspendWatchdog();
+        bool result = client.connect(host, port);
+        resumeWatchdog();
+        return result;
+    }
+    void writeTcp(const char* text)
+    {
+        client.print(text);
+    }
+    int readTcp()
+    {
+        return client.available() ? client.read() : -1;
+    }
+    bool tcpOpen()
+    {
+        return client.connected() || client.available();
+    }
+    void closeTcp()
+    {
+        client.stop();
+    }
+};
 
-/**
- * @brief converts a string representation of time to an integer value of seconds
- * @param  t: char* string representing time, must be 8 characters, ex: 16:31:02
- * @retval integer value of seconds since midnight.
- */
-int stringToTimeInt(char* t)
-{
-    char hours[2];
-    char mins[2];
-    char secs[2];
-    hours[0] = t[0];
-    hours[1] = t[1];
-    mins[0] = t[3];
-    mins[1] = t[4];
-    secs[0] = t[6];
-    secs[1] = t[7];
-    int hoursInt = atoi(hours);
-    int minsInt = atoi(mins);
-    int secsInt = atoi(secs);
-    return (hoursInt * 60 * 60) + (minsInt * 60) + secsInt;
-}
+const TimeSyncParameters time_sync_parameters = {
+    "pool.ntp.org",
+    "worldtimeapi.org",
+    "/api/timezone/America/New_York",
+    -5 * 3600, // Eastern Standard Time, until the API has been asked
+    1000, // wait a second for an SNTP reply
+    3, // before asking the API instead
+    5000,
+    3600, // resync every hour
+    60, // or a minute after a failure
+    SECONDS_PER_DAY, // daylight saving time starts and ends at night, a day late at the latest
+};
+WiFi101Net wifiNet;
+TimeSync<WiFi101Net> timeSync(wifiNet, time_sync_parameters);
+TimeOfDayText timeOfDayText;
 
 /**
- * @brief connects to wifi and saves a string representing the time.
- * @note blocks until wifi connects and webpage returns a good response
- * @retval pointer to global variable that contains the time represented as a string
+ * @brief  takes the next step of timeSync, call when it asks to be
+ * @param  can_block: true if it's fine for this to take a few seconds (ex: the motor is off)
+ * @retval milliseconds until this should be called again
  */
-void getStartTime()
+uint32_t updateTimeSync(bool can_block)
 {
-    setup_wifi();
-    while (!read_webpage())
-        ;
+    return timeSync.update(readRtcTicks(), can_block);
 }
 
 /**
- * @brief This function uses millis() to calculate the current time without any more connections to a time API.
- * @retval pointer to global variable string containing the current time in 24 hour time
+ * @brief  the current time from the RTC, without any more connections to a time API
+ * @note   the text is only rewritten when the second changes, calling this every frame is cheap
+ * @retval string containing the current time in 24 hour time, valid until the next call, --:--:-- until the time has been fetched
  */
-char* getCurrentTime()
+const char* getCurrentTime()
 {
-    int curMillis = millis();
-    int millisInDay = 24 * 60 * 60 * 1000;
-    if (timeSinceStart > (millisInDay)) {
-        timeSinceStart = timeSinceStart % millisInDay;
+    if (!timeSync.synced()) {
+        return "--:--:--";
     }
-    int curTime = stringToTimeInt(startTimeBuf) + ((curMillis)-timeSinceStart) / 1000;
-    int hours = curTime / 60 / 60;
-    int mins = (curTime / 60) - (hours * 60);
-    int secs = curTime - (hours * 60 * 60) - (mins * 60);
-    sprintf(timeBuf, "%02d:%02d:%02d", hours % 24, mins, secs);
-    return timeBuf;
+    return timeOfDayText.text(timeSync.localSeconds(readRtcTicks()));
 }
-#endif
\ No newline at end of file
+#endif
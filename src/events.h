@@ -0,0 +1,206 @@
+/**
+ * events.h contains the event queue that loop() runs on: ISRs push events into it, deadlines are armed for times in the future,
+ * and loop() takes one event at a time and runs its handler to completion. When there's nothing to do the core sleeps until the next interrupt
+ * instead of polling, and LoopStats measures how long it slept and how old each beam break was by the time the motor was updated.
+ */
+#ifndef EVENTS_H
+#define EVENTS_H
+#include "spsc.h"
+#include <Arduino.h>
+
+/**
+ * @brief  kinds of events, in the order loop() handles them when several are waiting
+ */
+enum class EventType : uint8_t {
+    BEAM_BREAK, // value is the readTimer32() ticks of the beam break
+    BUTTON, // id is the ButtonPress
+    ADC_COMPLETE, // value is the conversion's result
+    DEADLINE // id is the deadline that expired, value is when it was due (micros)
+};
+
+/**
+ * @brief  one event, copied through the queue
+ */
+struct Event {
+    EventType type;
+    uint8_t id;
+    uint32_t value;
+};
+
+/**
+ * @brief  Events from ISRs and deadlines, taken one at a time by loop().
+ * @note   Each source has its own SpscRing, so ISRs of different priorities never push into the same ring. A source has to be a single
+ *      producer, ex: every pin's ISR runs from EIC_Handler, so the beam break and button ISRs can share a source.
+ *      Sources are taken in order (source 0 first), then expired deadlines, earliest first. Deadlines are only used by loop(), no ISR touches them.
+ * @param  sources: number of ISR sources
+ * @param  deadlines: number of deadlines, at most 32
+ * @param  ring_size: slots in each source's ring, a power of 2
+ */
+template <uint8_t sources, uint8_t deadlines, uint16_t ring_size>
+class EventQueue {
+    static_assert(deadlines <= 32, "armed deadlines are a bit mask");
+
+    SpscRing<Event, ring_size> rings[sources];
+    unsigned long due[deadlines];
+    uint32_t armed; // bit i is set while deadline i is armed
+
+public:
+    EventQueue()
+    {
+        armed = 0;
+        for (uint8_t i = 0; i < deadlines; i++) {
+            due[i] = 0;
+        }
+    }
+    /**
+     * @brief  call from the source's ISR (or from loop() for a source only loop() pushes to)
+     * @retval false if the source's ring was full and the event was dropped
+     */
+    bool push(uint8_t source, const Event& event)
+    {
+        return rings[source].push(event);
+    }
+    /**
+     * @brief  call from loop(), deadline id expires at due_micros (replacing the time it was armed for)
+     */
+    void arm(uint8_t id, unsigned long due_micros)
+    {
+        due[id] = due_micros;
+        armed |= (uint32_t)1 << id;
+    }
+    /**
+     * @brief  call from loop(), deadline id won't expire until it is armed again
+     */
+    void disarm(uint8_t id)
+    {
+        armed &= ~((uint32_t)1 << id);
+    }
+    /**
+     * @brief  true if deadline id is armed
+     */
+    bool isArmed(uint8_t id)
+    {
+        return armed & ((uint32_t)1 << id);
+    }
+    /**
+     * @brief  Call from loop(), takes the next event. An expired deadline is disarmed, its handler can arm it again.
+     * @param  event: set to the event when this returns true
+     * @param  micros: the current time
+     * @retval false if there are no events and no deadline has expired, loop() can sleep
+     */
+    bool next(Event& event, unsigned long micros)
+    {
+        for (uint8_t s = 0; s < sources; s++) {
+            if (rings[s].pop(event)) {
+                return true;
+            }
+        }
+        int earliest = -1;
+        for (uint8_t i = 0; i < deadlines; i++) {
+            if (isArmed(i) && (long)(micros - due[i]) >= 0 && (earliest == -1 || (long)(due[i] - due[earliest]) < 0)) {
+                earliest = i;
+            }
+        }
+        if (earliest == -1) {
+            return false;
+        }
+        disarm(earliest);
+        event = { EventType::DEADLINE, (uint8_t)earliest, (uint32_t)due[earliest] };
+        return true;
+    }
+    /**
+     * @brief  true if an ISR has queued an event that next() hasn't taken, deadlines aren't counted
+     */
+    bool hasEvents()
+    {
+        for (uint8_t s = 0; s < sources; s++) {
+            if (rings[s].available() != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+    /**
+     * @brief  events dropped because their source's ring was full, over all sources
+     */
+    uint32_t dropped()
+    {
+        uint32_t total = 0;
+        for (uint8_t s = 0; s < sources; s++) {
+            total += rings[s].dropped();
+        }
+        return total;
+    }
+};
+
+/**
+ * @brief  Idle time and control latency of loop(), over a window that report() starts again.
+ * @note   All times are in the ticks of readTimer32(), microseconds. Only used by loop().
+ */
+class LoopStats {
+    uint32_t window_start;
+    uint32_t idle_ticks;
+    uint32_t latency_sum;
+    uint32_t latency_max;
+    uint16_t latency_samples;
+
+public:
+    /**
+     * @brief  idle time and latencies of a finished window
+     */
+    struct Report {
+        uint16_t idle_permille; // thousandths of the window that the core was asleep
+        uint32_t latency_mean; // ticks from a beam break to the motor being updated from it
+        uint32_t latency_max;
+        uint16_t latency_samples;
+    };
+
+    LoopStats()
+    {
+        start(0);
+    }
+    /**
+     * @brief  starts a new window at now
+     */
+    void start(uint32_t now)
+    {
+        window_start = now;
+        idle_ticks = 0;
+        latency_sum = 0;
+        latency_max = 0;
+        latency_samples = 0;
+    }
+    /**
+     * @brief  call after sleeping, with the ticks slept
+     */
+    void addIdle(uint32_t ticks)
+    {
+        idle_ticks += ticks;
+    }
+    /**
+     * @brief  call once the motor has been updated from a measurement, with the ticks since the measurement was made
+     */
+    void addLatency(uint32_t ticks)
+    {
+        latency_sum += ticks;
+        latency_max = max(latency_max, ticks);
+        latency_samples++;
+    }
+    /**
+     * @brief  the window from start() until now, and starts the next one
+     */
+    Report report(uint32_t now)
+    {
+        uint32_t window = max(now - window_start, (uint32_t)1);
+        Report result = {
+            (uint16_t)min((uint64_t)idle_ticks * 1000 / window, (uint64_t)1000),
+            latency_samples ? latency_sum / latency_samples : 0,
+            latency_max,
+            latency_samples,
+        };
+        start(now);
+        return result;
+    }
+};
+
+#endif // EVENTS_H
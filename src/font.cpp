@@ -2,6 +2,115 @@
  * font.cpp contains functions for printing characters to an array, using a font defined in font.h
  */
 #include "font.h"
+
+const uint8_t glyph_width = 6; // 5 columns of font and 1 column of spacing between characters
+
+/**
+ * @brief  the columns of one character, with the blank spacing column after it included
+ * @note   unlike font[], bit y of each column is pixel y (counting from the top), so a column can be drawn by shifting the mask right
+ */
+struct GlyphColumns {
+    uint8_t column[glyph_width];
+};
+
+/**
+ * @brief  reverses the order of the bits in a byte at compile time, (written recursively because constexpr functions in C++11 can only have a return statement)
+ */
+constexpr uint8_t reverseBits(uint8_t b, uint8_t bits_left = 8, uint8_t result = 0)
+{
+    return bits_left == 0 ? result : reverseBits(b >> 1, bits_left - 1, (result << 1) | (b & 1));
+}
+
+/**
+ * @brief  builds the GlyphColumns of character c from font[] at compile time
+ */
+constexpr GlyphColumns expandGlyph(unsigned int c)
+{
+    return GlyphColumns { { reverseBits(font[c * 5 + 0]), reverseBits(font[c * 5 + 1]), reverseBits(font[c * 5 + 2]),
+        reverseBits(font[c * 5 + 3]), reverseBits(font[c * 5 + 4]), 0 } };
+}
+
+// compile time list of the numbers 0 to N-1, used to call expandGlyph once for every character (C++11 doesn't have std::index_sequence)
+template <unsigned int... Is>
+struct GlyphIndices {
+};
+template <unsigned int N, unsigned int... Is>
+struct MakeGlyphIndices : MakeGlyphIndices<N - 1, N - 1, Is...> {
+};
+template <unsigned int... Is>
+struct MakeGlyphIndices<0, Is...> {
+    typedef GlyphIndices<Is...> type;
+};
+
+/**
+ * @brief  table of the expanded columns of every character, generated from font[] at compile time and stored in flash
+ */
+template <typename Indices>
+struct GlyphTable;
+template <unsigned int... Is>
+struct GlyphTable<GlyphIndices<Is...>> {
+    static constexpr GlyphColumns glyphs[sizeof...(Is)] = { expandGlyph(Is)... };
+};
+template <unsigned int... Is>
+constexpr GlyphColumns GlyphTable<GlyphIndices<Is...>>::glyphs[sizeof...(Is)];
+
+static_assert(sizeof(font) == 256 * 5, "font[] must have 5 columns for each of the 256 characters");
+typedef GlyphTable<MakeGlyphIndices<256>::type> glyph_table;
+
+/**
+ * @brief  writes a whole column of 8 pixels in one pass, without branching on each pixel
+ * @param  column[8]: pixels to write
+ * @param  mask: bit y chooses the color of pixel y (counting from the top)
+ * @param  colors[2]: colors[0] is used where the mask is 0 (background), colors[1] where it is 1 (foreground)
+ */
+void blitColumn(CRGB column[8], uint8_t mask, const CRGB colors[2])
+{
+    column[0] = colors[mask & 1];
+    column[1] = colors[(mask >> 1) & 1];
+    column[2] = colors[(mask >> 2) & 1];
+    column[3] = colors[(mask >> 3) & 1];
+    column[4] = colors[(mask >> 4) & 1];
+    column[5] = colors[(mask >> 5) & 1];
+    column[6] = colors[(mask >> 6) & 1];
+    column[7] = colors[(mask >> 7) & 1];
+}
+
+/**
+ * @brief  same as the CRGB version of blitColumn(), but writes the colors already encoded for the APA102 LEDs
+ */
+void blitColumn(Apa102Column& column, uint8_t mask, const CRGB colors[2])
+{
+    column.set(0, colors[mask & 1]);
+    column.set(1, colors[(mask >> 1) & 1]);
+    column.set(2, colors[(mask >> 2) & 1]);
+    column.set(3, colors[(mask >> 3) & 1]);
+    column.set(4, colors[(mask >> 4) & 1]);
+    column.set(5, colors[(mask >> 5) & 1]);
+    column.set(6, colors[(mask >> 6) & 1]);
+    column.set(7, colors[(mask >> 7) & 1]);
+}
+
+/**
+ * @brief  prints glyphs of a string into an image, starting at a column that has already been wrapped into [0, width)
+ * @param  Column: CRGB[8], Apa102Column or PaletteColumn, anything blitColumn() can write
+ * @param  Color: CRGB, or a palette index for a PaletteColumn
+ * @retval the column after the last one printed, wrapped into [0, width)
+ */
+template <typename Column, typename Color>
+static int printGlyphs(const byte* str, unsigned int count, int column, const Color colors[2], Column image[], int width)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        const uint8_t* glyph = glyph_table::glyphs[str[i]].column;
+        for (int x = 0; x < glyph_width; x++) {
+            blitColumn(image[column], glyph[x], colors);
+            if (++column == width) {
+                column = 0;
+            }
+        }
+    }
+    return column;
+}
+
 /**
  * @brief  prints a character to a given image array using a 5x8 font
  * @param  c: byte (0-255) value representing character to display. In addition to the standard ASCII values for letters, font.h defines symbols for all other values.
@@ -14,21 +123,15 @@
  */
 void printChar(byte c, long x_pos, CRGB foreground, CRGB background, CRGB image[][8], int width)
 {
-    for (int x = 0; x < 6; x++) { // assumes characters are 5 wide
-        int column = (((x_pos % width) + width + x) % width); // wraps around to within [0,width) even if x_pos is negative
-        for (int y = 0; y < 8; y++) { // assumes screen is 8 characters tall
-            if (x < 5)
-                image[column][y] = bitRead(font[c * 5 + x], 7 - y) ? foreground : background;
-            else // spacing between characters
-                image[column][y] = background;
-        }
-    }
+    const CRGB colors[2] = { background, foreground };
+    int column = ((x_pos % width) + width) % width; // wraps around to within [0,width) even if x_pos is negative
+    printGlyphs(&c, 1, column, colors, image, width);
 }
 
 /**
  * @brief  prints a string of characters to an array of pixels
  * @note  prints characters from left to right, because of how printChar() works, individual characters will be split when wrapping from the end to the beginning of the image array
- * @param  str: char* (null terminated string) to print
+ * @param  str: char* (null terminated string) to print, the null character is printed too (as a blank character)
  * @param  x_pos: what x coordinate (column) of the image array should the first column of the first character be printed into? if >=width, it is wrapped around to the start of the array inside this function.
  * @param  foreground: CRGB or CHSV (FastLED) color for the foreground of the character
  * @param  background: CRGB or CHSV (FastLED) color for the background of the character
@@ -36,9 +139,59 @@ void printChar(byte c, long x_pos, CRGB foreground, CRGB background, CRGB image[
  * @param  width: first dimension of the image array.
  * @retval void
  */
-void printString(char* str, long x_pos, CRGB foreground, CRGB background, CRGB image[][8], int width)
+void printString(const char* str, long x_pos, CRGB foreground, CRGB background, CRGB image[][8], int width)
 {
-    for (unsigned int i = 0; i <= strlen(str); i++) {
-        printChar((byte)str[i], x_pos + i * 6 /*char spacing*/, foreground, background, image, width);
-    }
+    const CRGB colors[2] = { background, foreground };
+    int column = ((x_pos % width) + width) % width; // wrap once for the whole string, printGlyphs only has to compare against width
+    printGlyphs((const byte*)str, strlen(str) + 1, column, colors, image, width);
+}
+
+/**
+ * @brief  same as the CRGB version of printChar(), but prints into an image that is already encoded for the APA102 LEDs
+ */
+void printChar(byte c, long x_pos, CRGB foreground, CRGB background, Apa102Column image[], int width)
+{
+    const CRGB colors[2] = { background, foreground };
+    int column = ((x_pos % width) + width) % width;
+    printGlyphs(&c, 1, column, colors, image, width);
+}
+
+/**
+ * @brief  same as the CRGB version of printString(), but prints into an image that is already encoded for the APA102 LEDs
+ */
+void printString(const char* str, long x_pos, CRGB foreground, CRGB background, Apa102Column image[], int width)
+{
+    const CRGB colors[2] = { background, foreground };
+    int column = ((x_pos % width) + width) % width;
+    printGlyphs((const byte*)str, strlen(str) + 1, column, colors, image, width);
 }
+
+/**
+ * @brief  same as the CRGB version of printChar(), but prints palette indices into an image of PaletteColumn
+ */
+template <uint8_t bits>
+void printChar(byte c, long x_pos, uint8_t foreground, uint8_t background, PaletteColumn<bits> image[], int width)
+{
+    const uint8_t colors[2] = { background, foreground };
+    int column = ((x_pos % width) + width) % width;
+    printGlyphs(&c, 1, column, colors, image, width);
+}
+
+/**
+ * @brief  same as the CRGB version of printString(), but prints palette indices into an image of PaletteColumn
+ */
+template <uint8_t bits>
+void printString(const char* str, long x_pos, uint8_t foreground, uint8_t background, PaletteColumn<bits> image[], int width)
+{
+    const uint8_t colors[2] = { background, foreground };
+    int column = ((x_pos % width) + width) % width;
+    printGlyphs((const byte*)str, strlen(str) + 1, column, colors, image, width);
+}
+
+// the glyph table is only in this file, so the palette versions are compiled here for each number of bits per pixel
+template void printChar<1>(byte c, long x_pos, uint8_t foreground, uint8_t background, PaletteColumn<1> image[], int width);
+template void printChar<2>(byte c, long x_pos, uint8_t foreground, uint8_t background, PaletteColumn<2> image[], int width);
+template void printChar<4>(byte c, long x_pos, uint8_t foreground, uint8_t background, PaletteColumn<4> image[], int width);
+template void printString<1>(const char* str, long x_pos, uint8_t foreground, uint8_t background, PaletteColumn<1> image[], int width);
+template void printString<2>(const char* str, long x_pos, uint8_t foreground, uint8_t background, PaletteColumn<2> image[], int width);
+template void printString<4>(const char* str, long x_pos, uint8_t foreground, uint8_t background, PaletteColumn<4> image[], int width);
@@ -6,18 +6,29 @@
 #ifndef FONT_H
 #define FONT_H
 
+#include "apa102.h"
+#include "palette.h"
 #include <Arduino.h>
 #include <FastLED.h>
 
 // see font.cpp
-void printString(char* str, long x_pos, CRGB foreground, CRGB background, CRGB image[][8], int width);
+void printString(const char* str, long x_pos, CRGB foreground, CRGB background, CRGB image[][8], int width);
+void printString(const char* str, long x_pos, CRGB foreground, CRGB background, Apa102Column image[], int width);
 void printChar(byte c, long x_pos, CRGB foreground, CRGB background, CRGB image[][8], int width);
+void printChar(byte c, long x_pos, CRGB foreground, CRGB background, Apa102Column image[], int width);
+void blitColumn(CRGB column[8], uint8_t mask, const CRGB colors[2]);
+void blitColumn(Apa102Column& column, uint8_t mask, const CRGB colors[2]);
+template <uint8_t bits> // 1, 2 or 4, the colors are palette indices
+void printString(const char* str, long x_pos, uint8_t foreground, uint8_t background, PaletteColumn<bits> image[], int width);
+template <uint8_t bits>
+void printChar(byte c, long x_pos, uint8_t foreground, uint8_t background, PaletteColumn<bits> image[], int width);
 /**
 From experimenting (see font.cpp for our solution) we found that
 one character is represented by 5 bytes, which are the 5 columns of pixels each character has from left to right,
 and each byte's most significant bit is the bottom of the 8 pixel column and each byte's least significant bit is the top.
+@note constexpr so that font.cpp can expand it into a table of columns at compile time, this array is still the only copy of the font.
 */
-const char font[] = {
+constexpr char font[] = {
     // source: https://github.com/Ameba8195/Arduino/blob/cf5a864ee9011da6c294bebbf38167b2ded6dc50/hardware_v2/cores/arduino/font5x7.h
     0x00, 0x00, 0x00, 0x00, 0x00, // 0x00 (nul)
     0x3E, 0x5B, 0x4F, 0x5B, 0x3E, // 0x01 (soh)
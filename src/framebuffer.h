@@ -0,0 +1,131 @@
+/**
+ * framebuffer.h contains a triple buffered image, so loop() can draw the next frame while the timer ISR displays the current one.
+ * Handing a finished frame to the display only swaps a one byte index, no pixels are copied in interrupt context.
+ */
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+#include <Arduino.h>
+
+/**
+ * @brief  Three images that rotate between being drawn (back), waiting to be displayed (ready), and being displayed (front).
+ * @note   loop() owns the back buffer and the ISRs own the front buffer. The ready buffer is passed between them by swapping a single byte,
+ *      so publish() and flip() take the same time no matter how wide the image is, and a half drawn frame is never displayed.
+ * @param  Column: type of one column of pixels, ex: CRGB[8]
+ * @param  width: number of columns in each image
+ */
+template <typename Column, int width>
+class TripleBuffer {
+    static const uint8_t INDEX_MASK = 0x03;
+    static const uint8_t NEW_FRAME = 0x04; // set in ready when it holds a frame that hasn't been displayed yet
+
+    Column buffers[3][width];
+    int scroll[3]; // for each image, which of its columns is displayed first after a beam break
+    uint8_t back; // only used by loop()
+    uint8_t front; // only used by ISRs
+    volatile uint8_t ready; // index of the ready buffer, or'ed with NEW_FRAME
+    uint32_t skipped; // only changed by publish()
+    volatile uint32_t stale; // only changed by flip()
+
+public:
+    TripleBuffer()
+    {
+        back = 0;
+        front = 1;
+        ready = 2;
+        scroll[0] = scroll[1] = scroll[2] = 0;
+        skipped = 0;
+        stale = 0;
+    }
+    /**
+     * @brief  which of the three images drawBuffer() currently is (0-2), lets a renderer remember what it drew into each one
+     */
+    uint8_t drawIndex()
+    {
+        return back;
+    }
+    /**
+     * @brief  image that loop() should draw the next frame into
+     */
+    Column* drawBuffer()
+    {
+        return buffers[back];
+    }
+    /**
+     * @brief  image that is currently being shown on the LEDs, only call from an ISR
+     */
+    const Column* displayBuffer()
+    {
+        return buffers[front];
+    }
+    /**
+     * @brief  which of the three images displayBuffer() currently is (0-2), only call from an ISR
+     */
+    uint8_t displayIndex()
+    {
+        return front;
+    }
+    /**
+     * @brief  one of the three images by index, for hardware (ex: DMA) that needs to know where all of them are ahead of time
+     */
+    const Column* image(uint8_t index)
+    {
+        return buffers[index];
+    }
+    /**
+     * @brief  which column of displayBuffer() should be shown first after a beam break, only call from an ISR
+     */
+    int displayScroll()
+    {
+        return scroll[front];
+    }
+    /**
+     * @brief  call from loop() once a frame has been completely drawn into drawBuffer(), the next flip() will display it.
+     * @note   drawBuffer() points to a different image afterwards, its contents are whatever frame was in there before.
+     * @param  scroll_columns: [0, width) column of the image to display first, lets text scroll without being redrawn
+     */
+    void publish(int scroll_columns = 0)
+    {
+        scroll[back] = scroll_columns;
+        // the M0+ has no atomic exchange instruction, so interrupts are masked for the two instructions that swap the index
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        uint8_t old_ready = ready;
+        ready = back | NEW_FRAME;
+        __set_PRIMASK(primask);
+        if (old_ready & NEW_FRAME) { // the last frame was never displayed
+            skipped++;
+        }
+        back = old_ready & INDEX_MASK;
+    }
+    /**
+     * @brief  call from an ISR when a new frame should start being displayed (ex: on a beam break). O(1), no pixels are copied.
+     * @retval true if a newly published frame is now being displayed, false if there was no new frame and the old one is kept
+     */
+    bool flip()
+    {
+        uint8_t old_ready = ready;
+        if (!(old_ready & NEW_FRAME)) {
+            stale = stale + 1;
+            return false;
+        }
+        ready = front;
+        front = old_ready & INDEX_MASK;
+        return true;
+    }
+    /**
+     * @brief  frames that publish() replaced before flip() displayed them, call from loop()
+     */
+    uint32_t framesSkipped()
+    {
+        return skipped;
+    }
+    /**
+     * @brief  calls of flip() that kept the old frame because there wasn't a new one
+     */
+    uint32_t staleFlips()
+    {
+        return stale;
+    }
+};
+
+#endif // FRAMEBUFFER_H
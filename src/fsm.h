@@ -0,0 +1,209 @@
+/**
+ * fsm.h contains a table driven state machine: each row of a transition table is a state, a guard, an action and the next state.
+ * The table is checked and indexed by state at compile time, so a dispatch only looks at the rows of the current state (a bounded number of guards)
+ * and every transition that changes the state is saved with a timestamp in a trace ring.
+ */
+#ifndef FSM_H
+#define FSM_H
+#include <Arduino.h>
+
+/**
+ * @brief  one row of a transition table
+ * @param  State: enum of states, with values from 0 to the number of states - 1
+ * @param  Input: what the guards and actions are given
+ */
+template <typename State, typename Input>
+struct FsmRow {
+    State from;
+    bool (*guard)(const Input&); // the row is taken if this returns true, nullptr to always take it
+    void (*action)(const Input&); // run when the row is taken, nullptr for none
+    State to;
+    const char* name; // ex: "1-2"
+};
+
+/**
+ * @brief  true if the rows are grouped by from in increasing order, calculated at compile time
+ */
+template <typename Row>
+constexpr bool fsmSorted(const Row* rows, size_t size, size_t i = 1)
+{
+    return i >= size || ((int)rows[i - 1].from <= (int)rows[i].from && fsmSorted(rows, size, i + 1));
+}
+/**
+ * @brief  true if the last row of every state has no guard, so a dispatch always takes a row
+ */
+template <typename Row>
+constexpr bool fsmEndsUnguarded(const Row* rows, size_t size, size_t i = 0)
+{
+    return i >= size || ((rows[i].guard == nullptr || (i + 1 < size && rows[i + 1].from == rows[i].from)) && fsmEndsUnguarded(rows, size, i + 1));
+}
+/**
+ * @brief  index of the first row whose from is state or higher, size if there isn't one
+ */
+template <typename Row>
+constexpr uint8_t fsmFirstRow(const Row* rows, size_t size, int state, size_t i = 0)
+{
+    return (i >= size || (int)rows[i].from >= state) ? i : fsmFirstRow(rows, size, state, i + 1);
+}
+/**
+ * @brief  highest number of rows of a state, the most guards a dispatch can check
+ */
+template <typename Row>
+constexpr uint8_t fsmMaxRows(const Row* rows, size_t size, int states, int state = 0)
+{
+    return state >= states ? 0
+                           : (fsmFirstRow(rows, size, state + 1) - fsmFirstRow(rows, size, state) > fsmMaxRows(rows, size, states, state + 1)
+                                   ? fsmFirstRow(rows, size, state + 1) - fsmFirstRow(rows, size, state)
+                                   : fsmMaxRows(rows, size, states, state + 1));
+}
+
+// compile time list of the states 0 to N-1, used to build the index (C++11 doesn't have std::integer_sequence)
+template <int... Is>
+struct FsmStates {
+};
+template <int N, int... Is>
+struct MakeFsmStates : MakeFsmStates<N - 1, N - 1, Is...> {
+};
+template <int... Is>
+struct MakeFsmStates<0, Is...> {
+    typedef FsmStates<Is...> type;
+};
+
+/**
+ * @brief  first[state] to first[state + 1] are the rows of a state, generated at compile time and stored in flash
+ */
+template <typename Row, const Row* rows, size_t size, typename States>
+struct FsmIndex;
+template <typename Row, const Row* rows, size_t size, int... Is>
+struct FsmIndex<Row, rows, size, FsmStates<Is...>> {
+    static constexpr uint8_t first[sizeof...(Is) + 1] = { fsmFirstRow(rows, size, Is)..., fsmFirstRow(rows, size, sizeof...(Is)) };
+};
+template <typename Row, const Row* rows, size_t size, int... Is>
+constexpr uint8_t FsmIndex<Row, rows, size, FsmStates<Is...>>::first[sizeof...(Is) + 1];
+
+/**
+ * @brief  a transition that changed the state
+ */
+struct FsmTraceEntry {
+    uint32_t micros;
+    uint8_t row; // index in the table, FSM_INVALID_ROW if the state was invalid
+    uint8_t from;
+    uint8_t to;
+};
+const uint8_t FSM_INVALID_ROW = 0xFF;
+
+/**
+ * @brief  Runs a transition table.
+ * @note   dispatch() checks the guards of the current state's rows in order and takes the first one that is true. A state outside the table
+ *      takes invalid_row. Only the last TRACE_SIZE transitions that changed the state are kept, self loops aren't traced.
+ */
+template <typename State, typename Input>
+class TableFsm {
+public:
+    typedef FsmRow<State, Input> Row;
+    static const uint8_t TRACE_SIZE = 16;
+
+private:
+    const Row* rows;
+    uint8_t size;
+    const uint8_t* first;
+    uint8_t states;
+    const Row& invalid_row;
+    uint8_t last_row;
+    FsmTraceEntry trace[TRACE_SIZE];
+    uint8_t trace_next;
+    uint32_t transitions;
+
+public:
+    /**
+     * @param  _rows: the table, checked with fsmSorted() and fsmEndsUnguarded()
+     * @param  _size: number of rows
+     * @param  _first: FsmIndex<...>::first
+     * @param  _states: number of states in the index
+     * @param  _invalid_row: taken (its guard isn't checked) when the state isn't in the table
+     */
+    TableFsm(const Row* _rows, uint8_t _size, const uint8_t* _first, uint8_t _states, const Row& _invalid_row)
+        : invalid_row(_invalid_row)
+    {
+        rows = _rows;
+        size = _size;
+        first = _first;
+        states = _states;
+        last_row = FSM_INVALID_ROW;
+        trace_next = 0;
+        transitions = 0;
+    }
+    /**
+     * @brief  takes a transition from state
+     * @param  state: the current state
+     * @param  input: passed to the guards and the action
+     * @param  micros: timestamp for the trace
+     * @retval the next state
+     */
+    State dispatch(State state, const Input& input, unsigned long micros)
+    {
+        const Row* row = &invalid_row;
+        last_row = FSM_INVALID_ROW;
+        uint8_t s = (uint8_t)state;
+        if (s < states) {
+            for (uint8_t i = first[s]; i < first[s + 1]; i++) {
+                if (rows[i].guard == nullptr || rows[i].guard(input)) {
+                    row = &rows[i];
+                    last_row = i;
+                    break;
+                }
+            }
+        }
+        if (row->action != nullptr) {
+            row->action(input);
+        }
+        if (row->to != state) {
+            trace[trace_next] = { (uint32_t)micros, last_row, s, (uint8_t)row->to };
+            trace_next = (trace_next + 1) % TRACE_SIZE;
+            transitions++;
+        }
+        return row->to;
+    }
+    /**
+     * @brief  index of the row the last dispatch() took, FSM_INVALID_ROW if it was invalid_row
+     */
+    uint8_t lastRow()
+    {
+        return last_row;
+    }
+    /**
+     * @brief  a row of the table, for tests and printing the trace
+     */
+    const Row& row(uint8_t index)
+    {
+        return index < size ? rows[index] : invalid_row;
+    }
+    /**
+     * @brief  number of rows in the table
+     */
+    uint8_t rowCount()
+    {
+        return size;
+    }
+    /**
+     * @brief  transitions that changed the state since startup, the trace has the last TRACE_SIZE of them
+     */
+    uint32_t transitionCount()
+    {
+        return transitions;
+    }
+    /**
+     * @brief  a transition from the trace, 0 is the newest
+     * @retval false if there isn't one that old
+     */
+    bool traced(uint8_t age, FsmTraceEntry& entry)
+    {
+        if (age >= TRACE_SIZE || age >= transitions) {
+            return false;
+        }
+        entry = trace[(trace_next + TRACE_SIZE - 1 - age) % TRACE_SIZE];
+        return true;
+    }
+};
+
+#endif // FSM_H
@@ -11,21 +11,41 @@ enum State {
     s02_WAIT = 2,
     s03_SPINNING_UP = 3,
     s04_RUNNING = 4,
-    s05_SPINNING_DOWN = 5
+    s05_SPINNING_DOWN = 5,
+    s06_AUTO_TUNING = 6
 };
-volatile State state;
+State state; // only used by loop(), the ISRs check displaying instead
 
 /**
  * @brief  struct containing inputs to our FSM
  */
 struct FsmInput {
-    volatile unsigned long micros;
-    volatile bool start_button;
-    volatile bool stop_button;
-    volatile unsigned long rotation_interval;
-    volatile unsigned long last_beam_break;
-    volatile float bat_volt;
+    unsigned long micros;
+    bool start_button;
+    bool stop_button;
+    unsigned long rotation_interval;
+    uint32_t rotation_jitter; // microseconds, see RotationEstimator::jitter()
+    unsigned long last_beam_break;
+    float bat_volt;
+};
+FsmInput fsm_input; // only used by loop(), the ISRs pass it what they measured through spsc.h
+
+/**
+ * @brief  a press of one of the buttons, queued by its ISR for loop() to run the FSM with
+ */
+enum class ButtonPress : uint8_t {
+    START,
+    STOP
+};
+
+/**
+ * @brief  what beamBreakIsr measured at the last beam break, published to loop() as a whole
+ */
+struct RotationSnapshot {
+    unsigned long last_beam_break; // micros()
+    uint32_t interval; // filtered rotation interval in microseconds, 0 if there isn't one yet
+    uint32_t predicted_interval; // expected interval of the revolution that started at last_beam_break, 0 if there isn't one yet
+    uint32_t jitter; // microseconds, see RotationEstimator::jitter()
 };
-FsmInput fsm_input;
 
 #endif // FSM_TYPES_H
@@ -0,0 +1,175 @@
+/**
+ * ir_direction.h contains an estimator of the direction an IR remote is pointed at the clock from, as a column of the image.
+ * Every column the IR receiver sees light in adds that column's unit vector to running sums, and the direction is the angle of the sum
+ * (a circular mean: https://en.wikipedia.org/wiki/Circular_mean). Adding a hit and reading the direction are both O(1).
+ */
+#ifndef IR_DIRECTION_H
+#define IR_DIRECTION_H
+#include <Arduino.h>
+
+/**
+ * @brief  sin(x) from its Taylor series, for x between -pi and pi, calculated at compile time
+ */
+constexpr double irSineSeries(double x_squared, double term, int k, int terms)
+{
+    return terms == 0 ? 0 : term + irSineSeries(x_squared, -term * x_squared / ((2 * k) * (2 * k + 1)), k + 1, terms - 1);
+}
+constexpr double irSine(double x)
+{
+    return irSineSeries(x * x, x, 1, 14);
+}
+constexpr double irWrap(double angle)
+{
+    return angle > PI ? angle - TWO_PI : angle;
+}
+constexpr int16_t irRoundQ15(double value)
+{
+    return (int16_t)(value * 32767 + (value >= 0 ? 0.5 : -0.5));
+}
+/**
+ * @brief  sin(2 pi column / width + phase) with 15 fraction bits
+ */
+constexpr int16_t irSineQ15(int column, int width, double phase)
+{
+    return irRoundQ15(irSine(irWrap(TWO_PI * column / width + phase)));
+}
+
+// compile time list of the columns 0 to N-1, used to fill the tables (C++11 doesn't have std::integer_sequence)
+template <int... Is>
+struct IrColumns {
+};
+template <int N, int... Is>
+struct MakeIrColumns : MakeIrColumns<N - 1, N - 1, Is...> {
+};
+template <int... Is>
+struct MakeIrColumns<0, Is...> {
+    typedef IrColumns<Is...> type;
+};
+
+/**
+ * @brief  unit vector of every column, generated at compile time and stored in flash
+ */
+template <int width, typename Columns>
+struct IrVectorTable;
+template <int width, int... Is>
+struct IrVectorTable<width, IrColumns<Is...>> {
+    static constexpr int16_t cosines[sizeof...(Is)] = { irSineQ15(Is, width, HALF_PI)... };
+    static constexpr int16_t sines[sizeof...(Is)] = { irSineQ15(Is, width, 0)... };
+};
+template <int width, int... Is>
+constexpr int16_t IrVectorTable<width, IrColumns<Is...>>::cosines[sizeof...(Is)];
+template <int width, int... Is>
+constexpr int16_t IrVectorTable<width, IrColumns<Is...>>::sines[sizeof...(Is)];
+
+/**
+ * @brief  angle of the vector (x, y) as a fraction of a turn, 0 to 65535 counterclockwise from the x axis, 0 if both are 0
+ * @note   One divide, and atan(t) ~= pi/4 t + 0.273 t (1 - t) for 0 <= t <= 1 (within 0.22 degrees, less than a tenth of a column)
+ */
+uint16_t integerAtan2(int32_t y, int32_t x)
+{
+    if (x == 0 && y == 0) {
+        return 0;
+    }
+    uint32_t abs_x = (x < 0) ? -(int64_t)x : x;
+    uint32_t abs_y = (y < 0) ? -(int64_t)y : y;
+    bool steep = abs_y > abs_x; // reflect into the first octant, where t = small / large is at most 1
+    uint32_t t = ((uint64_t)(steep ? abs_x : abs_y) << 15) / (steep ? abs_y : abs_x); // 15 fraction bits
+    uint32_t angle = (t * (8192 + ((2847 * (32768 - t)) >> 15))) >> 15; // 8192 is pi/4, 2847 is 0.273 radians
+    if (steep) {
+        angle = 16384 - angle;
+    }
+    if (x < 0) {
+        angle = 32768 - angle;
+    }
+    if (y < 0) {
+        angle = 65536 - angle;
+    }
+    return angle;
+}
+
+/**
+ * @brief  Circular mean of the columns that IR light was seen in, over the current burst of light from the remote.
+ * @note   Not safe to call from an ISR: readIrRemote() adds the hits from loop(), which also reads the direction and resets it.
+ * @param  width: number of columns in a rotation
+ */
+template <int width>
+class IrDirection {
+public:
+    static const uint16_t MIN_HITS = 10; // hits in a burst before it has a direction
+    static const uint32_t BURST_GAP = 400000; // microseconds without a hit that end a burst, the next hit starts a new one
+    static const uint16_t MAX_HITS = 32768; // the sums are halved at this many hits so they can't overflow, the mean stays the same
+
+private:
+    typedef IrVectorTable<width, typename MakeIrColumns<width>::type> vectors;
+
+    int32_t sum_x;
+    int32_t sum_y;
+    uint16_t hits;
+    unsigned long last_hit;
+    bool changed; // hits were added since direction() last returned a direction
+
+public:
+    IrDirection()
+    {
+        sum_x = 0;
+        sum_y = 0;
+        hits = 0;
+        last_hit = 0;
+        changed = false;
+    }
+    /**
+     * @brief  call when IR light is seen
+     * @param  column: the column being displayed, 0 to width - 1
+     * @param  micros: the current time
+     */
+    void addHit(int column, unsigned long micros)
+    {
+        column = constrain(column, 0, width - 1);
+        if (micros - last_hit > BURST_GAP) { // a new burst
+            sum_x = 0;
+            sum_y = 0;
+            hits = 0;
+        } else if (hits >= MAX_HITS) {
+            sum_x /= 2;
+            sum_y /= 2;
+            hits /= 2;
+        }
+        sum_x += vectors::cosines[column];
+        sum_y += vectors::sines[column];
+        hits++;
+        last_hit = micros;
+        changed = true;
+    }
+    /**
+     * @brief  forgets the current burst, ex: when the image starts being displayed
+     */
+    void reset()
+    {
+        sum_x = 0;
+        sum_y = 0;
+        hits = 0;
+        changed = false;
+    }
+    /**
+     * @brief  direction of the current burst, if it has changed since the last call
+     * @retval column of the image in the direction of the remote, or -1 if there isn't a new direction
+     *      (no new hits, fewer than MIN_HITS in the burst, or hits all around that cancel out)
+     */
+    int direction()
+    {
+        if (!changed || hits < MIN_HITS || (sum_x == 0 && sum_y == 0)) {
+            return -1;
+        }
+        changed = false;
+        return (((uint32_t)integerAtan2(sum_y, sum_x) * width + 32768) >> 16) % width; // rounded to the nearest column
+    }
+    /**
+     * @brief  micros when the last hit was added
+     */
+    unsigned long lastHit()
+    {
+        return last_hit;
+    }
+};
+
+#endif // IR_DIRECTION_H
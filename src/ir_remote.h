@@ -0,0 +1,168 @@
+/**
+ * ir_remote.h contains the IR receiver's input: an interrupt on every edge of the receiver's output saves a timestamp into an SpscRing (spsc.h),
+ * and loop() decodes the edges into NEC frames (the protocol most remotes use) without waiting for a frame to finish.
+ * Each frame also has the column of the image that was being displayed when it started, which is the direction of the remote.
+ */
+#ifndef IR_REMOTE_H
+#define IR_REMOTE_H
+#include <Arduino.h>
+
+/**
+ * @brief  one edge of the IR receiver's output
+ */
+struct IrEdge {
+    uint32_t ticks; // readTimer32() when the edge happened
+    bool light; // the receiver started seeing the remote's carrier (its output went low), false if it stopped
+    int16_t column; // column being displayed, -1 if the image isn't being displayed
+};
+
+/**
+ * @brief  a decoded NEC frame
+ */
+struct NecFrame {
+    uint16_t address; // 8 bit address in the low byte and its inverse in the high byte, or a 16 bit extended address
+    uint8_t command;
+    bool repeat; // the key is held down, address and command are the ones of the last frame
+    int16_t column; // column being displayed when the frame's leader started, -1 if the image wasn't being displayed
+};
+
+/**
+ * @brief  Decodes NEC frames from the edges of an IR receiver.
+ * @note   Timings are in microseconds, each mark and space may be off by NEC_TOLERANCE_DIVIDER of its length, which covers
+ *      the receiver's own error and the latency of the edge ISR. A frame that doesn't fit starts over at the next leader.
+ *      A frame: a 9 ms mark and 4.5 ms space, 32 bits each a 562 us mark then a 562 us (0) or 1687 us (1) space, least significant bit first,
+ *      and a final 562 us mark. A repeat: a 9 ms mark, 2.25 ms space and a 562 us mark.
+ */
+class NecDecoder {
+public:
+    static const uint16_t LEADER_MARK = 9000;
+    static const uint16_t LEADER_SPACE = 4500;
+    static const uint16_t REPEAT_SPACE = 2250;
+    static const uint16_t BIT_MARK = 562;
+    static const uint16_t ZERO_SPACE = 562;
+    static const uint16_t ONE_SPACE = 1687;
+    static const uint8_t NEC_TOLERANCE_DIVIDER = 4; // 25%
+    static const uint32_t FRAME_TIMEOUT = 12000; // an edge is never this far apart inside a frame, so the frame was cut off
+
+private:
+    enum class Phase {
+        IDLE, // waiting for the light of a leader
+        LEADER_MARK,
+        LEADER_SPACE,
+        BIT_MARK, // a bit's mark, or the final mark after 32 bits
+        BIT_SPACE,
+        REPEAT_MARK // the final mark of a repeat
+    };
+    Phase phase;
+    uint32_t last_edge;
+    uint32_t bits;
+    uint8_t bit_count;
+    int16_t column;
+    bool has_frame; // a frame was decoded, so a repeat has something to repeat
+    NecFrame last_frame;
+
+    static bool near(uint32_t duration, uint16_t expected)
+    {
+        uint16_t tolerance = expected / NEC_TOLERANCE_DIVIDER;
+        return duration + tolerance >= expected && duration <= (uint32_t)expected + tolerance;
+    }
+    /**
+     * @brief  start over, the edge that didn't fit can still be the start of a leader
+     */
+    void restart(const IrEdge& edge)
+    {
+        phase = edge.light ? Phase::LEADER_MARK : Phase::IDLE;
+        column = edge.column;
+    }
+
+public:
+    NecDecoder()
+    {
+        phase = Phase::IDLE;
+        last_edge = 0;
+        has_frame = false;
+        last_frame = { 0, 0, false, -1 };
+    }
+    /**
+     * @brief  Call with every edge, in order
+     * @param  edge: the next edge
+     * @param  frame: set to the decoded frame when this returns true
+     * @retval true if this edge finished a frame or a repeat
+     */
+    bool addEdge(const IrEdge& edge, NecFrame& frame)
+    {
+        uint32_t duration = edge.ticks - last_edge; // of the mark (if !edge.light) or space (if edge.light) that this edge ends
+        last_edge = edge.ticks;
+        if (phase != Phase::IDLE && duration > FRAME_TIMEOUT) {
+            restart(edge);
+            return false;
+        }
+        switch (phase) {
+        case Phase::IDLE:
+            restart(edge);
+            return false;
+        case Phase::LEADER_MARK:
+            if (!edge.light && near(duration, LEADER_MARK)) {
+                phase = Phase::LEADER_SPACE;
+            } else {
+                restart(edge);
+            }
+            return false;
+        case Phase::LEADER_SPACE:
+            if (edge.light && near(duration, LEADER_SPACE)) {
+                phase = Phase::BIT_MARK;
+                bits = 0;
+                bit_count = 0;
+            } else if (edge.light && near(duration, REPEAT_SPACE) && has_frame) {
+                phase = Phase::REPEAT_MARK;
+            } else {
+                restart(edge);
+            }
+            return false;
+        case Phase::BIT_MARK:
+            if (edge.light || !near(duration, BIT_MARK)) {
+                restart(edge);
+                return false;
+            }
+            if (bit_count < 32) {
+                phase = Phase::BIT_SPACE;
+                return false;
+            }
+            phase = Phase::IDLE;
+            if ((uint8_t)(bits >> 16) != (uint8_t)~(bits >> 24)) { // the command is sent with its inverse, a mismatch is a bad frame
+                return false;
+            }
+            last_frame = { (uint16_t)bits, (uint8_t)(bits >> 16), false, column };
+            has_frame = true;
+            frame = last_frame;
+            return true;
+        case Phase::BIT_SPACE:
+            if (!edge.light) {
+                restart(edge);
+                return false;
+            }
+            if (near(duration, ONE_SPACE)) {
+                bits |= (uint32_t)1 << bit_count;
+            } else if (!near(duration, ZERO_SPACE)) {
+                restart(edge);
+                return false;
+            }
+            bit_count++;
+            phase = Phase::BIT_MARK;
+            return false;
+        case Phase::REPEAT_MARK:
+            if (edge.light || !near(duration, BIT_MARK)) {
+                restart(edge);
+                return false;
+            }
+            phase = Phase::IDLE;
+            frame = last_frame;
+            frame.repeat = true;
+            frame.column = column;
+            return true;
+        }
+        return false;
+    }
+};
+
+#endif // IR_REMOTE_H
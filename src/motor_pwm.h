@@ -0,0 +1,101 @@
+/**
+ * motor_pwm.h contains a driver for the motor's PWM on a TCC peripheral, with 12 bits of duty cycle instead of analogWrite's 8.
+ * The carrier frequency is set by the TCC's period, and new duty cycles go through the buffered compare register (CCB),
+ * so they take effect at the start of the next period instead of in the middle of one.
+ */
+#ifndef MOTOR_PWM_H
+#define MOTOR_PWM_H
+#include <Arduino.h>
+#include <wiring_private.h>
+
+const uint8_t MOTOR_DUTY_BITS = 12; // resolution of writeMotorPwm()'s duty cycle, independent of the carrier frequency
+const int32_t MOTOR_DUTY_MAX = (1 << MOTOR_DUTY_BITS) - 1; // duty cycle that is fully on
+const uint32_t MOTOR_PWM_CLOCK = 48000000; // GCLK0, the TCC counts at the CPU clock
+const uint32_t MOTOR_PWM_MAX_TOP = 0xFFFFFF; // the TCCs have 24 bit counters
+
+/**
+ * @brief  the TCC and compare channel driving the motor pin, set by setupMotorPwm()
+ */
+struct MotorPwm {
+    Tcc* tcc;
+    uint8_t channel;
+    uint32_t top; // the TCC counts from 0 to top, so there are top + 1 steps in a period
+};
+MotorPwm motor_pwm = { nullptr, 0, 0 };
+
+/**
+ * @brief  Call this on startup to take over the motor pin from analogWrite, the motor starts off.
+ * @note   The TCC is reset, so other pins on the same TCC can't use analogWrite anymore. TCC2 isn't supported
+ *      because it shares its clock with TC3, which timer.h runs at 1 MHz.
+ *      Carrier frequencies above MOTOR_PWM_CLOCK >> MOTOR_DUTY_BITS (11.7 kHz) have fewer than MOTOR_DUTY_BITS bits of resolution,
+ *      ex: 2400 steps at 20 kHz.
+ * @param  pin: Arduino pin number, must have a TCC output (ex: pin 7 is TCC0 WO[7])
+ * @param  carrier_hz: PWM frequency
+ * @retval false if the pin doesn't have a TCC output, the motor can't be driven then
+ */
+bool setupMotorPwm(byte pin, uint32_t carrier_hz)
+{
+    const PinDescription& description = g_APinDescription[pin];
+    if (!(description.ulPinAttribute & (PIN_ATTR_TIMER | PIN_ATTR_TIMER_ALT))) {
+        return false;
+    }
+    uint8_t tcc_number = GetTCNumber(description.ulPWMChannel);
+    if (tcc_number >= 2) { // a TC, or TCC2
+        return false;
+    }
+    motor_pwm.tcc = (Tcc*)GetTC(description.ulPWMChannel);
+    motor_pwm.channel = GetTCChannelNumber(description.ulPWMChannel);
+    motor_pwm.top = constrain(MOTOR_PWM_CLOCK / max(carrier_hz, (uint32_t)1), (uint32_t)2, MOTOR_PWM_MAX_TOP + 1) - 1;
+
+    PM->APBCMASK.reg |= PM_APBCMASK_TCC0 << tcc_number;
+    GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_TCC0_TCC1 | GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0;
+    while (GCLK->STATUS.bit.SYNCBUSY)
+        ;
+
+    Tcc* tcc = motor_pwm.tcc;
+    tcc->CTRLA.reg &= ~TCC_CTRLA_ENABLE;
+    while (tcc->SYNCBUSY.bit.ENABLE)
+        ;
+    tcc->CTRLA.reg = TCC_CTRLA_SWRST; // forget analogWrite's 8 bit period
+    while (tcc->SYNCBUSY.bit.SWRST)
+        ;
+    // single slope PWM: the output is high from the start of the period until the count reaches CC
+    tcc->WAVE.reg = TCC_WAVE_WAVEGEN_NPWM;
+    while (tcc->SYNCBUSY.bit.WAVE)
+        ;
+    tcc->PER.reg = motor_pwm.top;
+    while (tcc->SYNCBUSY.bit.PER)
+        ;
+    tcc->CC[motor_pwm.channel].reg = 0;
+    while (tcc->SYNCBUSY.reg & (TCC_SYNCBUSY_CC0 << motor_pwm.channel))
+        ;
+    tcc->CTRLA.reg = TCC_CTRLA_PRESCALER_DIV1 | TCC_CTRLA_ENABLE;
+    while (tcc->SYNCBUSY.bit.ENABLE)
+        ;
+
+    pinPeripheral(pin, (description.ulPinAttribute & PIN_ATTR_TIMER) ? PIO_TIMER : PIO_TIMER_ALT);
+    return true;
+}
+
+/**
+ * @brief  sets the motor's duty cycle, it takes effect at the start of the next PWM period
+ * @note   Writes the buffered compare register, the TCC copies it to CC when the period ends (CTRLB.LUPD is cleared by the reset in setupMotorPwm()),
+ *      so a period is never cut short or stretched by an update in the middle of it. Uses a multiply and a shift, safe to call from an ISR.
+ * @param  duty: 0 (off) to MOTOR_DUTY_MAX (on), values outside are constrained
+ */
+void writeMotorPwm(int32_t duty)
+{
+    if (motor_pwm.tcc == nullptr) {
+        return;
+    }
+    duty = constrain(duty, 0, MOTOR_DUTY_MAX);
+    uint32_t compare = ((uint64_t)duty * (motor_pwm.top + 1)) >> MOTOR_DUTY_BITS;
+    if (duty == MOTOR_DUTY_MAX) {
+        compare = motor_pwm.top + 1; // a compare value past the top keeps the output high for the whole period
+    }
+    while (motor_pwm.tcc->SYNCBUSY.reg & (TCC_SYNCBUSY_CCB0 << motor_pwm.channel)) // the last write hasn't reached the TCC's clock domain yet
+        ;
+    motor_pwm.tcc->CCB[motor_pwm.channel].reg = compare;
+}
+
+#endif // MOTOR_PWM_H
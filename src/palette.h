@@ -0,0 +1,113 @@
+/**
+ * palette.h contains a column of pixels stored as indices into a small palette, 1, 2 or 4 bits per pixel instead of a 3 byte CRGB,
+ * so an image is 1 to 4 bytes per column. The clock only draws a foreground and a background color, so the colors themselves
+ * are kept once per image and looked up as each column is shown.
+ * The functions are inline because font.cpp includes this file as well as src.ino.
+ */
+#ifndef PALETTE_H
+#define PALETTE_H
+#include <Arduino.h>
+#include <FastLED.h>
+
+/**
+ * @brief  the unsigned type that holds 8 pixels of bits each
+ */
+template <uint8_t bits>
+struct PaletteStorage;
+template <>
+struct PaletteStorage<1> {
+    typedef uint8_t type;
+};
+template <>
+struct PaletteStorage<2> {
+    typedef uint16_t type;
+};
+template <>
+struct PaletteStorage<4> {
+    typedef uint32_t type;
+};
+
+/**
+ * @brief  One column of 8 pixels, each an index into a palette of 2^bits colors. Pixel y (counting from the top) is bits y * bits and up.
+ * @note   Index 0 is the color an image is cleared to, so palettes should make it black.
+ * @param  bits: bits per pixel, 1, 2 or 4
+ */
+template <uint8_t bits>
+struct PaletteColumn {
+    static const uint8_t COLORS = 1 << bits;
+    static const uint8_t MASK = COLORS - 1;
+    typedef typename PaletteStorage<bits>::type Storage;
+
+    Storage pixels;
+
+    PaletteColumn()
+    {
+        pixels = 0;
+    }
+    /**
+     * @brief  palette index of one pixel, 0 is the top of the column
+     */
+    uint8_t get(uint8_t led) const
+    {
+        return (pixels >> (led * bits)) & MASK;
+    }
+    /**
+     * @brief  sets the palette index of one pixel, 0 is the top of the column
+     */
+    void set(uint8_t led, uint8_t index)
+    {
+        pixels = (pixels & ~((Storage)MASK << (led * bits))) | ((Storage)(index & MASK) << (led * bits));
+    }
+    /**
+     * @brief  copies the column's colors out of palette, for the LEDs
+     * @param  pixels_out: 8 colors, 0 is the top of the column
+     */
+    void expand(const CRGB palette[], CRGB pixels_out[8]) const
+    {
+        Storage remaining = pixels;
+        for (uint8_t i = 0; i < 8; i++) {
+            pixels_out[i] = palette[remaining & MASK];
+            remaining >>= bits;
+        }
+    }
+};
+
+/**
+ * @brief  spreads bit y of mask to every bit of pixel y of a PaletteColumn<bits>, so a whole column is drawn with two ands and an or
+ */
+inline uint8_t spreadMask(uint8_t mask, PaletteColumn<1>*)
+{
+    return mask;
+}
+inline uint16_t spreadMask(uint8_t mask, PaletteColumn<2>*)
+{
+    uint16_t x = mask;
+    x = (x | (x << 4)) & 0x0F0F;
+    x = (x | (x << 2)) & 0x3333;
+    x = (x | (x << 1)) & 0x5555;
+    return x * 3;
+}
+inline uint32_t spreadMask(uint8_t mask, PaletteColumn<4>*)
+{
+    uint32_t x = mask;
+    x = (x | (x << 12)) & 0x000F000F;
+    x = (x | (x << 6)) & 0x03030303;
+    x = (x | (x << 3)) & 0x11111111;
+    return x * 15;
+}
+
+/**
+ * @brief  writes a whole column of pixels at once, the PaletteColumn version of font.h's blitColumn()
+ * @param  mask: bit y chooses the index of pixel y (counting from the top)
+ * @param  colors[2]: palette indices, colors[0] is used where the mask is 0 (background), colors[1] where it is 1 (foreground)
+ */
+template <uint8_t bits>
+inline void blitColumn(PaletteColumn<bits>& column, uint8_t mask, const uint8_t colors[2])
+{
+    typedef typename PaletteColumn<bits>::Storage Storage;
+    const Storage ones = (Storage)~(Storage)0 / PaletteColumn<bits>::MASK; // the lowest bit of every pixel
+    Storage spread = spreadMask(mask, (PaletteColumn<bits>*)nullptr);
+    column.pixels = (spread & (Storage)(ones * (colors[1] & PaletteColumn<bits>::MASK))) | (~spread & (Storage)(ones * (colors[0] & PaletteColumn<bits>::MASK)));
+}
+
+#endif // PALETTE_H
@@ -1,3 +1,7 @@
+/**
+ * pid.h contains the PID controllers used for the motor: the original PID class with gains set at runtime,
+ * and FixedPid, which does the same calculation without any divides and with gains that can change with the speed.
+ */
 #ifndef PID_H
 #define PID_H
 #include <Arduino.h>
@@ -68,7 +72,10 @@ public:
      */
     PID(int32_t k, int32_t f, int32_t p, int32_t i, int32_t d, int32_t _out_low, int32_t _out_high, uint8_t _out_devisor_pow)
     {
-        PID();
+        sum_error = 0;
+        last_calc_micros = 0;
+        last_error = 0;
+
         K = k;
         F = f;
         P = p;
@@ -108,7 +115,237 @@ public:
 
         last_error = error;
 
-        return constrain((int32_t)((int32_t)output / (int32_t)(1 << out_devisor_pow)), out_low, out_high);
+        output /= (int32_t)(1 << out_devisor_pow);
+        return constrain(output, (int64_t)out_low, (int64_t)out_high); // constrain before narrowing, so a large output doesn't wrap around
+    }
+};
+
+const uint8_t PID_DT_SHIFT = 10; // FixedPid looks up 1/dt in steps of 1024 microseconds
+const unsigned int PID_DT_STEPS = 256; // steps up to 262 ms each have their own reciprocal, longer steps use the last one
+const uint32_t PID_MAX_DT = 1000000; // a longer time step (ex: the first call after a pause) is integrated as one second
+const uint32_t PID_MICROS_TO_Q16 = 4295; // 2^32 / 1000000, so (dt * PID_MICROS_TO_Q16) >> 16 is dt in seconds with 16 fraction bits
+
+/**
+ * @brief  1000000 / dt with 16 fraction bits, for the dt in the middle of a step, calculated at compile time
+ */
+constexpr uint32_t pidDtReciprocal(unsigned int step)
+{
+    return (uint32_t)(((uint64_t)1000000 << 16) / ((2 * step + 1) << (PID_DT_SHIFT - 1)));
+}
+
+// compile time list of the numbers 0 to N-1, used to call pidDtReciprocal once for every step (C++11 doesn't have std::index_sequence)
+template <unsigned int... Is>
+struct PidDtIndices {
+};
+template <unsigned int N, unsigned int... Is>
+struct MakePidDtIndices : MakePidDtIndices<N - 1, N - 1, Is...> {
+};
+template <unsigned int... Is>
+struct MakePidDtIndices<0, Is...> {
+    typedef PidDtIndices<Is...> type;
+};
+
+/**
+ * @brief  table of pidDtReciprocal() for every step, generated at compile time and stored in flash
+ */
+template <typename Indices>
+struct PidDtTable;
+template <unsigned int... Is>
+struct PidDtTable<PidDtIndices<Is...>> {
+    static constexpr uint32_t reciprocals[sizeof...(Is)] = { pidDtReciprocal(Is)... };
+};
+template <unsigned int... Is>
+constexpr uint32_t PidDtTable<PidDtIndices<Is...>>::reciprocals[sizeof...(Is)];
+typedef PidDtTable<MakePidDtIndices<PID_DT_STEPS>::type> pid_dt_table;
+
+/**
+ * @brief  a * b, or the closest int64_t if that overflows
+ */
+inline int64_t saturatingMultiply(int64_t a, int64_t b)
+{
+    int64_t result;
+    if (__builtin_mul_overflow(a, b, &result)) {
+        return ((a < 0) != (b < 0)) ? INT64_MIN : INT64_MAX;
+    }
+    return result;
+}
+
+/**
+ * @brief  a + b, or the closest int64_t if that overflows
+ */
+inline int64_t saturatingAdd(int64_t a, int64_t b)
+{
+    int64_t result;
+    if (__builtin_add_overflow(a, b, &result)) {
+        return (a < 0) ? INT64_MIN : INT64_MAX;
+    }
+    return result;
+}
+
+/**
+ * @brief  one entry of a FixedPid gain schedule, the terms mean the same as in PID
+ * @note   Gains are in units of output / 2^q per unit of input, so they are the same numbers that PID takes with out_devisor_pow = q.
+ *      The i and d terms are per second.
+ */
+struct PidGains {
+    int32_t below_input; // these gains are used while the input is less than this, and the previous entries' below_input
+    int32_t k;
+    int32_t f;
+    int32_t p;
+    int32_t i;
+    int32_t d;
+};
+
+/**
+ * @brief  A PID controller in fixed point math, without any divides (the SAMD21 has no hardware divider, each divide is a library call).
+ * @note   Every term is calculated in 64 bits and saturates instead of overflowing, so any setpoint, input and time gives an output
+ *      between out_low and out_high with the sign of the error. The time step is scaled with a multiply for the integral and a table of
+ *      reciprocals for the derivative. The integral is kept in output units, so switching between gains in the schedule doesn't make the output jump.
+ * @param  q: number of fraction bits in the gains, the sum of the terms is shifted right by q
+ * @param  out_low: low bound of output
+ * @param  out_high: high bound of output
+ */
+template <uint8_t q, int32_t out_low, int32_t out_high>
+class FixedPid {
+    static_assert(q < 32, "q is the number of fraction bits of a 32 bit gain");
+    static_assert(out_low < out_high, "the output range can't be empty");
+
+    const PidGains* schedule;
+    uint8_t schedule_length;
+    uint8_t active_gains;
+    int64_t integral;
+    int64_t last_error;
+    bool has_last_error;
+    unsigned long last_calc_micros;
+
+    /**
+     * @brief  anti windup limit for the integral, the same as PID's
+     */
+    static constexpr int64_t integralLimit()
+    {
+        return (((int64_t)out_high - out_low) << q) / 2;
+    }
+    /**
+     * @brief  index of the schedule entry used for input
+     */
+    uint8_t scheduleIndex(int32_t input)
+    {
+        uint8_t g = 0;
+        while (g + 1 < schedule_length && input >= schedule[g].below_input) {
+            g++;
+        }
+        return g;
+    }
+
+public:
+    /**
+     * @brief  constructor for FixedPid
+     * @param  _schedule: gains sorted by increasing below_input, the last entry is used for every input above the others.
+     *      Must stay valid while the FixedPid uses it, ex: a constexpr array
+     * @param  length: number of entries in the schedule, at least 1
+     */
+    FixedPid(const PidGains* _schedule, uint8_t length)
+    {
+        setSchedule(_schedule, length);
+        reset();
+        last_calc_micros = 0;
+    }
+    /**
+     * @brief  replaces the gain schedule (ex: with gains from a tuner) without resetting the integral
+     */
+    void setSchedule(const PidGains* _schedule, uint8_t length)
+    {
+        schedule = _schedule;
+        schedule_length = length;
+        active_gains = 0;
+    }
+    /**
+     * @brief  the gains used by the last calculate()
+     */
+    const PidGains& gains()
+    {
+        return schedule[active_gains];
+    }
+    /**
+     * @brief  forgets the integral and the last error, ex: when the motor was stopped
+     */
+    void reset()
+    {
+        integral = 0;
+        last_error = 0;
+        has_last_error = false;
+    }
+    /**
+     * @brief  call this when starting the pid loop (to avoid the loop thinking there was a huge time step at the first calculate)
+     */
+    void initialize_time(unsigned long micros)
+    {
+        last_calc_micros = micros;
+        has_last_error = false; // the error from before the pause isn't a derivative
+    }
+    /**
+     * @brief  the integral term in output units << q, for restoreIntegral()
+     */
+    int64_t integralTerm()
+    {
+        return integral;
+    }
+    /**
+     * @brief  continues from an integral saved with integralTerm() (ex: before a watchdog reset), call after initialize_time()
+     */
+    void restoreIntegral(int64_t saved)
+    {
+        integral = constrain(saved, -integralLimit(), integralLimit());
+    }
+    /**
+     * @brief  Bumpless transfer: sets the integral so that calculate() with this setpoint and input outputs output,
+     *      ex: the last duty cycle of another controller that this one takes over from. Call after initialize_time()
+     */
+    void transferOutput(int32_t output, int32_t setpoint, int32_t input)
+    {
+        const PidGains& gains = schedule[scheduleIndex(input)];
+        int64_t error = (int64_t)setpoint - input;
+        int64_t others = saturatingAdd(saturatingMultiply(gains.p, error), saturatingAdd(gains.k, (int64_t)gains.f * setpoint));
+        integral = saturatingAdd(saturatingMultiply(output, (int64_t)1 << q), -others);
+        integral = constrain(integral, -integralLimit(), integralLimit());
+    }
+    /**
+     * @brief  Call this method to run the PID loop
+     * @param  setpoint: (int32_t) target value to reach
+     * @param  input: (int32_t) input (measurement), also chooses the gains from the schedule
+     * @param  micros: (unsigned long) a value that increases steadily at a rate of one million per second.
+     * @retval (int32_t) output value of PID control loop, between out_low and out_high
+     */
+    int32_t calculate(int32_t setpoint, int32_t input, unsigned long micros)
+    {
+        uint32_t dt = micros - last_calc_micros;
+        last_calc_micros = micros;
+        if (dt > PID_MAX_DT) {
+            dt = PID_MAX_DT;
+        }
+
+        active_gains = scheduleIndex(input);
+        const PidGains& gains = schedule[active_gains];
+
+        int64_t error = (int64_t)setpoint - input;
+
+        int64_t dt_q16 = ((uint64_t)dt * PID_MICROS_TO_Q16) >> 16; // seconds
+        integral = saturatingAdd(integral, saturatingMultiply(saturatingMultiply(gains.i, error), dt_q16) >> 16);
+        integral = constrain(integral, -integralLimit(), integralLimit()); // anti windup
+
+        int64_t output = saturatingAdd(saturatingMultiply(gains.p, error), integral);
+        if (has_last_error) {
+            uint32_t step = dt >> PID_DT_SHIFT;
+            uint32_t reciprocal = pid_dt_table::reciprocals[step < PID_DT_STEPS ? step : PID_DT_STEPS - 1];
+            output = saturatingAdd(output, saturatingMultiply(saturatingMultiply(gains.d, error - last_error), reciprocal) >> 16);
+        }
+        output = saturatingAdd(output, saturatingAdd(gains.k, (int64_t)gains.f * setpoint)); // add constant offset, and feedforward terms
+
+        last_error = error;
+        has_last_error = true;
+
+        output >>= q;
+        return constrain(output, (int64_t)out_low, (int64_t)out_high);
     }
 };
 
@@ -0,0 +1,127 @@
+/**
+ * render_scheduler.h contains a scheduler that times drawing the next frame from the predicted time of the next beam break,
+ * so a fresh frame is published just before the beam break that displays it, instead of on a cadence of its own that beats against the rotation
+ * (showing some frames for two revolutions and overwriting others before they were shown).
+ */
+#ifndef RENDER_SCHEDULER_H
+#define RENDER_SCHEDULER_H
+#include <Arduino.h>
+
+/**
+ * @brief  Schedules one frame every revolutions_per_frame revolutions, each finished just before the beam break that will display it.
+ * @note   All times are micros(), only used by loop(). The render time is tracked as a peak that decays slowly,
+ *      so a render that is slower than usual pushes the next starts earlier right away.
+ */
+class RenderScheduler {
+    static const uint8_t RENDER_TIME_DECAY_SHIFT = 4; // the estimate moves 1/16 of the way down to a faster render
+
+    uint8_t revolutions_per_frame;
+    uint32_t margin; // microseconds between the predicted end of a render and its beam break
+    bool pending; // a render was scheduled and hasn't finished yet
+    unsigned long target; // predicted beam break the pending render has to be published before
+    unsigned long started;
+    uint32_t render_time; // estimate
+    uint32_t last_render_time;
+    uint32_t published;
+    uint32_t missed;
+
+public:
+    RenderScheduler(uint8_t _revolutions_per_frame, uint32_t _margin)
+    {
+        revolutions_per_frame = max(_revolutions_per_frame, (uint8_t)1);
+        margin = _margin;
+        pending = false;
+        target = 0;
+        started = 0;
+        render_time = 0;
+        last_render_time = 0;
+        published = 0;
+        missed = 0;
+    }
+    /**
+     * @brief  Call on every beam break while the image is displayed.
+     * @param  beam_break: micros() of the beam break
+     * @param  predicted_interval: expected interval of the revolution that just started, 0 if unknown
+     * @param  now: micros()
+     * @param  start: set to when the next render should start, when this returns true
+     * @retval true if a render was scheduled, false if one is already waiting or the interval is unknown
+     */
+    bool beamBreak(unsigned long beam_break, uint32_t predicted_interval, unsigned long now, unsigned long& start)
+    {
+        if (pending || predicted_interval == 0) {
+            return false;
+        }
+        target = beam_break + predicted_interval * revolutions_per_frame;
+        start = target - render_time - margin;
+        if ((long)(start - now) < 0) { // renders take longer than the revolutions there are for them
+            start = now;
+        }
+        pending = true;
+        return true;
+    }
+    /**
+     * @brief  call right before rendering
+     */
+    void renderStarted(unsigned long now)
+    {
+        started = now;
+    }
+    /**
+     * @brief  call once the frame has been published
+     * @param  now: micros()
+     * @retval false if the frame was published after the beam break it was scheduled for, and will be displayed a revolution late
+     */
+    bool renderFinished(unsigned long now)
+    {
+        last_render_time = now - started;
+        if (last_render_time > render_time) {
+            render_time = last_render_time;
+        } else {
+            render_time -= (render_time - last_render_time) >> RENDER_TIME_DECAY_SHIFT;
+        }
+        published++;
+        bool on_time = !pending || (long)(now - target) <= 0;
+        if (!on_time) {
+            missed++;
+        }
+        pending = false;
+        return on_time;
+    }
+    /**
+     * @brief  frames are scheduled every revolutions revolutions from the next beam break, ex: 2 when renders are too slow for every one
+     */
+    void setRevolutionsPerFrame(uint8_t revolutions)
+    {
+        revolutions_per_frame = max(revolutions, (uint8_t)1);
+    }
+    /**
+     * @brief  estimated render time in microseconds
+     */
+    uint32_t renderTime()
+    {
+        return render_time;
+    }
+    /**
+     * @brief  microseconds the last render took
+     */
+    uint32_t lastRenderTime()
+    {
+        return last_render_time;
+    }
+    /**
+     * @brief  frames rendered and published, including the ones that weren't scheduled for a beam break (ex: while not displaying)
+     */
+    uint32_t framesPublished()
+    {
+        return published;
+    }
+    /**
+     * @brief  scheduled frames that were published after their beam break
+     */
+    uint32_t framesMissed()
+    {
+        return missed;
+    }
+};
+
+#endif // RENDER_SCHEDULER_H
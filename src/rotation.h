@@ -0,0 +1,240 @@
+/**
+ * rotation.h contains an estimator of how long the rotor takes to rotate, built from the timestamps of beam breaks.
+ * Instead of trusting the difference of the last two timestamps, it keeps a short history, rejects double triggers and missed breaks,
+ * and fits a line through the history to get a filtered interval, an acceleration, and a prediction of the next interval
+ * (or uses the newest intervals while the history is short or curves too much for a line, ex: while spinning up).
+ */
+#ifndef ROTATION_H
+#define ROTATION_H
+#include <Arduino.h>
+
+/**
+ * @brief  Estimates the rotation interval from beam break timestamps, in microseconds.
+ * @note   addBeamBreak() and the getters are meant to be called from the beam break ISR, which publishes what loop() needs (see spsc.h).
+ *      requestReset() is the only call from loop(), the reset happens at the next addBeamBreak() so the history only has one writer.
+ */
+class RotationEstimator {
+public:
+    static const uint8_t HISTORY = 8; // number of intervals the line is fit through
+    static const uint32_t MAX_INTERVAL = 2000000; // a longer interval means the rotor had stopped, so it starts a new history
+    static const uint8_t CONFIDENCE_STEP = 32; // confidence gained per accepted interval, out of 255
+    static const uint8_t JITTER_SHIFT = 3; // jitter is averaged over about 2^JITTER_SHIFT revolutions
+
+private:
+    uint32_t intervals[HISTORY]; // ring buffer, intervals[next] is the oldest once it is full
+    uint8_t next;
+    uint8_t count;
+    unsigned long last_beam_break; // every beam break except double triggers
+    unsigned long last_accepted; // the last beam break whose interval was accepted into the history
+    bool has_beam_break;
+    uint8_t rejected_in_row;
+
+    uint32_t filtered;
+    int32_t acceleration;
+    uint32_t predicted;
+    uint8_t confidence;
+    uint32_t scaled_jitter; // average of |interval - predicted| with JITTER_SHIFT fraction bits
+    volatile uint8_t resets_requested; // only changed by requestReset()
+    volatile uint8_t resets_done; // only changed by addBeamBreak()
+
+    /**
+     * @brief  recalculates filtered, acceleration and predicted from the history
+     */
+    void fit()
+    {
+        uint8_t newest = (next + HISTORY - 1) % HISTORY;
+        if (count < HISTORY) { // not enough intervals for a line yet
+            fitNewest();
+            return;
+        }
+        // least squares line through (i, interval) for i = 0 (oldest) to 7 (newest). With x = 2i - 7 the x values are centered
+        // on 0 and the sum of x^2 is 168, so the slope is sum(x * interval) / 84 per revolution
+        int32_t sum = 0;
+        int32_t weighted_sum = 0;
+        for (uint8_t i = 0; i < HISTORY; i++) {
+            int32_t interval = intervals[(next + i) % HISTORY];
+            sum += interval;
+            weighted_sum += (2 * i - 7) * interval;
+        }
+        int32_t mean = sum / HISTORY;
+        acceleration = weighted_sum / 84;
+        filtered = mean + weighted_sum / 24; // line at i = 7: mean + slope * 3.5
+        predicted = mean + weighted_sum * 3 / 56; // line at i = 8: mean + slope * 4.5
+        if (abs((int32_t)(filtered - intervals[newest])) > (int32_t)(intervals[newest] / 16)) { // the history curves too much for a line (ex: spinning up)
+            fitNewest();
+        }
+    }
+    /**
+     * @brief  estimates from the last two intervals only, for when there isn't a history that a line fits
+     */
+    void fitNewest()
+    {
+        uint8_t newest = (next + HISTORY - 1) % HISTORY;
+        uint8_t previous = (next + HISTORY - 2) % HISTORY;
+        filtered = intervals[newest];
+        acceleration = (count >= 2) ? (int32_t)(intervals[newest] - intervals[previous]) : 0;
+        predicted = max((int32_t)filtered + acceleration, (int32_t)filtered / 2);
+    }
+    void push(uint32_t interval)
+    {
+        intervals[next] = interval;
+        next = (next + 1) % HISTORY;
+        if (count < HISTORY) {
+            count++;
+        }
+        fit();
+    }
+
+public:
+    RotationEstimator()
+    {
+        has_beam_break = false;
+        resets_requested = 0;
+        resets_done = 0;
+        reset();
+    }
+    /**
+     * @brief  forgets the history (ex: before spinning up), the next timestamps start a new one
+     */
+    void reset()
+    {
+        next = 0;
+        count = 0;
+        rejected_in_row = 0;
+        filtered = 0;
+        acceleration = 0;
+        predicted = 0;
+        confidence = 0;
+        scaled_jitter = 0;
+    }
+    /**
+     * @brief  starts the history from an interval measured before a reset, so the first beam break already has a prediction
+     * @note   call before the beam break ISR is attached, the first beam break keeps the seed instead of starting a new history
+     */
+    void seed(uint32_t interval)
+    {
+        reset();
+        has_beam_break = false;
+        push(interval);
+    }
+    /**
+     * @brief  call from loop() to forget the history (ex: before spinning up), without interrupting addBeamBreak() in the middle of it
+     * @note   interval() and jitter() are 0 until the next beam break starts the new history
+     */
+    void requestReset()
+    {
+        resets_requested = resets_requested + 1;
+    }
+    /**
+     * @brief  true from requestReset() until the next addBeamBreak() has done it, the interval loop() last got from the ISR is from before
+     */
+    bool resetPending()
+    {
+        return resets_requested != resets_done;
+    }
+    /**
+     * @brief  call on every beam break
+     * @param  timestamp: micros() (or any microsecond counter) when the beam was broken
+     * @retval false if the beam break was rejected as a double trigger and a new revolution should not be started, true otherwise
+     */
+    bool addBeamBreak(unsigned long timestamp)
+    {
+        if (resetPending()) {
+            resets_done = resets_requested;
+            reset();
+        }
+        uint32_t since_last = timestamp - last_beam_break;
+        if (!has_beam_break || since_last > MAX_INTERVAL) {
+            bool seeded = !has_beam_break && count > 0; // see seed()
+            has_beam_break = true;
+            last_beam_break = timestamp;
+            last_accepted = timestamp;
+            if (!seeded) {
+                reset();
+            }
+            return true;
+        }
+        uint32_t interval = timestamp - last_accepted; // rejected beam breaks don't count, so a late one doesn't also make the next interval short
+        if (count >= 2) {
+            uint32_t expected = predicted;
+            uint32_t tolerance = expected / 4;
+            if (since_last < expected / 2) { // double trigger
+                confidence /= 2;
+                return false;
+            }
+            uint32_t revolutions = (interval + expected / 2) / expected; // more than 1 if beam breaks were missed or rejected
+            if (revolutions >= 1 && revolutions <= 3 && abs((int32_t)(interval - revolutions * expected)) <= (int32_t)tolerance) {
+                interval /= revolutions;
+                if (revolutions > 1) {
+                    confidence /= 2;
+                } else { // exponential moving average of how far off the prediction was
+                    scaled_jitter += abs((int32_t)(interval - expected)) - (scaled_jitter >> JITTER_SHIFT);
+                }
+            } else { // a bad measurement, unless it keeps happening because the speed really changed
+                last_beam_break = timestamp;
+                if (++rejected_in_row < 2) {
+                    confidence /= 2;
+                    return true;
+                }
+                reset();
+                interval = since_last;
+            }
+        }
+        rejected_in_row = 0;
+        last_beam_break = timestamp;
+        last_accepted = timestamp;
+        push(interval);
+        confidence = min(255, confidence + CONFIDENCE_STEP);
+        return true;
+    }
+    /**
+     * @brief  filtered interval of the most recent rotation in microseconds, 0 if there is no measurement yet
+     */
+    uint32_t interval()
+    {
+        if (resetPending()) {
+            return 0;
+        }
+        return filtered;
+    }
+    /**
+     * @brief  expected interval of the rotation that just started in microseconds, 0 if there is no measurement yet
+     */
+    uint32_t predictedInterval()
+    {
+        return predicted;
+    }
+    /**
+     * @brief  change of the interval per rotation in microseconds, negative while speeding up
+     */
+    int32_t intervalAcceleration()
+    {
+        return acceleration;
+    }
+    /**
+     * @brief  0 (no or unreliable measurements) to 255 (many accepted intervals in a row)
+     */
+    uint8_t confidenceLevel()
+    {
+        return confidence;
+    }
+    /**
+     * @brief  average difference between a revolution's interval and its prediction in microseconds, 0 if there is no measurement yet
+     */
+    uint32_t jitter()
+    {
+        if (resetPending()) {
+            return 0;
+        }
+        return scaled_jitter >> JITTER_SHIFT;
+    }
+    /**
+     * @brief  timestamp of the last beam break that wasn't a double trigger (even if its interval was rejected)
+     */
+    unsigned long lastBeamBreak()
+    {
+        return last_beam_break;
+    }
+};
+
+#endif // ROTATION_H
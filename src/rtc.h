@@ -0,0 +1,61 @@
+/**
+ * rtc.h contains functions for running the RTC peripheral as a free running counter of 1/1024 seconds from the 32.768 kHz crystal.
+ * It keeps counting through everything loop() does, and DisciplinedClock (time_sync.h) turns its count into the time.
+ * The 32 bit count wraps after 48 days.
+ */
+#ifndef RTC_H
+#define RTC_H
+#include <Arduino.h>
+
+/**
+ * @brief  call on startup, starts the RTC counting at 1024 Hz
+ * @param  keep_count: keep the count from before the reset if the RTC is still running. Only a power on reset resets the RTC,
+ *      a watchdog reset only stops its generic clock, so the count has only lost the ticks from the reset until this call.
+ * @retval true if the count was kept, false if it starts from 0
+ * @note   Uses GCLK generator 2. Arduino's startup code already runs XOSC32K (the crystal) as the DFLL's reference, so it is left as it is.
+ */
+bool setupRtc(bool keep_count)
+{
+    PM->APBAMASK.reg |= PM_APBAMASK_RTC;
+
+    // generator 2 divides the crystal by 2^(4+1), 1024 Hz
+    GCLK->GENDIV.reg = GCLK_GENDIV_DIV(4) | GCLK_GENDIV_ID(2);
+    while (GCLK->STATUS.bit.SYNCBUSY)
+        ;
+    GCLK->GENCTRL.reg = GCLK_GENCTRL_GENEN | GCLK_GENCTRL_ID(2) | GCLK_GENCTRL_SRC_XOSC32K | GCLK_GENCTRL_DIVSEL;
+    while (GCLK->STATUS.bit.SYNCBUSY)
+        ;
+    GCLK->CLKCTRL.reg = GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN(2) | GCLK_CLKCTRL_ID_RTC;
+    while (GCLK->STATUS.bit.SYNCBUSY)
+        ;
+
+    const uint16_t counting = RTC_MODE0_CTRL_MODE_COUNT32 | RTC_MODE0_CTRL_PRESCALER_DIV1 | RTC_MODE0_CTRL_ENABLE;
+    bool kept = keep_count && (RTC->MODE0.CTRL.reg & (RTC_MODE0_CTRL_MODE_Msk | RTC_MODE0_CTRL_PRESCALER_Msk | RTC_MODE0_CTRL_ENABLE)) == counting;
+    if (!kept) {
+        RTC->MODE0.CTRL.reg = RTC_MODE0_CTRL_SWRST;
+        while (RTC->MODE0.CTRL.bit.SWRST)
+            ;
+        // mode 0 is a 32 bit counter, counting every cycle of generator 2
+        RTC->MODE0.CTRL.reg = RTC_MODE0_CTRL_MODE_COUNT32 | RTC_MODE0_CTRL_PRESCALER_DIV1;
+        while (RTC->MODE0.STATUS.bit.SYNCBUSY)
+            ;
+    }
+    // COUNT is synchronized from the 1024 Hz domain continuously, so reading it doesn't have to wait for a read request
+    RTC->MODE0.READREQ.reg = RTC_READREQ_RREQ | RTC_READREQ_RCONT | RTC_READREQ_ADDR(0x10); // 0x10 is COUNT
+    if (!kept) {
+        RTC->MODE0.CTRL.reg |= RTC_MODE0_CTRL_ENABLE;
+        while (RTC->MODE0.STATUS.bit.SYNCBUSY)
+            ;
+    }
+    return kept;
+}
+
+/**
+ * @brief  the count, 1024 per second, a single register read
+ */
+uint32_t readRtcTicks()
+{
+    return RTC->MODE0.COUNT.reg;
+}
+
+#endif // RTC_H
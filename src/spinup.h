@@ -0,0 +1,107 @@
+/**
+ * spinup.h contains the controller used while spinning up: the motor follows a speed trajectory that rises as fast as the
+ * acceleration and current limits allow, instead of an open loop ramp of the duty cycle.
+ */
+#ifndef SPINUP_H
+#define SPINUP_H
+#include <Arduino.h>
+
+/**
+ * @brief  model of the motor and limits of the trajectory, speeds are in the units of the setpoint and the terms have q fraction bits
+ */
+struct SpinUpParameters {
+    int32_t acceleration; // speed per second, the slope of the trajectory
+    int32_t max_lead; // the trajectory waits for the measured speed if it gets this far ahead (ex: while the current is limited)
+    int32_t duty_per_speed; // feedforward, duty cycle that holds a speed with the battery at nominal_battery (like PID's F term)
+    int32_t duty_per_acceleration; // feedforward, extra duty cycle per speed per second of acceleration
+    int32_t stall_duty; // current limit: duty cycle allowed on top of the back EMF of the measured speed, not shifted by q
+    int32_t p; // duty cycle per speed the measurement is behind the trajectory
+    float nominal_battery; // volts that duty_per_speed, duty_per_acceleration and stall_duty were measured at
+};
+
+/**
+ * @brief  Calculates the duty cycle for spinning up along a trajectory limited by acceleration and current.
+ * @note   Before the first rotation is measured, the duty cycle is only the feedforward of the trajectory, and the current limit assumes the rotor follows it.
+ *      Every term is divided by the battery voltage, so a weak pack gets a higher duty cycle for the same torque.
+ * @param  q: number of fraction bits in duty_per_speed, duty_per_acceleration and p
+ * @param  out_high: duty cycle that is fully on
+ */
+template <uint8_t q, int32_t out_high>
+class SpinUpController {
+    const SpinUpParameters& params;
+    int32_t trajectory;
+    int32_t duty;
+    unsigned long last_micros;
+
+public:
+    SpinUpController(const SpinUpParameters& _params)
+        : params(_params)
+    {
+        trajectory = 0;
+        duty = 0;
+        last_micros = 0;
+    }
+    /**
+     * @brief  call this when starting to spin up
+     * @param  speed: measured speed, 0 if stopped or not measured
+     * @param  micros: the current time
+     */
+    void start(int32_t speed, unsigned long micros)
+    {
+        trajectory = speed;
+        duty = 0;
+        last_micros = micros;
+    }
+    /**
+     * @brief  Call this every loop while spinning up
+     * @param  setpoint: the trajectory rises until it reaches this speed
+     * @param  speed: measured speed, 0 if no rotation has been measured yet
+     * @param  battery: battery voltage
+     * @param  micros: (unsigned long) a value that increases steadily at a rate of one million per second.
+     * @retval duty cycle for the motor, 0 to out_high
+     */
+    int32_t calculate(int32_t setpoint, int32_t speed, float battery, unsigned long micros)
+    {
+        uint32_t dt = micros - last_micros;
+        last_micros = micros;
+
+        int32_t acceleration = params.acceleration;
+        int64_t next = trajectory + (int64_t)acceleration * dt / 1000000;
+        if (next >= setpoint) {
+            next = setpoint;
+            acceleration = 0;
+        }
+        if (speed != 0 && next > (int64_t)speed + params.max_lead) { // the motor can't keep up, don't let the trajectory run away
+            next = (int64_t)speed + params.max_lead;
+        }
+        trajectory = next;
+
+        int64_t command = (int64_t)params.duty_per_speed * trajectory + (int64_t)params.duty_per_acceleration * acceleration;
+        if (speed != 0) {
+            command += (int64_t)params.p * (trajectory - speed);
+        }
+        int32_t back_emf_speed = (speed != 0) ? speed : trajectory; // before the first measurement, assume the rotor follows the feedforward
+        int64_t current_limit = ((int64_t)params.duty_per_speed * back_emf_speed >> q) + params.stall_duty;
+        command = constrain(command >> q, (int64_t)0, current_limit);
+
+        float scale = (battery > 1) ? params.nominal_battery / battery : 1; // a dead battery reading shouldn't make the duty cycle explode
+        duty = constrain((int32_t)(command * scale), 0, out_high);
+        return duty;
+    }
+    /**
+     * @brief  the speed the trajectory is at
+     */
+    int32_t reference()
+    {
+        return trajectory;
+    }
+    /**
+     * @brief  the duty cycle from the last calculate(), so the next controller can start from it
+     */
+    int32_t lastDuty()
+    {
+        return duty;
+    }
+};
+
+#endif // SPINUP_H
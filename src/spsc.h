@@ -0,0 +1,140 @@
+/**
+ * spsc.h contains the two ways data is passed between the ISRs and loop() without disabling interrupts: a ring buffer for a stream of events,
+ * and a seqlock for a struct that is replaced as a whole (ex: the latest measurement of the rotation).
+ * Both have exactly one writer and one reader. On the Cortex-M0+ a load or store of up to 32 aligned bits is atomic, but there's no
+ * exclusive load/store, so nothing here is read-modify-written by both sides. __DMB() orders the data against the index or sequence
+ * that publishes it, and also stops the compiler from moving accesses across it.
+ */
+#ifndef SPSC_H
+#define SPSC_H
+#include <Arduino.h>
+
+/**
+ * @brief  Single producer, single consumer ring buffer.
+ * @note   The producer only moves head and the consumer only moves tail, so either can interrupt the other at any point.
+ *      If the consumer falls behind, new items are dropped (and counted) instead of overwriting ones it may be reading.
+ *      Holds size - 1 items, one slot is kept empty to tell a full ring from an empty one.
+ * @param  T: type of an item, copied in and out
+ * @param  size: number of slots, a power of 2 up to 32768
+ */
+template <typename T, uint16_t size>
+class SpscRing {
+    static_assert(size >= 2 && size <= 32768 && (size & (size - 1)) == 0, "the indices wrap around with a mask");
+
+    T items[size];
+    volatile uint16_t head; // next slot to write, only changed by push()
+    volatile uint16_t tail; // next slot to read, only changed by pop()
+    volatile uint16_t dropped_items; // only changed by push()
+
+public:
+    SpscRing()
+    {
+        head = 0;
+        tail = 0;
+        dropped_items = 0;
+    }
+    /**
+     * @brief  call from the producer
+     * @retval false if the ring was full and the item was dropped
+     */
+    bool push(const T& item)
+    {
+        uint16_t next = (head + 1) & (size - 1);
+        if (next == tail) {
+            dropped_items = dropped_items + 1;
+            return false;
+        }
+        items[head] = item;
+        __DMB(); // the item is written before the consumer can see the new head
+        head = next;
+        return true;
+    }
+    /**
+     * @brief  call from the consumer
+     * @retval false if the ring is empty
+     */
+    bool pop(T& item)
+    {
+        uint16_t current = tail;
+        if (current == head) {
+            return false;
+        }
+        __DMB(); // the item is read after the head that published it
+        item = items[current];
+        __DMB(); // the item is read before the producer can reuse its slot
+        tail = (current + 1) & (size - 1);
+        return true;
+    }
+    /**
+     * @brief  items waiting to be popped, call from either side (the other side can change it right after)
+     */
+    uint16_t available()
+    {
+        return (head - tail) & (size - 1);
+    }
+    /**
+     * @brief  items dropped because the ring was full
+     */
+    uint16_t dropped()
+    {
+        return dropped_items;
+    }
+};
+
+/**
+ * @brief  A struct that one side replaces as a whole and the other side reads a consistent copy of, without a lock.
+ * @note   The writer makes the sequence odd, writes the data and makes the sequence even again. The reader copies the data and
+ *      copies it again if the sequence was odd or changed in the meantime. A read only retries if the writer ran in the middle of it,
+ *      so the writer has to be able to interrupt the reader (ex: the writer is an ISR and the reader is loop()), never the other way around.
+ * @param  T: type of the snapshot, keep it small, it is copied by both sides
+ */
+template <typename T>
+class Seqlock {
+    T data;
+    volatile uint32_t sequence; // odd while write() is changing data
+
+public:
+    Seqlock()
+    {
+        data = T();
+        sequence = 0;
+    }
+    /**
+     * @brief  replaces the snapshot, call from the writer
+     */
+    void write(const T& value)
+    {
+        sequence = sequence + 1;
+        __DMB(); // the sequence is odd before any of the data changes
+        data = value;
+        __DMB(); // all of the data has changed before the sequence is even again
+        sequence = sequence + 1;
+    }
+    /**
+     * @brief  copies the snapshot, call from the reader
+     * @param  value: set to the latest snapshot
+     * @retval number of write()s that the snapshot is from, lets the reader tell whether anything was written since its last read
+     */
+    uint32_t read(T& value)
+    {
+        uint32_t before;
+        uint32_t after;
+        do {
+            before = sequence;
+            __DMB();
+            value = data;
+            __DMB();
+            after = sequence;
+        } while ((before & 1) || before != after);
+        return before >> 1;
+    }
+    /**
+     * @brief  number of write()s so far, without copying the snapshot
+     */
+    uint32_t version()
+    {
+        return sequence >> 1;
+    }
+};
+
+#endif // SPSC_H
@@ -13,37 +13,122 @@
 
 #define APPLICATION 3 // 0=display the speed, 1==display the time, 2==IR and watchdog test, 3== both 1 and 2
 
+// #define PRINT_LOOP_STATS // uncomment to print loop()'s idle time and control latency, the chosen speed setpoint and other stats to Serial every 5 seconds
+
+// #define APA102_FRAMEBUFFER // uncomment to store the image already encoded for the LEDs, so TC3_Handler only sends bytes (uses 15 KB of RAM instead of 9 KB)
+// #define APA102_DMA // uncomment to send columns with DMA triggered by TC3 instead of from TC3_Handler (requires APA102_FRAMEBUFFER, uses 6 KB more RAM)
+
+// #define PALETTE_BITS 1 // uncomment to store each pixel as an index into a palette of 2^PALETTE_BITS colors (1, 2 or 4), looked up as each column is shown (the images use 375 bytes of RAM with 1 bit instead of 9 KB)
+
+#if defined(APA102_DMA) && !defined(APA102_FRAMEBUFFER)
+#error "APA102_DMA sends the encoded columns of APA102_FRAMEBUFFER, define both"
+#endif
+#if defined(PALETTE_BITS) && defined(APA102_FRAMEBUFFER)
+#error "PALETTE_BITS and APA102_FRAMEBUFFER are two formats of the same images, define at most one"
+#endif
+
+#include "adc.h"
+#include "apa102.h"
+#include "apa102_dma.h"
+#include "autotune.h"
 #include "clock_time.h"
+#include "events.h"
 #include "font.h"
+#include "framebuffer.h"
+#include "fsm.h"
 #include "fsm_types.h"
+#include "ir_direction.h"
+#include "ir_remote.h"
+#include "motor_pwm.h"
+#include "palette.h"
 #include "pid.h"
+#include "render_scheduler.h"
+#include "rotation.h"
+#include "rtc.h"
+#include "spinup.h"
+#include "spsc.h"
+#include "supervisor.h"
+#include "text_renderer.h"
+#include "time_of_day.h"
+#include "time_sync.h"
 #include "timer.h"
 #include "unit_tests.h"
+#include "warm_restart.h"
 #include "watchdog.h"
-#include <CircularBuffer.h> // https://github.com/rlogiacco/CircularBuffer
 #include <FastLED.h> //https://github.com/FastLED/FastLED/
 #include <SPI.h>
 
-PID motorPid;
-
 const unsigned long wait_interval_micros = 2000000; // time between pressing start button and spinning up
 const unsigned long down_time = 1500000; // if it's been this long since a beam break measurement, consider the clock to have finished spinning down
 const unsigned long spinup_timeout = 5000000; // if the target speed hasn't been reached after this time in microseconds, stop spinning up and turn the motor off
-const unsigned int spinup_divider = 2000; // analogWrite (time in microseconds) / (spinup_divider) used to make the clock start more smoothly
 const float bat_voltage_scaler = 0.01; // used to calibrate battery monitor; multiplied by analogRead
 const float bat_voltage_low_thresh = 6.5; // clock stops spinning if batteries go below this voltage
+const unsigned long fsm_poll_interval = 125000; // updateFSM() runs on every beam break, and this long after its last run when there isn't one (ex: timeouts, a stopped rotor)
+const unsigned long render_interval = 100000; // while the image isn't displayed, a new frame is drawn this often (renderScheduler times them while it is)
+const uint8_t revolutions_per_frame = 1; // a fresh frame for every revolution
+const uint32_t render_margin = 2000; // microseconds between the expected end of a render and the beam break that displays it
+const unsigned long housekeeping_interval = 100000; // the battery is measured and the watchdog petted this often
+const unsigned long stats_interval = 5000000; // PRINT_LOOP_STATS prints this often
+const unsigned long warm_restart_settle = 10000; // milliseconds after startup, a reset after this isn't counted as one of a reset loop
+const uint8_t max_warm_resumes = 5; // resets in a row that are resumed from, then the saved state is taken as the cause and dropped
+const unsigned long sync_quiet_time = 20000000; // microseconds without a button press before connecting to WiFi may block loop() (up to wifi_connect_timeout), so it never delays the start button after boot
+const uint32_t time_sync_max_wait = 60000; // milliseconds, timeSync is updated at least this often (deadlines have to be less than 35 minutes away)
+const uint32_t motor_pwm_frequency = MOTOR_PWM_CLOCK >> MOTOR_DUTY_BITS; // 11.7 kHz, the highest carrier with a full MOTOR_DUTY_BITS of resolution
 
 const uint8_t speed_unit_devisor_power = 12; // to provide more resolution for speed measurements in RPS, they are multiplied by 2^speed_unit_devisor_power
 const uint32_t speed_unit_devisor = (1 << speed_unit_devisor_power); // 2^speed_unit_devisor_power
 int32_t speed_setpoint = speed_unit_devisor * 10 / 1; // the second two numbers represent a fractional Rotations Per Second value
 
+// the integral is held while the clock is well below the setpoint (recovering from a disturbance), so it doesn't wind up and overshoot
+constexpr PidGains motor_gains[] = {
+    { speed_unit_devisor * 19 / 2, 0, 288, 1600, 0, 0 }, // below 9.5 rotations per second
+    { INT32_MAX, 0, 288, 1600, 320, 0 }, // steady state, the gains that PID used scaled from 8 to 12 bit duty cycles
+};
+const uint8_t motor_gains_length = sizeof(motor_gains) / sizeof(motor_gains[0]);
+FixedPid<speed_unit_devisor_power, 0, MOTOR_DUTY_MAX> motorPid(motor_gains, motor_gains_length); // output is the writeMotorPwm() duty cycle
+int32_t motor_control = 0; // last duty cycle written to the motor (by spinUp, motorPid or motorTuner), motorPid starts from it and the relay of s06_AUTO_TUNING switches around it
+
+// pressing start while running measures the motor loop with a relay experiment, and replaces the p and i terms of motor_gains
+RelayTuner motorTuner;
+PidGains tuned_motor_gains[motor_gains_length];
+const int32_t tuning_relay_amplitude = 480; // duty cycle units above and below motor_control
+const int32_t tuning_hysteresis = speed_unit_devisor / 32; // more than the noise of the speed measurement
+const unsigned long tuning_timeout = 30000000; // go back to running with the old gains if the experiment hasn't finished after this many microseconds
+
+// spin up along a speed trajectory, the feedforward terms are motor_gains' f term and the rotor's time constant of about 1.5 seconds
+constexpr SpinUpParameters spinup_parameters = {
+    speed_unit_devisor * 6, // accelerate at up to 6 rotations per second per second
+    speed_unit_devisor / 2, // don't get more than half a rotation per second ahead of the rotor
+    288, // duty cycle per speed, same as motor_gains' f
+    432, // duty cycle per speed per second, 288 * 1.5 seconds
+    1920, // duty cycle above the back EMF that the motor's stall current allows
+    1600, // same as motor_gains' p
+    8.4, // the feedforward terms were measured on a full battery
+};
+SpinUpController<speed_unit_devisor_power, MOTOR_DUTY_MAX> spinUp(spinup_parameters);
+const uint8_t spinup_handover_divider = 20; // motorPid takes over at 1/20 (5%) below the setpoint, instead of waiting for the rotor to creep up to it
+
+// while running, speed_setpoint is raised in steps as long as the rotor stays steady, see supervisor.h
+constexpr SupervisorParameters supervisor_parameters = {
+    speed_unit_devisor * 39 / 4, // a worn rotor can slow down to 9.75 rotations per second
+    speed_unit_devisor * 12, // a well balanced one can speed up to 12
+    speed_unit_devisor / 4, // in steps of a quarter rotation per second
+    speed_unit_devisor / 2, // keep half a rotation per second away from too_slow_rotation_interval and too_fast_rotation_interval
+    4, // columns land within 1.4 degrees of where they should on average
+    MOTOR_DUTY_MAX * 9 / 10, // keep a tenth of the duty cycle for correcting disturbances
+    0.3, // volts above bat_voltage_low_thresh
+    5000000, // decide every 5 seconds
+    2000000, // after the PID has had 2 seconds to reach a new setpoint
+};
+SetpointSupervisor setpointSupervisor(supervisor_parameters, speed_setpoint);
+
 uint32_t too_slow_rotation_interval = 1000000 / 9; // devisor is threshold in rotations per second, converts to microseconds per rotation
 uint32_t too_fast_rotation_interval = 1000000 / 13; // devisor is threshold in rotations per second, converts to microseconds per rotation
 
 const byte START_BUTTON_PIN = 1;
 const byte STOP_BUTTON_PIN = 0;
 const byte BAT_VOLT_PIN = A1;
-const byte MOTOR_CTRL_PIN = 7;
+const byte MOTOR_CTRL_PIN = 7; // TCC0 WO[7], see motor_pwm.h
 const byte PIEZO_PIN = 4;
 const byte BEAM_BREAK_PIN = A2;
 const byte LEDS_DATA_PIN = 8;
@@ -53,20 +138,85 @@ const byte IR_PIN = 5;
 const byte image_height = 8; // number of leds in vertical column
 CRGB leds[image_height]; // CRGB is used by FastLED to represent colors
 
-const int image_width = 125; // Horizontal resolution of display; do not set to above 2100 (causes overflow in calculation of isrRate)
-CRGB staged_image[image_width][image_height] = { 0 }; // buffer to print characters to
-CRGB current_image[image_width][image_height]; // buffer being displayed
-volatile bool staged_image_new; // we want this to be atomic
-volatile unsigned long last_rotation_micros; // interval of most recent complete rotation
-volatile unsigned long last_beam_break_micros;
+const int image_width = 125; // Horizontal resolution of display, limited by RAM (each column is 24 bytes in each of the framebuffer's 3 images, 1 to 4 with PALETTE_BITS)
+#ifdef APA102_FRAMEBUFFER
+typedef Apa102Column ImageColumn; // columns are encoded when they are drawn, not every time they are shown
+typedef CRGB ImageColor;
+static_assert(image_height == APA102_LEDS, "Apa102Column is one column of LEDs");
+#elif defined(PALETTE_BITS)
+typedef PaletteColumn<PALETTE_BITS> ImageColumn; // pixels are indices into the image's palette in image_palettes
+typedef uint8_t ImageColor;
+static_assert(image_height == 8, "PaletteColumn is one column of 8 LEDs");
+#else
+typedef CRGB ImageColumn[image_height];
+typedef CRGB ImageColor;
+#endif
+TripleBuffer<ImageColumn, image_width> framebuffer; // loop() prints characters to framebuffer.drawBuffer(), TC3_Handler displays framebuffer.displayBuffer()
+#ifdef PALETTE_BITS
+CRGB image_palettes[3][ImageColumn::COLORS]; // the colors of each of framebuffer's images, by drawIndex() and displayIndex(). Index 0 stays black
+#endif
+#ifdef APA102_DMA
+Apa102Dma<image_width> apa102Dma; // sends framebuffer.displayBuffer() one column per TC3 compare match, TC3_Handler only schedules the compares
+#endif
+TextRenderer<3, ImageColumn, ImageColor> textRenderer; // only redraws the characters that changed since each of the framebuffer's images was last drawn
+RotationEstimator rotationEstimator; // filters the beam break timestamps, rejecting double triggers and missed breaks
+Seqlock<RotationSnapshot> rotation_snapshot; // written by beamBreakIsr, read by loop()
+volatile bool displaying = false; // set by updateFSM() while the image should be displayed, the ISRs read it instead of state
 volatile int column_counter; // incremented by timer ISR, used to know what column of the image to send to the LEDs
-volatile unsigned long start_micros; // variable for state machine (so it's an extended state machine)
+unsigned long start_micros; // variable for state machine (so it's an extended state machine)
+unsigned long last_button_micros; // when a button was last pressed, or setup() ran, see sync_quiet_time
+
+// loop() handles one event at a time and sleeps when there are none, see events.h
+enum EventSource : uint8_t {
+    PIN_EVENTS, // beamBreakIsr, startButtonIsr and stopButtonIsr, which all run from EIC_Handler so they are one producer
+    ADC_EVENTS, // ADC_Handler
+    EVENT_SOURCES
+};
+enum DeadlineId : uint8_t {
+    FSM_DEADLINE, // fsm_poll_interval after the last updateFSM()
+    RENDER_DEADLINE, // set by renderScheduler while displaying, every render_interval otherwise
+    HOUSEKEEPING_DEADLINE, // every housekeeping_interval
+    SYNC_DEADLINE, // whenever timeSync asks for its next update, with APPLICATION 1 or 3
+    STATS_DEADLINE, // every stats_interval, with PRINT_LOOP_STATS
+    DEADLINES
+};
+EventQueue<EVENT_SOURCES, DEADLINES, 16> events;
+LoopStats loopStats;
+RenderScheduler renderScheduler(revolutions_per_frame, render_margin); // draws each frame just before the beam break that displays it
 
 // used for the IR receiver
-volatile unsigned long last_ir_micros;
-volatile boolean ir_buf_lock = false;
 int most_recent_ir_angle = -1;
-CircularBuffer<int, 50> ir_buf; // stores data for calculating what direction the IR remote is
+IrDirection<image_width> irDirection; // readIrRemote() adds the columns IR light is seen in, loop() reads the direction of the remote
+SpscRing<IrEdge, 128> ir_edges; // written by irEdgeIsr, read by readIrRemote(), a NEC frame is 68 edges
+NecDecoder necDecoder;
+int16_t ir_light_column = -1; // column the receiver started seeing light in, -1 if it isn't or the image wasn't displayed
+NecFrame last_ir_frame = { 0, 0, false, -1 }; // the last command from the remote
+unsigned long last_ir_frame_micros = 0;
+bool has_ir_frame = false;
+
+// a watchdog reset continues from the state loop() saved, instead of spinning down and getting the time again, see warm_restart.h
+struct WarmState {
+    TimeSyncState time_sync;
+    int64_t pid_integral;
+    int32_t motor_control;
+    int32_t speed_setpoint;
+    uint32_t rotation_interval;
+    State state;
+    uint8_t resumes; // resets in a row that were resumed from
+};
+WarmRestartBlock<WarmState> warm_restart __attribute__((section(".noinit"))); // saved every housekeeping_interval, read by setup()
+uint8_t warm_resumes = 0; // resumes before this startup, 0 once it has run for warm_restart_settle
+
+#ifdef APA102_DMA
+// The build recorded in platformio.ini (the code before the framebuffer formats) used 15660 bytes of RAM, 11000 of them its HTTP buffer
+// and two CRGB images, so the libraries (WiFi101, FastLED, Serial) and the small globals take at most the rest.
+// APA102_DMA's images and descriptor chains are the biggest RAM user, with the other large globals they have to leave room for the stack.
+const uint32_t measured_other_ram = 15660 - 5000 - 2 * image_width * image_height * sizeof(CRGB);
+const uint32_t stack_reserve = 4096;
+static_assert(sizeof(framebuffer) + sizeof(apa102Dma) + sizeof(textRenderer) + sizeof(events) + sizeof(ir_edges) + sizeof(timeSync) + sizeof(warm_restart)
+        <= 32768 - measured_other_ram - stack_reserve,
+    "APA102_DMA's images and descriptor chains don't fit in the SAMD21's 32 KB of RAM, reduce image_width");
+#endif
 
 void setup()
 {
@@ -76,21 +226,24 @@ void setup()
     pinMode(STOP_BUTTON_PIN, INPUT_PULLUP);
     pinMode(BAT_VOLT_PIN, INPUT);
     pinMode(BEAM_BREAK_PIN, INPUT);
+    pinMode(IR_PIN, INPUT);
 
-    analogWrite(MOTOR_CTRL_PIN, 0);
+    setupMotorPwm(MOTOR_CTRL_PIN, motor_pwm_frequency); // the motor starts off
 
+#ifdef APA102_FRAMEBUFFER
+    setupApa102(); // LEDS_DATA_PIN and LEDS_CLOCK_PIN are the SPI pins
+#else
     FastLED.addLeds<APA102, LEDS_DATA_PIN, LEDS_CLOCK_PIN, BGR>(leds, image_height); // https://learn.sparkfun.com/tutorials/lumenati-hookup-guide#example-using-a-samd21-mini-breakout
+    FastLED.setDither(DISABLE_DITHER); // so the same colors are sent as in APA102_FRAMEBUFFER mode
+#endif
 
-    motorPid = PID(0, 18, 100, 20, 0, 0, 255, speed_unit_devisor_power);
-
-    staged_image_new = false;
-    last_rotation_micros = 0;
     column_counter = 0;
-    last_beam_break_micros = micros();
+    rotation_snapshot.write({ micros(), 0, 0, 0 }); // before beamBreakIsr is attached, it is the only writer afterwards
 
-    fsm_input.last_beam_break = last_beam_break_micros;
+    fsm_input.last_beam_break = micros();
     fsm_input.micros = micros();
     fsm_input.rotation_interval = 0;
+    fsm_input.rotation_jitter = 0;
     fsm_input.start_button = false;
     fsm_input.stop_button = false;
     fsm_input.bat_volt = 0;
@@ -105,64 +258,248 @@ void setup()
     runAllTests(); // runAllTests never exits
 #endif
 
-#if ((APPLICATION == 1) || (APPLICATION == 3))
-    leds[0] = CRGB(0, 0, 255);
-    FastLED.show();
-    getStartTime(); // takes a few seconds to connect to wifi and get the time
-    leds[0] = CRGB(0, 0, 0);
-    FastLED.show();
-
-#endif
+    WarmState warm;
+    bool warm_boot = (PM->RCAUSE.reg & (PM_RCAUSE_WDT | PM_RCAUSE_SYST)) && warm_restart.load(warm) && warm.resumes < max_warm_resumes;
+    bool rtc_kept = setupRtc(warm_boot); // the time base of timeSync, which gets the time in the background once loop() runs
 
     clearDisplay();
 
     setupTimer(); // prepare to use a timer interrupt (for timing the update of the LEDs)
+#if ((APPLICATION == 1) || (APPLICATION == 3))
+    wifiNet.begin(); // before the watchdog, starting the WINC1500 takes longer than its timeout
+#endif
     setupWatchdog(); // configures and starts watchdog timer
+    fsm_input.bat_volt = analogRead(BAT_VOLT_PIN) * bat_voltage_scaler;
+    setupAdcInterrupt(BAT_VOLT_PIN, 3); // the lowest priority, ADC_Handler only queues the result
+#ifdef APA102_DMA
+    const Apa102Column* const images[3] = { framebuffer.image(0), framebuffer.image(1), framebuffer.image(2) };
+    apa102Dma.setup(images);
+#endif
 
+    if (warm_boot) {
+        resumeFromWarmRestart(warm, rtc_kept); // before beamBreakIsr is attached, it seeds rotationEstimator
+    }
     attachInterrupt(BEAM_BREAK_PIN, beamBreakIsr, FALLING);
+    setupBeamBreakCapture(BEAM_BREAK_PIN); // TC3 timestamps the same falling edges
     attachInterrupt(START_BUTTON_PIN, startButtonIsr, FALLING); // buttons pull pins low when pressed
     attachInterrupt(STOP_BUTTON_PIN, stopButtonIsr, FALLING);
+    attachInterrupt(IR_PIN, irEdgeIsr, CHANGE); // the receiver's output is low while it sees the remote's carrier
+
+    unsigned long now = micros();
+    last_button_micros = now;
+    events.arm(FSM_DEADLINE, now);
+    events.arm(RENDER_DEADLINE, now);
+    events.arm(HOUSEKEEPING_DEADLINE, now);
+#if ((APPLICATION == 1) || (APPLICATION == 3))
+    events.arm(SYNC_DEADLINE, now);
+#endif
+#ifdef PRINT_LOOP_STATS
+    events.arm(STATS_DEADLINE, now + stats_interval);
+#endif
+    loopStats.start(readTimer32());
 }
 
+/**
+ * @brief  Handles the next event, or sleeps until an interrupt if there isn't one. Every handler runs to completion.
+ * @note   Interrupts stay enabled, the ISRs only queue what they measured and never run the FSM themselves.
+ *      SysTick (millis()) wakes the core every millisecond, which is how often expired deadlines are noticed.
+ */
 void loop()
 {
-    float bat_voltage = analogRead(BAT_VOLT_PIN) * bat_voltage_scaler;
-    noInterrupts();
-    fsm_input.bat_volt = bat_voltage;
-    fsm_input.last_beam_break = last_beam_break_micros;
+    Event event;
+    if (!events.next(event, micros())) {
+        uint32_t sleep_start = readTimer32();
+        __disable_irq(); // an event queued between next() and __WFI() would otherwise wait for the interrupt after it
+        if (!events.hasEvents()) {
+            __WFI(); // wakes up on a pending interrupt even though they are masked, which then runs at __enable_irq()
+        }
+        __enable_irq();
+        loopStats.addIdle(readTimer32() - sleep_start);
+        return;
+    }
+    switch (event.type) {
+    case EventType::BEAM_BREAK:
+        runFsm(false, false); // with the interval the beam break just measured
+        loopStats.addLatency(readTimer32() - event.value);
+        scheduleRender();
+        break;
+    case EventType::BUTTON:
+        last_button_micros = micros();
+        runFsm(event.id == (uint8_t)ButtonPress::START, event.id == (uint8_t)ButtonPress::STOP);
+        break;
+    case EventType::ADC_COMPLETE:
+        fsm_input.bat_volt = event.value * bat_voltage_scaler;
+        break;
+    case EventType::DEADLINE:
+        if (event.id == FSM_DEADLINE) {
+            runFsm(false, false);
+        } else if (event.id == RENDER_DEADLINE) {
+            renderScheduler.renderStarted(micros());
+            render();
+            renderScheduler.renderFinished(micros());
+            if (!displaying) { // otherwise the next beam break schedules the next frame
+                events.arm(RENDER_DEADLINE, nextPeriod(event.value, render_interval));
+            }
+        } else if (event.id == HOUSEKEEPING_DEADLINE) {
+            events.arm(HOUSEKEEPING_DEADLINE, nextPeriod(event.value, housekeeping_interval));
+            startAdcConversion(); // ADC_Handler queues the result
+            petWatchdog();
+            saveWarmState();
+        } else if (event.id == SYNC_DEADLINE) {
+            bool can_block = state == State::s01_MOTOR_OFF && micros() - last_button_micros > sync_quiet_time; // connecting takes seconds, only while nobody is using the clock
+            uint32_t wait = min(updateTimeSync(can_block), time_sync_max_wait);
+            events.arm(SYNC_DEADLINE, micros() + wait * 1000);
+        } else if (event.id == STATS_DEADLINE) {
+            events.arm(STATS_DEADLINE, nextPeriod(event.value, stats_interval));
+            printLoopStats();
+        }
+        break;
+    }
+}
+
+/**
+ * @brief  continues from the state loop() saved before a watchdog reset: the time, and the motor and the image if the clock was running
+ * @param  rtc_kept: the RTC kept counting through the reset, so the saved time base is still valid
+ * @note   The first beam break starts the columns with the saved interval as its prediction, so the image is back within a revolution.
+ *      If the rotor stopped in the meantime, shouldStopRunning() sees no beam breaks and the clock spins down as usual.
+ *      An auto tuning experiment isn't continued, the clock goes back to running with the gains from before it.
+ */
+void resumeFromWarmRestart(const WarmState& warm, bool rtc_kept)
+{
+    warm_resumes = warm.resumes + 1;
+    if (rtc_kept) {
+        timeSync.restore(warm.time_sync, readRtcTicks());
+    }
+    speed_setpoint = warm.speed_setpoint;
+    setpointSupervisor.restoreSetpoint(speed_setpoint);
+    if ((warm.state != State::s04_RUNNING && warm.state != State::s06_AUTO_TUNING) || warm.rotation_interval == 0) {
+        if (warm.state == State::s03_SPINNING_UP || warm.state == State::s05_SPINNING_DOWN) {
+            state = State::s05_SPINNING_DOWN; // the reset turned the motor off, wait for the rotor to stop
+        }
+        return;
+    }
+    unsigned long now = micros();
+    state = State::s04_RUNNING;
+    rotationEstimator.seed(warm.rotation_interval);
+    rotation_snapshot.write({ now, warm.rotation_interval, warm.rotation_interval, 0 });
+    fsm_input.last_beam_break = now;
+    fsm_input.rotation_interval = warm.rotation_interval;
+    motor_control = warm.motor_control;
+    motorPid.initialize_time(now);
+    motorPid.restoreIntegral(warm.pid_integral);
+    writeMotor(motor_control);
+    irDirection.reset();
+    startSupervisor(now);
+    displaying = true; // beamBreakIsr starts the columns at the next beam break
+}
+
+/**
+ * @brief  saves what resumeFromWarmRestart() needs, call often enough that it's at most a revolution old (ex: every housekeeping_interval)
+ */
+void saveWarmState()
+{
+    if (warm_resumes != 0 && millis() > warm_restart_settle) { // ran long enough that the resets weren't a loop
+        warm_resumes = 0;
+    }
+    warm_restart.save({ timeSync.save(), motorPid.integralTerm(), motor_control, speed_setpoint, (uint32_t)fsm_input.rotation_interval, state, warm_resumes });
+}
+
+/**
+ * @brief  runs updateFSM() with the latest rotation from beamBreakIsr, and runs it again fsm_poll_interval later unless a beam break comes first
+ * @param  start_button: the start button was pressed
+ * @param  stop_button: the stop button was pressed
+ */
+void runFsm(bool start_button, bool stop_button)
+{
+    RotationSnapshot rotation = readRotation();
+    fsm_input.last_beam_break = rotation.last_beam_break;
+    fsm_input.rotation_interval = rotation.interval;
+    fsm_input.rotation_jitter = rotation.jitter;
+    fsm_input.start_button = start_button;
+    fsm_input.stop_button = stop_button;
     fsm_input.micros = micros();
-    fsm_input.rotation_interval = last_rotation_micros;
-    fsm_input.start_button = false; // ISRs set it true
-    fsm_input.stop_button = false;
     state = updateFSM(state, fsm_input);
-    interrupts();
+    events.arm(FSM_DEADLINE, fsm_input.micros + fsm_poll_interval);
+}
 
-    int irAngle = getIRAngle();
+/**
+ * @brief  the latest rotation published by beamBreakIsr
+ */
+RotationSnapshot readRotation()
+{
+    RotationSnapshot rotation;
+    rotation_snapshot.read(rotation);
+    if (rotationEstimator.resetPending()) { // the snapshot is from before updateFSM() asked for a new history
+        rotation.interval = 0;
+        rotation.predicted_interval = 0;
+        rotation.jitter = 0;
+    }
+    return rotation;
+}
+
+/**
+ * @brief  call after a beam break, schedules the render of the frame for a coming beam break while the image is displayed
+ */
+void scheduleRender()
+{
+    RotationSnapshot rotation = readRotation();
+    unsigned long start;
+    if (displaying && renderScheduler.beamBreak(rotation.last_beam_break, rotation.predicted_interval, micros(), start)) {
+        events.arm(RENDER_DEADLINE, start);
+    } else if (!events.isArmed(RENDER_DEADLINE)) { // no prediction to schedule from, keep drawing frames
+        events.arm(RENDER_DEADLINE, micros() + render_interval);
+    }
+}
+
+/**
+ * @brief  when a periodic deadline that was due at due is due next, skipping periods that were missed instead of running them all late
+ */
+unsigned long nextPeriod(unsigned long due, unsigned long period)
+{
+    unsigned long next = due + period;
+    if ((long)(micros() - next) >= 0) {
+        next = micros() + period;
+    }
+    return next;
+}
+
+/**
+ * @brief  reads the IR remote, draws the next frame and publishes it
+ */
+void render()
+{
+    readIrRemote();
+    int irAngle = irDirection.direction();
     if (irAngle != -1) { // if new valid angle is available
         most_recent_ir_angle = irAngle;
     }
 
+    long x_pos = 0; // column the text starts at, applied when the frame is published so moving text doesn't have to be redrawn
+
 #if APPLICATION == 0
     char text[20];
-    clearDisplay();
-    sprintf(text, "speed = %d", 1000000 / last_rotation_micros);
-    printString(text, 0, CHSV(0, 0, 145), CRGB(0, 0, 0), staged_image, image_width);
+    sprintf(text, "speed = %d", (int)(1000000 / max(fsm_input.rotation_interval, 1UL)));
+    printText(text, CHSV(0, 0, 145));
 #endif
 #if APPLICATION == 1
-    clearDisplay();
-    char* text = getCurrentTime();
-    printString(text, -millis() / 60, CHSV(millis() / 10, 255, 245), CRGB(0, 0, 0), staged_image, image_width);
+    const char* text = getCurrentTime();
+    x_pos = -millis() / 60;
+    printText(text, CHSV(millis() / 10, 255, 245));
 #endif
 
 #if APPLICATION == 2
     char text[20];
-    if (most_recent_ir_angle == -1 || micros() - last_ir_micros > 5000000) { // clear display if no ir angle or it's been 5 seconds
+    if (most_recent_ir_angle == -1 || micros() - irDirection.lastHit() > 5000000) { // clear display if no ir angle or it's been 5 seconds
         most_recent_ir_angle = -1;
         clearDisplay();
     } else { // show text
-        clearDisplay();
-        sprintf(text, "%d", (int)((millis() / 1000) % 1000));
-        printString(text, most_recent_ir_angle, CHSV(0, 0, 145), CRGB(0, 0, 0), staged_image, image_width);
+        if (has_ir_frame && micros() - last_ir_frame_micros < 5000000) { // show the remote's command
+            sprintf(text, "%02X", last_ir_frame.command);
+        } else {
+            sprintf(text, "%d", (int)((millis() / 1000) % 1000));
+        }
+        x_pos = most_recent_ir_angle;
+        printText(text, CHSV(0, 0, 145));
         if (most_recent_ir_angle > 100) {
             delay(300); // causes watchdog timer to reboot the MCU
         }
@@ -171,124 +508,308 @@ void loop()
 
 #if APPLICATION == 3
     char text[20];
-    if (most_recent_ir_angle == -1 || micros() - last_ir_micros > 10000000) { // show time if no ir angle or it's been 10 seconds
+    if (most_recent_ir_angle == -1 || micros() - irDirection.lastHit() > 10000000) { // show time if no ir angle or it's been 10 seconds
         most_recent_ir_angle = -1;
-        clearDisplay();
-        char* text = getCurrentTime();
-        printString(text, -millis() / 60, CHSV(millis() / 10, 255, 245), CRGB(0, 0, 0), staged_image, image_width);
+        const char* text = getCurrentTime();
+        x_pos = -millis() / 60;
+        printText(text, CHSV(millis() / 10, 255, 245));
     } else { // show text
-        clearDisplay();
         sprintf(text, "1600");
-        printString(text, most_recent_ir_angle - 15, CHSV(millis() / 10, 255, 255), CRGB(0, 0, 0), staged_image, image_width);
+        x_pos = most_recent_ir_angle - 15;
+        printText(text, CHSV(millis() / 10, 255, 255));
         if (most_recent_ir_angle > 110) {
             delay(300); // causes watchdog timer to reboot the MCU
         }
     }
 #endif
 
-    staged_image_new = true;
+    framebuffer.publish(((-x_pos % image_width) + image_width) % image_width); // column x_pos of the display shows column 0 of the image
+}
 
-    petWatchdog();
-    delay(100);
+/**
+ * @brief  prints the idle time and control latency since the last call, the setpoint setpointSupervisor chose and why, and the FSM's recent transitions,
+ *      with PRINT_LOOP_STATS
+ */
+void printLoopStats()
+{
+    LoopStats::Report report = loopStats.report(readTimer32());
+    Serial.print("idle %: ");
+    Serial.print(report.idle_permille / 10.0);
+    Serial.print(" latency us mean/max: ");
+    Serial.print(report.latency_mean);
+    Serial.print("/");
+    Serial.print(report.latency_max);
+    Serial.print(" revolutions: ");
+    Serial.print(report.latency_samples);
+    Serial.print(" dropped events: ");
+    Serial.println(events.dropped());
+    Serial.print("frames published/missed: ");
+    Serial.print(renderScheduler.framesPublished());
+    Serial.print("/");
+    Serial.print(renderScheduler.framesMissed());
+    Serial.print(" render us estimate/last: ");
+    Serial.print(renderScheduler.renderTime());
+    Serial.print("/");
+    Serial.print(renderScheduler.lastRenderTime());
+    Serial.print(" skipped frames: ");
+    Serial.print(framebuffer.framesSkipped());
+    Serial.print(" stale revolutions: ");
+    Serial.println(framebuffer.staleFlips());
+    Serial.print("time syncs/failures: ");
+    Serial.print(timeSync.syncCount());
+    Serial.print("/");
+    Serial.print(timeSync.failureCount());
+    Serial.print(" last error ticks: ");
+    Serial.print(timeSync.timeBase().lastError());
+    Serial.print(" RTC ppb: ");
+    Serial.println(timeSync.timeBase().frequencyError());
+    const SupervisorStats& setpoint_stats = setpointSupervisor.lastStats();
+    Serial.print("setpoint RPS: ");
+    Serial.print((float)setpointSupervisor.chosenSetpoint() / speed_unit_devisor);
+    Serial.print(" decision: ");
+    Serial.print((int)setpoint_stats.decision); // 0 none yet, 1 hold, 2 raise, 3 back off
+    Serial.print(" raises/back offs: ");
+    Serial.print(setpoint_stats.raises);
+    Serial.print("/");
+    Serial.print(setpoint_stats.back_offs);
+    Serial.print(" jitter mean/peak: ");
+    Serial.print(setpoint_stats.jitter);
+    Serial.print("/");
+    Serial.print(setpoint_stats.peak_jitter);
+    Serial.print(" effort mean/peak: ");
+    Serial.print(setpoint_stats.effort);
+    Serial.print("/");
+    Serial.print(setpoint_stats.peak_effort);
+    Serial.print(" RPS min/max: ");
+    Serial.print((float)setpoint_stats.min_speed / speed_unit_devisor);
+    Serial.print("/");
+    Serial.print((float)setpoint_stats.max_speed / speed_unit_devisor);
+    Serial.print(" min battery V: ");
+    Serial.println(setpoint_stats.min_battery);
+    Serial.print("transitions: ");
+    Serial.print(clockFsm.transitionCount());
+    FsmTraceEntry entry;
+    for (uint8_t age = 0; clockFsm.traced(age, entry); age++) { // newest first
+        Serial.print(" ");
+        Serial.print(clockFsm.row(entry.row).name);
+        Serial.print("@");
+        Serial.print(entry.micros);
+    }
+    Serial.println();
 }
 
-State updateFSM(State state, FsmInput fsm_input)
+/**
+ * @brief  true if the clock has to stop running: stop pressed, too slow or stopped, too fast, or battery low
+ */
+bool shouldStopRunning(const FsmInput& fsm_input)
 {
-    switch (state) {
-    case State::s01_MOTOR_OFF:
-        if (fsm_input.start_button) { // transition 1-2
-            start_micros = micros();
-            playWaitingTone();
-            turnOffBuiltinLed();
-            state = State::s02_WAIT;
-        } else { // 1-1 self loop
-            blinkBuiltinLed();
-        }
-        return state;
-        break;
-    case State::s02_WAIT:
-        if (fsm_input.stop_button) { // transition 2-1
-            stopPlayingTone();
-            state = State::s01_MOTOR_OFF;
-        } else if (fsm_input.micros - start_micros > wait_interval_micros) { // transition 2-3
-            playSpinningUpTone();
-            last_rotation_micros = 0;
-            start_micros = fsm_input.micros;
-            state = State::s03_SPINNING_UP;
-        } else { // 2-2 self loop
-            dangerBlink();
-        }
-        return state;
-        break;
-    case State::s03_SPINNING_UP:
-        if (fsm_input.stop_button) { // transition 3-5a stop pressed
-            turnOffMotor();
-            playSpinningDownTone();
-            state = State::s05_SPINNING_DOWN;
-        } else if (fsm_input.rotation_interval != 0 && fsm_input.rotation_interval <= (int64_t)1000000 * speed_unit_devisor / speed_setpoint) { // transition 3-4
-            // fast enough
-            stopPlayingTone();
-            state = State::s04_RUNNING;
-            ir_buf.clear();
-            most_recent_ir_angle = -1;
-            motorPid.initialize_time(fsm_input.micros);
-        } else if (fsm_input.micros - start_micros > spinup_timeout) { // transition 3-5b timeout
-            turnOffMotor();
-            playSpinningDownTone();
-            state = State::s05_SPINNING_DOWN;
-        } else { // self loop
-            dangerBlink();
+    return fsm_input.stop_button
+        || ((fsm_input.micros - fsm_input.last_beam_break) > too_slow_rotation_interval) // too slow/stopped, rotation_interval doesn't need to update)
+        || (fsm_input.rotation_interval > too_slow_rotation_interval) // too slow
+        || (fsm_input.rotation_interval < too_fast_rotation_interval) // too fast
+        || (fsm_input.bat_volt < bat_voltage_low_thresh); // battery low
+}
+
+/**
+ * @brief  stops displaying the image, beamBreakIsr won't start the column timer again after this
+ */
+void stopDisplaying()
+{
+    displaying = false;
+    __DMB(); // a beam break before this line starts the timer before it is stopped, one after it sees displaying is false
+    stopTimerInterrupts();
+}
+
+/**
+ * @brief  starts a new run of setpointSupervisor, with the thresholds of shouldStopRunning() as its guards
+ */
+void startSupervisor(unsigned long micros)
+{
+    setpointSupervisor.start(speedFromInterval(too_slow_rotation_interval), speedFromInterval(too_fast_rotation_interval), bat_voltage_low_thresh, micros);
+}
+
+/**
+ * @brief  converts a rotation interval in microseconds to a speed in rotations per second * speed_unit_devisor
+ * @retval the speed, 0 if rotation_interval is 0 (not measured yet)
+ */
+int32_t speedFromInterval(unsigned long rotation_interval)
+{
+    if (rotation_interval == 0) {
+        return 0;
+    }
+    return min((int64_t)1000000 * speed_unit_devisor / (int64_t)rotation_interval, (int64_t)INT32_MAX);
+}
+
+// guards of the FSM's transition table
+bool startPressed(const FsmInput& fsm_input)
+{
+    return fsm_input.start_button;
+}
+bool stopPressed(const FsmInput& fsm_input)
+{
+    return fsm_input.stop_button;
+}
+bool waitedLongEnough(const FsmInput& fsm_input)
+{
+    return fsm_input.micros - start_micros > wait_interval_micros;
+}
+bool fastEnoughToRun(const FsmInput& fsm_input)
+{
+    return speedFromInterval(fsm_input.rotation_interval) >= speed_setpoint - speed_setpoint / spinup_handover_divider;
+}
+bool spinUpTimedOut(const FsmInput& fsm_input)
+{
+    return fsm_input.micros - start_micros > spinup_timeout;
+}
+bool tuningFinished(const FsmInput& fsm_input)
+{
+    return !motorTuner.isRunning();
+}
+bool stoppedSpinning(const FsmInput& fsm_input)
+{
+    return fsm_input.micros - fsm_input.last_beam_break > down_time;
+}
+
+// actions of the FSM's transition table
+void blinkWhileOff(const FsmInput& fsm_input)
+{
+    blinkBuiltinLed();
+}
+void blinkWhileMoving(const FsmInput& fsm_input)
+{
+    dangerBlink();
+}
+void startWaiting(const FsmInput& fsm_input)
+{
+    start_micros = fsm_input.micros;
+    playWaitingTone();
+    turnOffBuiltinLed();
+}
+void cancelWaiting(const FsmInput& fsm_input)
+{
+    stopPlayingTone();
+}
+void startSpinningUp(const FsmInput& fsm_input)
+{
+    playSpinningUpTone();
+    rotationEstimator.requestReset();
+    start_micros = fsm_input.micros;
+    spinUp.start(0, fsm_input.micros);
+}
+void spinUpStep(const FsmInput& fsm_input)
+{
+    dangerBlink();
 #ifdef MOCK_FUNCTIONS
-            mock_motor = Mock_Motor::RAMP;
-#else
-            analogWrite(MOTOR_CTRL_PIN, constrain((fsm_input.micros - start_micros) / spinup_divider, 0, 255)); // ramp to full power
+    mock_motor = Mock_Motor::RAMP;
 #endif
-        }
-        return state;
-        break;
-    case State::s04_RUNNING:
-        if (fsm_input.stop_button
-            || ((fsm_input.micros - fsm_input.last_beam_break) > too_slow_rotation_interval) // too slow/stopped, rotation_interval doesn't need to update)
-            || (fsm_input.rotation_interval > too_slow_rotation_interval) // too slow
-            || (fsm_input.rotation_interval < too_fast_rotation_interval) // too fast
-            || (fsm_input.bat_volt < bat_voltage_low_thresh) // battery low
-        ) { // transition 4-5 (stop running)
-            stopTimerInterrupts();
-            turnOffMotor();
-            playSpinningDownTone();
-            FastLED.clear(true);
-            state = State::s05_SPINNING_DOWN;
-        } else { // 4-4 self loop
+    motor_control = spinUp.calculate(speed_setpoint, speedFromInterval(fsm_input.rotation_interval), fsm_input.bat_volt, fsm_input.micros);
+    writeMotor(motor_control);
+}
+void abortSpinUp(const FsmInput& fsm_input)
+{
+    turnOffMotor();
+    playSpinningDownTone();
+}
+void startRunning(const FsmInput& fsm_input)
+{
+    stopPlayingTone();
+    displaying = true; // beamBreakIsr starts the columns at the next beam break
+    irDirection.reset();
+    most_recent_ir_angle = -1;
+    motorPid.initialize_time(fsm_input.micros);
+    motorPid.transferOutput(motor_control, speed_setpoint, speedFromInterval(fsm_input.rotation_interval)); // bumpless, the PID starts from the spin up duty cycle
+    startSupervisor(fsm_input.micros);
+}
+void runStep(const FsmInput& fsm_input)
+{
 #ifdef MOCK_FUNCTIONS
-            mock_motor = Mock_Motor::ON;
-#else
-            int32_t speed = (int64_t)1000000 * speed_unit_devisor / fsm_input.rotation_interval;
-            int32_t motor_control = motorPid.calculate(speed_setpoint, speed, fsm_input.micros);
-            analogWrite(MOTOR_CTRL_PIN, motor_control);
+    mock_motor = Mock_Motor::ON;
 #endif
+    speed_setpoint = setpointSupervisor.update(speedFromInterval(fsm_input.rotation_interval), fsm_input.rotation_jitter, fsm_input.rotation_interval, motor_control, fsm_input.bat_volt, fsm_input.micros);
+    motor_control = motorPid.calculate(speed_setpoint, speedFromInterval(fsm_input.rotation_interval), fsm_input.micros);
+    writeMotor(motor_control);
+}
+void stopRunning(const FsmInput& fsm_input)
+{
+    stopDisplaying();
+    turnOffMotor();
+    playSpinningDownTone();
+    clearLeds();
+}
+void startTuning(const FsmInput& fsm_input)
+{
+    motorTuner.start(speed_setpoint, motor_control, tuning_relay_amplitude, tuning_hysteresis, tuning_timeout, fsm_input.micros);
+}
+void tuningStep(const FsmInput& fsm_input)
+{
+#ifdef MOCK_FUNCTIONS
+    mock_motor = Mock_Motor::RELAY;
+#endif
+    motor_control = constrain(motorTuner.update(speedFromInterval(fsm_input.rotation_interval), fsm_input.micros), 0, MOTOR_DUTY_MAX);
+    writeMotor(motor_control);
+}
+void finishTuning(const FsmInput& fsm_input)
+{
+    if (motorTuner.succeeded()) { // otherwise keep the gains from before
+        for (uint8_t i = 0; i < motor_gains_length; i++) {
+            tuned_motor_gains[i] = motorTuner.gains(motor_gains[i], speed_unit_devisor_power);
         }
-        return state;
-        break;
-    case State::s05_SPINNING_DOWN:
-        if (fsm_input.micros - fsm_input.last_beam_break > down_time) { // 5-1 has stopped spinning
-            stopPlayingTone();
-            FastLED.clear(true);
-            state = State::s01_MOTOR_OFF;
-        } else { // self loop
-            dangerBlink();
-        }
-        return state;
-        break;
-    default:
-        // invalid and theoretically unreachable state, stop the motor
-        analogWrite(MOTOR_CTRL_PIN, 0);
-        stopTimerInterrupts();
-        noTone(PIEZO_PIN);
-        state = State::s05_SPINNING_DOWN;
-        return state;
-        break;
+        motorPid.setSchedule(tuned_motor_gains, motor_gains_length);
     }
-    return state;
+    motorPid.initialize_time(fsm_input.micros);
+    motorPid.transferOutput(motor_control, speed_setpoint, speedFromInterval(fsm_input.rotation_interval)); // bumpless, the PID starts from the relay's last duty cycle
+    startSupervisor(fsm_input.micros); // the relay's oscillation isn't the rotor's jitter
+}
+void finishSpinningDown(const FsmInput& fsm_input)
+{
+    stopPlayingTone();
+    clearLeds();
+}
+void recoverFromInvalidState(const FsmInput& fsm_input)
+{
+    writeMotor(0);
+    stopDisplaying();
+    noTone(PIEZO_PIN);
+}
+
+/**
+ * the FSM: the rows of each state are checked in order and the first one whose guard is true (or that has no guard) is taken
+ */
+constexpr FsmRow<State, FsmInput> fsm_table[] = {
+    { State::s01_MOTOR_OFF, startPressed, startWaiting, State::s02_WAIT, "1-2" },
+    { State::s01_MOTOR_OFF, nullptr, blinkWhileOff, State::s01_MOTOR_OFF, "1-1" },
+    { State::s02_WAIT, stopPressed, cancelWaiting, State::s01_MOTOR_OFF, "2-1" },
+    { State::s02_WAIT, waitedLongEnough, startSpinningUp, State::s03_SPINNING_UP, "2-3" },
+    { State::s02_WAIT, nullptr, blinkWhileMoving, State::s02_WAIT, "2-2" },
+    { State::s03_SPINNING_UP, stopPressed, abortSpinUp, State::s05_SPINNING_DOWN, "3-5a" },
+    { State::s03_SPINNING_UP, fastEnoughToRun, startRunning, State::s04_RUNNING, "3-4" },
+    { State::s03_SPINNING_UP, spinUpTimedOut, abortSpinUp, State::s05_SPINNING_DOWN, "3-5b" },
+    { State::s03_SPINNING_UP, nullptr, spinUpStep, State::s03_SPINNING_UP, "3-3" },
+    { State::s04_RUNNING, shouldStopRunning, stopRunning, State::s05_SPINNING_DOWN, "4-5" },
+    { State::s04_RUNNING, startPressed, startTuning, State::s06_AUTO_TUNING, "4-6" }, // start pressed while running, tune the motor
+    { State::s04_RUNNING, nullptr, runStep, State::s04_RUNNING, "4-4" },
+    { State::s05_SPINNING_DOWN, stoppedSpinning, finishSpinningDown, State::s01_MOTOR_OFF, "5-1" },
+    { State::s05_SPINNING_DOWN, nullptr, blinkWhileMoving, State::s05_SPINNING_DOWN, "5-5" },
+    { State::s06_AUTO_TUNING, shouldStopRunning, stopRunning, State::s05_SPINNING_DOWN, "6-5" },
+    { State::s06_AUTO_TUNING, tuningFinished, finishTuning, State::s04_RUNNING, "6-4" },
+    { State::s06_AUTO_TUNING, nullptr, tuningStep, State::s06_AUTO_TUNING, "6-6" },
+};
+const uint8_t fsm_table_size = sizeof(fsm_table) / sizeof(fsm_table[0]);
+const uint8_t fsm_states = State::s06_AUTO_TUNING + 1; // the index starts at 0, which has no rows
+constexpr FsmRow<State, FsmInput> fsm_invalid_row = { State::s01_MOTOR_OFF, nullptr, recoverFromInvalidState, State::s05_SPINNING_DOWN, "invalid" }; // theoretically unreachable, stop the motor
+static_assert(fsmSorted(fsm_table, fsm_table_size), "the rows of a state have to be next to each other, in order of state");
+static_assert(fsmEndsUnguarded(fsm_table, fsm_table_size), "the last row of each state needs no guard, so every dispatch takes a row");
+static_assert(fsmMaxRows(fsm_table, fsm_table_size, fsm_states) <= 4, "updateFSM() checks at most 4 guards");
+typedef FsmIndex<FsmRow<State, FsmInput>, fsm_table, fsm_table_size, MakeFsmStates<fsm_states>::type> FsmTableIndex;
+TableFsm<State, FsmInput> clockFsm(fsm_table, fsm_table_size, FsmTableIndex::first, fsm_states, fsm_invalid_row);
+
+/**
+ * @brief  takes one transition of the FSM's table, the trace records it with fsm_input.micros if it changes the state
+ * @retval the next state
+ */
+State updateFSM(State state, FsmInput fsm_input)
+{
+    return clockFsm.dispatch(state, fsm_input, fsm_input.micros);
 }
 
 /**
@@ -297,101 +818,123 @@ State updateFSM(State state, FsmInput fsm_input)
 void beamBreakIsr()
 {
     // speed
-    unsigned long temp_micros = micros();
-    last_rotation_micros = temp_micros - last_beam_break_micros;
-    last_beam_break_micros = temp_micros;
+    uint32_t now = readTimer32();
+    uint32_t beam_break_ticks = readBeamBreakCapture(now); // latched by TC3 when the beam was broken, so interrupt latency isn't measured
+    if (!rotationEstimator.addBeamBreak(beam_break_ticks)) { // double trigger, this isn't the start of a new revolution
+        return;
+    }
+    // timer ticks are microseconds, loop() compares the beam break to micros()
+    rotation_snapshot.write({ micros() - (now - beam_break_ticks), rotationEstimator.interval(), rotationEstimator.predictedInterval(), rotationEstimator.jitter() });
+    events.push(PIN_EVENTS, { EventType::BEAM_BREAK, 0, beam_break_ticks }); // loop() runs the FSM with the new interval
 
     column_counter = 0;
-    if (state == s04_RUNNING) {
-        if (staged_image_new) {
-            stopTimerInterrupts();
-            memcpy(current_image, staged_image, sizeof(CRGB) * image_width * image_height);
-            staged_image_new = false;
-        }
-        if (last_beam_break_micros == 0) { // shouldn't happen, but protects from div/0
+    if (displaying) {
+        framebuffer.flip(); // starts displaying the newest frame from loop(), if there is one
+        uint32_t predicted_micros = rotationEstimator.predictedInterval(); // spread the columns over the rotation that is starting, not the one that just ended
+        if (predicted_micros == 0) { // shouldn't happen, no rotation to spread the columns over
             stopTimerInterrupts();
             return;
         }
-        int32_t isrRate = (int32_t)image_width * 1000000 / last_rotation_micros;
-        isrRate = max(30, isrRate); // minimum frequency that setTimerISRRate supports is 30Hz
-        setTimerISRRate(isrRate);
+        startColumnTimer(predicted_micros, image_width, beam_break_ticks); // the columns follow the beam break, not the ISR
+#ifdef APA102_DMA
+        apa102Dma.start(framebuffer.displayIndex(), framebuffer.displayScroll()); // DMA sends the first column at the first TC3 compare match, like TC3_Handler does without it
+#endif
     }
 }
 
 /**
  * @brief  This ISR gets run by a timer interrupt at a rate that the leds can be updated for a new column of pixels image_width times per revolution
+ * @note   It also runs every time TC3's counter overflows, advanceColumnTimer() counts those for readTimer32().
  */
 void TC3_Handler() // timerISR
 {
+    if (!advanceColumnTimer()) { // counter overflow, or part way through a very long column
+        return;
+    }
     int temp_column_counter = constrain(column_counter, 0, image_width - 1);
-    if (digitalRead(IR_PIN) == LOW) { // IR light detected
-        if (ir_buf_lock == false) { // unlocked
-            last_ir_micros = micros();
-            ir_buf.push(temp_column_counter); // save current angle to buffer
-        }
+#ifndef APA102_DMA // with APA102_DMA the column was already sent by the DMA controller when this ISR runs
+    int scrolled_column = temp_column_counter + framebuffer.displayScroll();
+    if (scrolled_column >= image_width) {
+        scrolled_column -= image_width;
     }
+#ifdef APA102_FRAMEBUFFER
+    showApa102Column(framebuffer.displayBuffer()[scrolled_column]);
+#elif defined(PALETTE_BITS)
+    framebuffer.displayBuffer()[scrolled_column].expand(image_palettes[framebuffer.displayIndex()], leds);
+    FastLED.show();
+#else
+    const CRGB* column = framebuffer.displayBuffer()[scrolled_column];
     for (int i = 0; i < image_height; i++) {
-        leds[i] = current_image[temp_column_counter][i];
+        leds[i] = column[i];
     }
     FastLED.show();
+#endif
+#endif
     column_counter++;
-    TC3->COUNT16.INTFLAG.reg |= TC_INTFLAG_MC0; // Clear interrupt register flag
 }
 
 /**
- * @brief  runs updateFSM with stop_button=true (an event that can update the FSM)
+ * @brief  saves every edge of the IR receiver's output with a timestamp, readIrRemote() decodes them
  */
-void stopButtonIsr()
+void irEdgeIsr()
 {
-    fsm_input.last_beam_break = last_beam_break_micros;
-    fsm_input.rotation_interval = last_rotation_micros;
-    fsm_input.start_button = false;
+    IrEdge edge = { readTimer32(), digitalRead(IR_PIN) == LOW, (int16_t)(displaying ? constrain(column_counter, 0, image_width - 1) : -1) };
+    ir_edges.push(edge);
+}
 
-    fsm_input.stop_button = true;
-    fsm_input.micros = micros();
-    state = updateFSM(state, fsm_input);
+/**
+ * @brief  Decodes the IR edges saved since the last call into NEC frames, and adds the columns the remote's light lasted through to irDirection.
+ * @note   Doesn't wait for a frame to finish, the decoder keeps its place between calls.
+ */
+void readIrRemote()
+{
+    unsigned long now_micros = micros();
+    uint32_t now_ticks = readTimer32();
+    IrEdge edge;
+    NecFrame frame;
+    while (ir_edges.pop(edge)) {
+        if (edge.light) {
+            ir_light_column = edge.column;
+        } else if (ir_light_column != -1 && edge.column != -1) { // every column from where the light started to where it ended
+            unsigned long edge_micros = now_micros - (now_ticks - edge.ticks);
+            for (int column = ir_light_column;; column = (column + 1) % image_width) {
+                irDirection.addHit(column, edge_micros);
+                if (column == edge.column) {
+                    break;
+                }
+            }
+            ir_light_column = -1;
+        }
+        if (necDecoder.addEdge(edge, frame)) {
+            last_ir_frame = frame;
+            last_ir_frame_micros = now_micros - (now_ticks - edge.ticks);
+            has_ir_frame = true;
+        }
+    }
 }
 
 /**
- * @brief  runs updateFSM with start_button=true (an event that can update the FSM)
+ * @brief  queues a press of the stop button, loop() runs updateFSM with stop_button=true
  */
-void startButtonIsr()
+void stopButtonIsr()
 {
-    fsm_input.last_beam_break = last_beam_break_micros;
-    fsm_input.rotation_interval = last_rotation_micros;
-    fsm_input.stop_button = false;
+    events.push(PIN_EVENTS, { EventType::BUTTON, (uint8_t)ButtonPress::STOP, 0 });
+}
 
-    fsm_input.start_button = true;
-    fsm_input.micros = micros();
-    state = updateFSM(state, fsm_input);
+/**
+ * @brief  queues a press of the start button, loop() runs updateFSM with start_button=true
+ */
+void startButtonIsr()
+{
+    events.push(PIN_EVENTS, { EventType::BUTTON, (uint8_t)ButtonPress::START, 0 });
 }
 
 /**
- * @brief This function calculates what angle an IR remote most recently sent a signal from.
- * @retval Which column of the image is in the direction that the IR signal is coming from. Or -1 if no new reading is available.
+ * @brief  queues the battery voltage measured by the conversion that startAdcConversion() started
  */
-int getIRAngle()
+void ADC_Handler()
 {
-    ir_buf_lock = true;
-    int angle = -1;
-    if (micros() - last_ir_micros > 400000) { // wait until data has stopped coming in
-        if (ir_buf.size() >= 10) { // enough readings
-            // https://en.wikipedia.org/wiki/Circular_mean (make a vector for each point, then add them, then use atan2)
-            long x = 0;
-            long y = 0;
-            for (int i = 0; i < ir_buf.size(); i++) {
-                x += cos16((1 << 16) / image_width * ir_buf[i]); // https://fastled.io/docs/3.1/group___trig.html#ga056952ebed39f55880bb353857b47075
-                y += sin16((1 << 16) / image_width * ir_buf[i]); // https://fastled.io/docs/3.1/group___trig.html#ga0890962cb06b267617f4b06d7e9be5eb
-            }
-            if (x != 0 && y != 0) {
-                angle = (atan2(-y, -x) + PI) * image_width / TWO_PI;
-                angle = constrain(angle, 0, image_width - 1);
-            }
-        }
-        ir_buf.clear();
-    }
-    ir_buf_lock = false;
-    return angle;
+    events.push(ADC_EVENTS, { EventType::ADC_COMPLETE, 0, readAdcResult() });
 }
 
 /**
@@ -401,11 +944,22 @@ inline void turnOffMotor()
 {
 #ifdef MOCK_FUNCTIONS
     mock_motor = Mock_Motor::OFF;
-#else
-    analogWrite(MOTOR_CTRL_PIN, 0);
 #endif
+    writeMotor(0);
 } // other motor mock functions are literally inline in updateFsm
 
+/**
+ * @brief  sets the motor's duty cycle (0 to MOTOR_DUTY_MAX), or becomes a mock function that only saves it if unit tests are being run.
+ */
+inline void writeMotor(int32_t duty)
+{
+#ifdef MOCK_FUNCTIONS
+    mock_motor_duty = duty;
+#else
+    writeMotorPwm(duty);
+#endif
+}
+
 /**
  * @brief  plays a tone, or becomes a mock function that only sets a variable if unit tests are being run.
  * This tone is heard between the time when the start button is pressed and the motor starts up.
@@ -475,6 +1029,32 @@ inline void blinkBuiltinLed()
     digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
 #endif
 }
+/**
+ * @brief sends leds[] to the LEDs, through FastLED or the APA102_FRAMEBUFFER SPI output
+ */
+void showLeds()
+{
+#ifdef APA102_DMA
+    apa102Dma.stop(); // SPI can't be shared with the DMA channel
+#endif
+#ifdef APA102_FRAMEBUFFER
+    Apa102Column column;
+    encodeApa102Column(leds, column);
+    showApa102Column(column);
+#else
+    FastLED.show();
+#endif
+}
+/**
+ * @brief turns off all the LEDs, same as FastLED.clear(true)
+ */
+void clearLeds()
+{
+    for (int i = 0; i < image_height; i++) {
+        leds[i] = CRGB(0, 0, 0);
+    }
+    showLeds();
+}
 /**
  * @brief flashes the lights orange and off, used to indicate that the clock will move or is moving
  * @note   can be a mock function for unit tests
@@ -489,18 +1069,32 @@ void dangerBlink()
     for (int i = 0; i < image_height; i++) {
         leds[i] = (blinkVar) ? CRGB(255, 100, 0) : CRGB(0, 0, 0);
     }
-    FastLED.show();
+    showLeds();
 #endif
 }
 
 /**
- * @brief  sets every pixel in the image to off.
+ * @brief  sets every pixel in the image being drawn to off (palette index 0 with PALETTE_BITS).
+ * @note   only the columns that textRenderer drew into last time this image was drawn are touched.
  */
 void clearDisplay()
 {
-    for (int x = 0; x < image_width; x++) {
-        for (int y = 0; y < image_height; y++) {
-            staged_image[x][y] = CRGB(0, 0, 0);
-        }
-    }
+    textRenderer.clear(framebuffer.drawIndex(), framebuffer.drawBuffer(), image_width);
+}
+
+/**
+ * @brief  makes the image being drawn show text, starting at column 0 on a black background. Equivalent to clearDisplay() followed by printString().
+ * @note   only the characters that changed since this image was last drawn are reprinted, see textRenderer.columnsTouched().
+ *      With PALETTE_BITS the characters are palette index 1 and a change of color only changes the palette.
+ * @param  text: null terminated string to print
+ * @param  foreground: CRGB or CHSV (FastLED) color for the characters
+ */
+void printText(const char* text, CRGB foreground)
+{
+#ifdef PALETTE_BITS
+    image_palettes[framebuffer.drawIndex()][1] = foreground; // a new color is a new palette entry, no pixels are redrawn for it
+    textRenderer.render(framebuffer.drawIndex(), text, 0, 1, 0, framebuffer.drawBuffer(), image_width);
+#else
+    textRenderer.render(framebuffer.drawIndex(), text, 0, foreground, CRGB(0, 0, 0), framebuffer.drawBuffer(), image_width);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,234 @@
+/**
+ * supervisor.h contains a supervisor that chooses the speed setpoint while running: a steady rotor is sped up in small steps
+ * (a faster refresh flickers less), and the setpoint is lowered again when the rotor gets unsteady, the motor runs out of headroom,
+ * the battery sags, or the speed gets near the thresholds that stop the clock.
+ */
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+#include <Arduino.h>
+
+/**
+ * @brief  limits and budgets of SetpointSupervisor, speeds are in the units of the setpoint
+ */
+struct SupervisorParameters {
+    int32_t min_setpoint;
+    int32_t max_setpoint;
+    int32_t step; // the setpoint changes by this much at the end of a window
+    int32_t guard_margin; // the speed has to stay this far inside the too slow and too fast thresholds
+    uint16_t jitter_budget; // average jitter of a revolution allowed, in thousandths of a revolution
+    int32_t effort_budget; // highest duty cycle allowed, the PID needs the rest as headroom to correct disturbances
+    float battery_margin; // volts the battery has to stay above the low battery threshold
+    unsigned long window; // microseconds of statistics behind each decision
+    unsigned long settle; // microseconds after a change of the setpoint that aren't counted, while the PID catches up
+};
+
+/**
+ * @brief  what the supervisor did at the end of the last window
+ */
+enum class SupervisorDecision {
+    NONE = 0, // no window has finished since start()
+    HOLD = 1, // within budget, but not by enough margin to go faster (or already at the highest setpoint)
+    RAISE = 2,
+    BACK_OFF = 3
+};
+
+/**
+ * @brief  statistics of the last finished window, and the decision made from them
+ */
+struct SupervisorStats {
+    uint16_t jitter; // average difference between a revolution and its prediction, in thousandths of a revolution
+    uint16_t peak_jitter;
+    int32_t effort; // average duty cycle
+    int32_t peak_effort;
+    int32_t min_speed;
+    int32_t max_speed;
+    float min_battery;
+    uint16_t samples;
+    SupervisorDecision decision;
+    uint16_t raises; // since start()
+    uint16_t back_offs;
+};
+
+/**
+ * @brief  Raises the setpoint while the rotor holds it comfortably, and lowers it when a budget or guard is approached.
+ * @note   update() is meant to be called from updateFSM() every loop while running. Decisions are made once per window,
+ *      from statistics gathered after the speed settled. A setpoint that had to be backed off from isn't tried again until start(),
+ *      so the setpoint doesn't oscillate between a speed that works and one that doesn't.
+ */
+class SetpointSupervisor {
+    const SupervisorParameters& params;
+    int32_t setpoint;
+    int32_t low; // range the setpoint is kept in, see setRange()
+    int32_t high;
+    int32_t ceiling; // lowest setpoint that was backed off from
+    int32_t slow_speed; // guards, the speeds that stop the clock
+    int32_t fast_speed;
+    float low_battery;
+    unsigned long window_start; // statistics are gathered from this time, which is in the future while settling
+    SupervisorStats stats;
+
+    // statistics of the current window
+    uint32_t jitter_sum;
+    uint16_t peak_jitter;
+    int64_t effort_sum;
+    int32_t peak_effort;
+    int32_t min_speed;
+    int32_t max_speed;
+    float min_battery;
+    uint16_t samples;
+
+    void clearWindow(unsigned long micros, unsigned long delay)
+    {
+        window_start = micros + delay;
+        jitter_sum = 0;
+        peak_jitter = 0;
+        effort_sum = 0;
+        peak_effort = INT32_MIN;
+        min_speed = INT32_MAX;
+        max_speed = INT32_MIN;
+        min_battery = INFINITY;
+        samples = 0;
+    }
+    /**
+     * @brief  moves the setpoint by change (and keeps it in range), the next window starts after the speed settles
+     */
+    void changeSetpoint(int32_t change, unsigned long micros)
+    {
+        setpoint = constrain(setpoint + change, low, min(high, ceiling - 1));
+        setpoint = max(setpoint, low); // ceiling can be below low after the range was changed
+        clearWindow(micros, params.settle);
+    }
+    /**
+     * @brief  decides from the finished window's statistics
+     */
+    void decide(unsigned long micros)
+    {
+        stats.jitter = jitter_sum / samples;
+        stats.peak_jitter = peak_jitter;
+        stats.effort = effort_sum / samples;
+        stats.peak_effort = peak_effort;
+        stats.min_speed = min_speed;
+        stats.max_speed = max_speed;
+        stats.min_battery = min_battery;
+        stats.samples = samples;
+
+        bool over_budget = stats.jitter > params.jitter_budget
+            || peak_effort > params.effort_budget
+            || min_battery < low_battery + params.battery_margin
+            || min_speed < slow_speed + params.guard_margin
+            || max_speed > fast_speed - params.guard_margin;
+        // one more step has to fit in every budget: the guard and effort grow with the speed, the jitter and sag get worse
+        bool room_for_step = stats.jitter <= params.jitter_budget / 2
+            && peak_effort + (int64_t)peak_effort * params.step / max(setpoint, (int32_t)1) <= params.effort_budget
+            && min_battery >= low_battery + 2 * params.battery_margin
+            && max_speed + params.step <= fast_speed - params.guard_margin;
+
+        if (over_budget && setpoint > low) {
+            ceiling = setpoint;
+            stats.decision = SupervisorDecision::BACK_OFF;
+            stats.back_offs++;
+            changeSetpoint(-params.step, micros);
+        } else if (!over_budget && room_for_step && setpoint + params.step <= min(high, ceiling - 1)) {
+            stats.decision = SupervisorDecision::RAISE;
+            stats.raises++;
+            changeSetpoint(params.step, micros);
+        } else {
+            stats.decision = SupervisorDecision::HOLD;
+            clearWindow(micros, 0);
+        }
+    }
+
+public:
+    SetpointSupervisor(const SupervisorParameters& _params, int32_t initial_setpoint)
+        : params(_params)
+    {
+        setpoint = initial_setpoint;
+        low = params.min_setpoint;
+        high = params.max_setpoint;
+        ceiling = INT32_MAX;
+        slow_speed = INT32_MIN / 2;
+        fast_speed = INT32_MAX / 2;
+        low_battery = 0;
+        stats = {};
+        clearWindow(0, 0);
+    }
+    /**
+     * @brief  call this when the clock starts running, it keeps the setpoint from the last run but forgets what it backed off from
+     * @param  _slow_speed: the speed below which the clock stops
+     * @param  _fast_speed: the speed above which the clock stops
+     * @param  _low_battery: the voltage below which the clock stops
+     * @param  micros: the current time
+     */
+    void start(int32_t _slow_speed, int32_t _fast_speed, float _low_battery, unsigned long micros)
+    {
+        slow_speed = _slow_speed;
+        fast_speed = _fast_speed;
+        low_battery = _low_battery;
+        ceiling = INT32_MAX;
+        stats.decision = SupervisorDecision::NONE;
+        stats.raises = 0;
+        stats.back_offs = 0;
+        clearWindow(micros, params.settle);
+    }
+    /**
+     * @brief  Call this every loop while running
+     * @param  speed: measured speed
+     * @param  jitter: average difference between a revolution's interval and its prediction in microseconds (RotationEstimator::jitter())
+     * @param  interval: the rotation interval in microseconds
+     * @param  effort: the duty cycle the PID is driving the motor with
+     * @param  battery: battery voltage
+     * @param  micros: (unsigned long) a value that increases steadily at a rate of one million per second.
+     * @retval the setpoint to use
+     */
+    int32_t update(int32_t speed, uint32_t jitter, uint32_t interval, int32_t effort, float battery, unsigned long micros)
+    {
+        if ((long)(micros - window_start) < 0 || interval == 0) { // settling
+            return setpoint;
+        }
+        uint16_t jitter_thousandths = min((uint64_t)jitter * 1000 / interval, (uint64_t)UINT16_MAX);
+        jitter_sum += jitter_thousandths;
+        peak_jitter = max(peak_jitter, jitter_thousandths);
+        effort_sum += effort;
+        peak_effort = max(peak_effort, effort);
+        min_speed = min(min_speed, speed);
+        max_speed = max(max_speed, speed);
+        min_battery = min(min_battery, battery);
+        samples++;
+        if (micros - window_start >= params.window) {
+            decide(micros);
+        }
+        return setpoint;
+    }
+    /**
+     * @brief  the setpoint chosen by the supervisor
+     */
+    int32_t chosenSetpoint()
+    {
+        return setpoint;
+    }
+    /**
+     * @brief  statistics of the last finished window, and what was decided from them
+     */
+    const SupervisorStats& lastStats()
+    {
+        return stats;
+    }
+    /**
+     * @brief  continues from the setpoint it had chosen before a reset, kept in range
+     */
+    void restoreSetpoint(int32_t saved)
+    {
+        setpoint = constrain(saved, low, high);
+    }
+    /**
+     * @brief  limits the setpoint at runtime (ex: set both to the same speed to hold it), within the parameters' range
+     */
+    void setRange(int32_t _low, int32_t _high)
+    {
+        low = max(_low, params.min_setpoint);
+        high = max(min(_high, params.max_setpoint), low);
+        setpoint = constrain(setpoint, low, high);
+    }
+};
+
+#endif // SUPERVISOR_H
@@ -0,0 +1,138 @@
+/**
+ * text_renderer.h contains a text renderer that remembers what it last drew into each image of a frame buffer,
+ * so each frame only the characters that changed are redrawn instead of clearing and reprinting the whole image.
+ */
+#ifndef TEXT_RENDERER_H
+#define TEXT_RENDERER_H
+#include "font.h"
+#include <Arduino.h>
+#include <FastLED.h>
+
+/**
+ * @brief  Draws a string into an image the same way clearDisplay() followed by printString() would, but only touches the columns that changed.
+ * @note   Each image must only be drawn into through the same TextRenderer, and must start out cleared (all black).
+ * @param  slots: number of images that are drawn into in rotation, ex: 3 for a TripleBuffer
+ * @param  Column: type of one column of the images, CRGB[8], Apa102Column or PaletteColumn
+ * @param  Color: CRGB, or uint8_t palette indices for PaletteColumn (recoloring is then a change of the palette, which redraws nothing)
+ */
+template <uint8_t slots, typename Column, typename Color = CRGB>
+class TextRenderer {
+public:
+    static const uint8_t MAX_LENGTH = 19; // longest string whose characters are tracked, longer strings are still drawn but always in full
+
+private:
+    static const uint8_t CHAR_WIDTH = 6; // 5 columns of font and 1 column of spacing
+
+    /**
+     * @brief  what is currently drawn in one image
+     */
+    struct Drawn {
+        char text[MAX_LENGTH + 1];
+        uint8_t glyphs; // number of characters drawn, including the null character that printString() also prints. 0 if nothing is drawn
+        long x_pos;
+        Color foreground;
+        Color background;
+        bool known; // false if the image may contain pixels that aren't described by this struct
+    };
+    Drawn drawn[slots];
+    unsigned int columns_touched;
+
+    /**
+     * @brief  sets count columns of image to off, starting at column first and wrapping around at width
+     */
+    void clearColumns(Column image[], int width, long first, int count)
+    {
+        const Color off[2] = { Color(0), Color(0) }; // black, or palette index 0
+        int column = ((first % width) + width) % width;
+        for (int x = 0; x < count; x++) {
+            blitColumn(image[column], 0, off);
+            if (++column == width) {
+                column = 0;
+            }
+        }
+        columns_touched += count;
+    }
+
+public:
+    TextRenderer()
+    {
+        columns_touched = 0;
+        for (uint8_t i = 0; i < slots; i++) {
+            drawn[i].text[0] = '\0';
+            drawn[i].glyphs = 0;
+            drawn[i].x_pos = 0;
+            drawn[i].known = true;
+        }
+    }
+    /**
+     * @brief  makes image show str, equivalent to clearing image and then calling printString()
+     * @param  slot: [0, slots) which image is being drawn into, ex: TripleBuffer::drawIndex()
+     * @param  str: null terminated string to print
+     * @param  x_pos: column of the image the first character is printed into, wraps around like printString()
+     * @param  foreground: color for the foreground of the characters
+     * @param  background: color for the background of the characters
+     * @param  image: image that slot refers to
+     * @param  width: number of columns in the image.
+     */
+    void render(uint8_t slot, const char* str, long x_pos, Color foreground, Color background, Column image[], int width)
+    {
+        Drawn& old = drawn[slot];
+        columns_touched = 0;
+        size_t length = strlen(str);
+        bool trackable = length <= MAX_LENGTH && (long)(length + 1) * CHAR_WIDTH <= width; // characters must not wrap around onto each other
+
+        if (!old.known || !trackable) {
+            clearColumns(image, width, 0, width);
+            old.glyphs = 0;
+        } else if (x_pos != old.x_pos) {
+            clearColumns(image, width, old.x_pos, old.glyphs * CHAR_WIDTH);
+            old.glyphs = 0;
+        }
+        bool recolor = foreground != old.foreground || background != old.background;
+        for (unsigned int i = 0; i <= length; i++) {
+            if (recolor || i >= old.glyphs || str[i] != old.text[i]) {
+                printChar((byte)str[i], x_pos + i * CHAR_WIDTH, foreground, background, image, width);
+                columns_touched += CHAR_WIDTH;
+            }
+        }
+        if (old.glyphs > length + 1) { // erase the end of a longer string that was there before
+            clearColumns(image, width, x_pos + (length + 1) * CHAR_WIDTH, (old.glyphs - (length + 1)) * CHAR_WIDTH);
+        }
+
+        old.known = trackable;
+        if (trackable) {
+            memcpy(old.text, str, length + 1);
+            old.glyphs = length + 1;
+            old.x_pos = x_pos;
+            old.foreground = foreground;
+            old.background = background;
+        }
+    }
+    /**
+     * @brief  makes image completely off, equivalent to clearDisplay()
+     * @param  slot: [0, slots) which image is being drawn into
+     * @param  image: image that slot refers to
+     * @param  width: number of columns in the image.
+     */
+    void clear(uint8_t slot, Column image[], int width)
+    {
+        Drawn& old = drawn[slot];
+        columns_touched = 0;
+        if (old.known) {
+            clearColumns(image, width, old.x_pos, old.glyphs * CHAR_WIDTH);
+        } else {
+            clearColumns(image, width, 0, width);
+        }
+        old.glyphs = 0;
+        old.known = true;
+    }
+    /**
+     * @brief  number of columns written by the last call to render() or clear(), a full redraw would be width plus the columns of the string
+     */
+    unsigned int columnsTouched()
+    {
+        return columns_touched;
+    }
+};
+
+#endif // TEXT_RENDERER_H
@@ -0,0 +1,164 @@
+/**
+ * time_of_day.h contains the time of day as packed BCD (0xHHMMSS), which turns into the displayed digits with shifts and masks.
+ * It is only calculated with divides when the clock is set or jumps, one second later is a BCD increment with carries.
+ */
+#ifndef TIME_OF_DAY_H
+#define TIME_OF_DAY_H
+#include <Arduino.h>
+
+const uint32_t SECONDS_PER_DAY = 86400;
+
+/**
+ * @brief  converts 0 to 99 to two BCD digits
+ */
+uint8_t toBcd(uint8_t value)
+{
+    return ((value / 10) << 4) | (value % 10);
+}
+
+/**
+ * @brief  converts seconds to the time of day as packed BCD
+ * @param  seconds: seconds since a midnight, ex: Unix time plus the UTC offset
+ * @retval hours, minutes and seconds in BCD, ex: 0x163102 for 16:31:02
+ */
+uint32_t bcdTimeOfDay(uint32_t seconds)
+{
+    seconds %= SECONDS_PER_DAY;
+    return ((uint32_t)toBcd(seconds / 3600) << 16) | ((uint32_t)toBcd(seconds / 60 % 60) << 8) | toBcd(seconds % 60);
+}
+
+/**
+ * @brief  adds one second to a time of day from bcdTimeOfDay(), 23:59:59 wraps around to 00:00:00
+ */
+uint32_t nextBcdSecond(uint32_t bcd)
+{
+    bcd++;
+    if ((bcd & 0x00000F) == 0x00000A) { // 9 seconds carry into the tens
+        bcd += 0x000006;
+    }
+    if ((bcd & 0x0000F0) == 0x000060) { // 60 seconds carry into the minutes
+        bcd += 0x0000A0;
+    }
+    if ((bcd & 0x000F00) == 0x000A00) {
+        bcd += 0x000600;
+    }
+    if ((bcd & 0x00F000) == 0x006000) { // 60 minutes carry into the hours
+        bcd += 0x00A000;
+    }
+    if ((bcd & 0x0F0000) == 0x0A0000) {
+        bcd += 0x060000;
+    }
+    if (bcd == 0x240000) {
+        bcd = 0;
+    }
+    return bcd;
+}
+
+/**
+ * @brief  writes a time of day from bcdTimeOfDay() as text
+ * @param  text: at least 9 chars, set to HH:MM:SS and a null terminator
+ */
+void formatBcdTime(uint32_t bcd, char* text)
+{
+    text[0] = '0' + ((bcd >> 20) & 0xF);
+    text[1] = '0' + ((bcd >> 16) & 0xF);
+    text[2] = ':';
+    text[3] = '0' + ((bcd >> 12) & 0xF);
+    text[4] = '0' + ((bcd >> 8) & 0xF);
+    text[5] = ':';
+    text[6] = '0' + ((bcd >> 4) & 0xF);
+    text[7] = '0' + (bcd & 0xF);
+    text[8] = '\0';
+}
+
+/**
+ * @brief  reads a time of day written as HH:MM:SS
+ * @param  text: doesn't need to be null terminated after the 8 characters, parsing stops at the first unexpected character
+ * @retval seconds since midnight, -1 if text isn't a time of day
+ */
+int32_t parseTimeOfDay(const char* text)
+{
+    const uint8_t limits[3] = { 24, 60, 60 };
+    int32_t seconds = 0;
+    for (uint8_t field = 0; field < 3; field++) {
+        const char* digits = text + field * 3;
+        if (digits[0] < '0' || digits[0] > '9' || digits[1] < '0' || digits[1] > '9' || (field < 2 && digits[2] != ':')) {
+            return -1;
+        }
+        uint8_t value = (digits[0] - '0') * 10 + (digits[1] - '0');
+        if (value >= limits[field]) {
+            return -1;
+        }
+        seconds = seconds * 60 + value;
+    }
+    return seconds;
+}
+
+/**
+ * @brief  reads a UTC offset written as +HH:MM or -HH:MM
+ * @param  offset: set to the offset in seconds, ex: -18000 for -05:00
+ * @retval false if text isn't a UTC offset
+ */
+bool parseUtcOffset(const char* text, int32_t& offset)
+{
+    if (text[0] != '+' && text[0] != '-') {
+        return false;
+    }
+    for (uint8_t i = 1; i < 6; i++) {
+        if (i == 3 ? text[i] != ':' : (text[i] < '0' || text[i] > '9')) {
+            return false;
+        }
+    }
+    int32_t hours = (text[1] - '0') * 10 + (text[2] - '0');
+    int32_t minutes = (text[4] - '0') * 10 + (text[5] - '0');
+    if (hours > 14 || minutes >= 60) {
+        return false;
+    }
+    offset = (hours * 3600 + minutes * 60) * (text[0] == '-' ? -1 : 1);
+    return true;
+}
+
+/**
+ * @brief  The displayed time of day, updated from a count of seconds.
+ * @note   The text is only rewritten when the second changes, and a change of one second is a nextBcdSecond(),
+ *      so calling text() every frame costs a compare.
+ */
+class TimeOfDayText {
+    uint32_t seconds; // the count that bcd and time_text are from
+    uint32_t bcd;
+    bool valid;
+    char time_text[9];
+
+public:
+    TimeOfDayText()
+    {
+        seconds = 0;
+        bcd = 0;
+        valid = false;
+        formatBcdTime(0, time_text);
+    }
+    /**
+     * @param  now: seconds since a midnight, ex: timeSync.localSeconds()
+     * @retval the time of day as HH:MM:SS, valid until the next call
+     */
+    const char* text(uint32_t now)
+    {
+        if (valid && now == seconds) {
+            return time_text;
+        }
+        bcd = (valid && now == seconds + 1) ? nextBcdSecond(bcd) : bcdTimeOfDay(now);
+        seconds = now;
+        valid = true;
+        formatBcdTime(bcd, time_text);
+        return time_text;
+    }
+    /**
+     * @brief  the time of day of the last text() as packed BCD, 0xHHMMSS
+     */
+    uint32_t bcdTime()
+    {
+        return bcd;
+    }
+};
+
+#endif // TIME_OF_DAY_H
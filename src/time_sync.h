@@ -0,0 +1,541 @@
+/**
+ * time_sync.h contains the clock's time base and the client that keeps it synchronized in the background.
+ * DisciplinedClock turns the RTC's free running count into UTC, corrected for the crystal's frequency error measured between syncs.
+ * TimeSync asks an SNTP server for the time over UDP, falls back to the worldtimeapi.org HTTP API, and tries again periodically.
+ * It is a state machine that loop() steps, so it never waits for a reply. The network is a template parameter,
+ * so the unit tests can run it against a stand-in server.
+ */
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+#include "time_of_day.h"
+#include "worldtime_parser.h"
+#include <Arduino.h>
+
+const uint32_t RTC_TICKS_PER_SECOND = 1024; // see rtc.h
+const uint32_t NTP_UNIX_OFFSET = 2208988800UL; // seconds from 1900 (NTP's epoch) to 1970 (Unix time's)
+const uint8_t SNTP_PACKET_SIZE = 48;
+const uint16_t SNTP_PORT = 123;
+
+/**
+ * @brief  writes an SNTP client request
+ * @param  cookie: sent as the transmit timestamp, the server echoes it as the originate timestamp of its reply
+ */
+void makeSntpRequest(uint8_t* packet, uint32_t cookie)
+{
+    memset(packet, 0, SNTP_PACKET_SIZE);
+    packet[0] = 0x23; // no leap second warning, version 4, mode 3 (client)
+    packet[44] = cookie >> 24;
+    packet[45] = cookie >> 16;
+    packet[46] = cookie >> 8;
+    packet[47] = cookie;
+}
+
+/**
+ * @brief  big endian 32 bit field of a packet
+ */
+uint32_t readBigEndian32(const uint8_t* bytes)
+{
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+/**
+ * @brief  reads the server's transmit timestamp from an SNTP reply
+ * @param  cookie: the cookie of the request it has to be a reply to
+ * @param  seconds: set to the Unix time
+ * @param  fraction: set to the fraction of a second, in 1/2^32 seconds
+ * @retval false if it isn't a reply to the request, or the server doesn't have the time (ex: a kiss-o'-death packet)
+ */
+bool readSntpReply(const uint8_t* packet, int length, uint32_t cookie, uint32_t& seconds, uint32_t& fraction)
+{
+    if (length < SNTP_PACKET_SIZE || (packet[0] & 0x07) != 4 || (packet[0] >> 6) == 3 || packet[1] == 0 || packet[1] > 15) {
+        return false; // not a server reply, the server's clock isn't synchronized, or stratum 0 (kiss-o'-death)
+    }
+    if (readBigEndian32(packet + 24) != 0 || readBigEndian32(packet + 28) != cookie) {
+        return false; // the originate timestamp isn't the cookie, a stale or forged reply
+    }
+    seconds = readBigEndian32(packet + 40) - NTP_UNIX_OFFSET;
+    fraction = readBigEndian32(packet + 44);
+    return seconds != 0 || fraction != 0;
+}
+
+/**
+ * @brief  what DisciplinedClock knows, as plain data that can be kept across a reset (see warm_restart.h)
+ */
+struct TimeBaseState {
+    uint32_t base_rtc;
+    uint32_t base_seconds;
+    uint32_t base_fraction;
+    int32_t ppb;
+    bool frequency_known;
+    bool is_set;
+    bool has_precise;
+    uint32_t precise_rtc;
+    int32_t last_error;
+};
+
+/**
+ * @brief  UTC from the RTC's count, corrected for the RTC's frequency error.
+ * @note   Times are in RTC ticks (1/1024 seconds). The clock is stepped to each sync, and the frequency error is estimated from
+ *      how far the clock had drifted by the next precise one (SNTP, not the HTTP API's whole seconds).
+ *      The count is a uint32_t that wraps after 48 days, so the time base is moved forward at least once a day by rebase().
+ */
+class DisciplinedClock {
+    static const uint32_t REBASE_TICKS = SECONDS_PER_DAY * RTC_TICKS_PER_SECOND;
+    static const uint32_t MIN_FREQUENCY_INTERVAL = 600 * RTC_TICKS_PER_SECOND; // shorter intervals are dominated by the network's jitter
+    static const int32_t MAX_PPB = 200000; // a 32 kHz crystal is within 200 ppm even at the extremes of temperature
+    static const int32_t MAX_SLEW_TICKS = 2 * RTC_TICKS_PER_SECOND; // a bigger error is a step of the time (ex: a wrong source), not drift
+
+    uint32_t base_rtc;
+    uint32_t base_seconds; // UTC at base_rtc
+    uint32_t base_fraction; // in ticks, below RTC_TICKS_PER_SECOND
+    int32_t ppb; // how fast the RTC runs, in parts per billion
+    bool frequency_known;
+    bool is_set;
+    bool has_precise; // precise_rtc is the last precise sync, and the clock hasn't been stepped by an imprecise one since
+    uint32_t precise_rtc;
+    int32_t last_error; // ticks the clock was off by at the last sync
+
+    /**
+     * @brief  ticks since the base, corrected for ppb
+     */
+    uint64_t correctedTicks(uint32_t rtc)
+    {
+        uint32_t elapsed = rtc - base_rtc;
+        return base_fraction + elapsed - (int64_t)elapsed * ppb / 1000000000;
+    }
+
+public:
+    DisciplinedClock()
+    {
+        base_rtc = 0;
+        base_seconds = 0;
+        base_fraction = 0;
+        ppb = 0;
+        frequency_known = false;
+        is_set = false;
+        has_precise = false;
+        precise_rtc = 0;
+        last_error = 0;
+    }
+    /**
+     * @brief  UTC in whole seconds at RTC count rtc, 0 if the clock hasn't been set
+     */
+    uint32_t seconds(uint32_t rtc)
+    {
+        return is_set ? base_seconds + correctedTicks(rtc) / RTC_TICKS_PER_SECOND : 0;
+    }
+    /**
+     * @brief  UTC time of day in ticks at RTC count rtc, 0 if the clock hasn't been set
+     */
+    uint32_t ticksOfDay(uint32_t rtc)
+    {
+        return is_set ? ((uint64_t)(base_seconds % SECONDS_PER_DAY) * RTC_TICKS_PER_SECOND + correctedTicks(rtc)) % ((uint64_t)SECONDS_PER_DAY * RTC_TICKS_PER_SECOND) : 0;
+    }
+    /**
+     * @brief  Sets the clock to a measurement of UTC.
+     * @param  rtc: RTC count the measurement is for
+     * @param  seconds: UTC, whole seconds (the date doesn't matter when comparing to the clock, errors are taken modulo a day)
+     * @param  fraction: ticks to add to seconds
+     * @param  precise: true if the measurement is good to a few ticks and can be used to estimate the frequency error
+     */
+    void sync(uint32_t rtc, uint32_t seconds, uint32_t fraction, bool precise)
+    {
+        if (is_set) {
+            int64_t day = (int64_t)SECONDS_PER_DAY * RTC_TICKS_PER_SECOND;
+            int64_t error = ((int64_t)seconds * RTC_TICKS_PER_SECOND + fraction) - ((int64_t)base_seconds * RTC_TICKS_PER_SECOND + (int64_t)correctedTicks(rtc));
+            error %= day;
+            if (error >= day / 2) {
+                error -= day;
+            } else if (error < -day / 2) {
+                error += day;
+            }
+            last_error = error;
+            uint32_t interval = rtc - precise_rtc;
+            if (precise && has_precise && error > -MAX_SLEW_TICKS && error < MAX_SLEW_TICKS && interval >= MIN_FREQUENCY_INTERVAL && interval < 0x80000000) {
+                // the clock would have been right with a rate of 1 - ppb, so the RTC runs error/interval slower than it was corrected for
+                int32_t measured = ppb - (int32_t)(error * 1000000000 / interval);
+                ppb = frequency_known ? ppb + (measured - ppb) / 2 : measured;
+                ppb = constrain(ppb, -MAX_PPB, MAX_PPB);
+                frequency_known = true;
+            }
+        }
+        base_rtc = rtc;
+        base_seconds = seconds + fraction / RTC_TICKS_PER_SECOND;
+        base_fraction = fraction % RTC_TICKS_PER_SECOND;
+        is_set = true;
+        has_precise = precise;
+        if (precise) {
+            precise_rtc = rtc;
+        }
+    }
+    /**
+     * @brief  moves the time base to rtc if it is more than a day old, call at least once every 48 days (ex: every update of TimeSync)
+     */
+    void rebase(uint32_t rtc)
+    {
+        uint32_t elapsed = rtc - base_rtc;
+        if (!is_set || elapsed < REBASE_TICKS) {
+            return;
+        }
+        uint64_t corrected = correctedTicks(rtc);
+        base_rtc = rtc;
+        base_seconds += corrected / RTC_TICKS_PER_SECOND;
+        base_fraction = corrected % RTC_TICKS_PER_SECOND;
+    }
+    /**
+     * @brief  a copy of the time base, for restore()
+     */
+    TimeBaseState save()
+    {
+        return { base_rtc, base_seconds, base_fraction, ppb, frequency_known, is_set, has_precise, precise_rtc, last_error };
+    }
+    /**
+     * @brief  goes back to a time base from save(), only valid if the RTC kept counting since (ex: through a watchdog reset)
+     */
+    void restore(const TimeBaseState& state)
+    {
+        base_rtc = state.base_rtc;
+        base_seconds = state.base_seconds;
+        base_fraction = state.base_fraction;
+        ppb = constrain(state.ppb, -MAX_PPB, MAX_PPB);
+        frequency_known = state.frequency_known;
+        is_set = state.is_set;
+        has_precise = state.has_precise;
+        precise_rtc = state.precise_rtc;
+        last_error = state.last_error;
+    }
+    /**
+     * @brief  true once sync() has been called
+     */
+    bool isSet()
+    {
+        return is_set;
+    }
+    /**
+     * @brief  estimated frequency error of the RTC, parts per billion (positive if it runs fast), 0 until two precise syncs were 10 minutes apart
+     */
+    int32_t frequencyError()
+    {
+        return ppb;
+    }
+    /**
+     * @brief  ticks the clock was behind the last sync (negative if it was ahead)
+     */
+    int32_t lastError()
+    {
+        return last_error;
+    }
+};
+
+/**
+ * @brief  what TimeSync keeps across a reset: the time base and the UTC offset
+ */
+struct TimeSyncState {
+    TimeBaseState time_base;
+    int32_t utc_offset;
+    bool has_utc_offset;
+};
+
+/**
+ * @brief  where and how often TimeSync gets the time
+ */
+struct TimeSyncParameters {
+    const char* ntp_host;
+    const char* http_host;
+    const char* http_path; // of a worldtimeapi.org timezone, ex: /api/timezone/America/New_York
+    int32_t default_utc_offset; // seconds, used until the HTTP API has been asked
+    uint32_t reply_timeout; // milliseconds to wait for an SNTP reply before sending the request again
+    uint8_t sntp_attempts; // requests sent before falling back to the HTTP API
+    uint32_t http_timeout; // milliseconds to wait for the whole HTTP response
+    uint32_t resync_interval; // seconds between syncs
+    uint32_t retry_interval; // seconds to wait after a failed sync
+    uint32_t utc_offset_interval; // seconds between asking the HTTP API for the UTC offset, which changes with daylight saving time
+};
+
+/**
+ * @brief  Keeps a DisciplinedClock synchronized, call update() from loop() whenever it asks to be.
+ * @note   Net has to provide:
+ *      bool connected(), bool connect(), uint32_t resolve(const char* host) (an IPv4 address, 0 if it failed),
+ *      bool sendUdp(uint32_t ip, uint16_t port, const uint8_t* data, uint8_t length), int receiveUdp(uint8_t* data, uint8_t size) (0 if nothing arrived),
+ *      bool openTcp(const char* host, uint16_t port), void writeTcp(const char* text), int readTcp() (-1 if no byte is available),
+ *      bool tcpOpen() (connected or bytes left to read) and void closeTcp().
+ *      connect(), resolve() and openTcp() can block (WiFi101 waits for them), so update() only calls them when it's told it can block.
+ *      Everything else has to return right away.
+ * @param  Net: the network
+ */
+template <typename Net>
+class TimeSync {
+public:
+    enum class Stage : uint8_t {
+        IDLE, // waiting for the next sync
+        SNTP, // waiting for a reply from the SNTP server
+        HTTP // reading a response from the HTTP API
+    };
+
+private:
+    static const uint32_t POLL_INTERVAL = 10; // milliseconds between checks for a reply
+
+    Net& net;
+    const TimeSyncParameters& parameters;
+    DisciplinedClock clock;
+    Stage stage;
+    uint32_t next_sync; // RTC count
+    uint32_t sent; // RTC count when the request was sent or the HTTP connection was opened
+    uint32_t cookie;
+    uint8_t attempts;
+    uint32_t ntp_ip;
+    int32_t utc_offset;
+    bool has_utc_offset;
+    uint32_t utc_offset_rtc; // RTC count when utc_offset was read
+    bool sntp_synced; // the current sync got the time from SNTP, and is asking the HTTP API for the UTC offset
+    uint32_t syncs;
+    uint32_t failures;
+    WorldTimeParser http_parser; // the response is parsed as it arrives, none of it is kept
+
+    /**
+     * @brief  RTC count milliseconds from rtc
+     */
+    static uint32_t after(uint32_t rtc, uint32_t milliseconds)
+    {
+        return rtc + (uint64_t)milliseconds * RTC_TICKS_PER_SECOND / 1000;
+    }
+    /**
+     * @brief  milliseconds from rtc until when, 0 if it has passed
+     */
+    static uint32_t millisecondsUntil(uint32_t rtc, uint32_t when)
+    {
+        int32_t ticks = when - rtc;
+        return ticks <= 0 ? 0 : ((uint64_t)ticks * 1000 + RTC_TICKS_PER_SECOND - 1) / RTC_TICKS_PER_SECOND;
+    }
+    /**
+     * @brief  true if the HTTP API should be asked, for the UTC offset or because SNTP didn't work
+     */
+    bool needsHttp(uint32_t rtc)
+    {
+        return !has_utc_offset || rtc - utc_offset_rtc >= parameters.utc_offset_interval * RTC_TICKS_PER_SECOND;
+    }
+    void sendSntp(uint32_t rtc)
+    {
+        uint8_t packet[SNTP_PACKET_SIZE];
+        cookie = rtc ^ (syncs << 16) ^ (attempts << 8) ^ 0x5A5A5A5A; // changes with every request, so an old reply can't be taken for a new one
+        makeSntpRequest(packet, cookie);
+        sent = rtc;
+        attempts++;
+        stage = Stage::SNTP;
+        net.sendUdp(ntp_ip, SNTP_PORT, packet, SNTP_PACKET_SIZE);
+    }
+    /**
+     * @brief  opens the connection to the HTTP API and sends the request
+     * @retval false if it couldn't connect
+     */
+    bool startHttp(uint32_t rtc)
+    {
+        if (!net.openTcp(parameters.http_host, 80)) {
+            return false;
+        }
+        net.writeTcp("GET ");
+        net.writeTcp(parameters.http_path);
+        net.writeTcp(" HTTP/1.1\r\nHost: ");
+        net.writeTcp(parameters.http_host);
+        net.writeTcp("\r\nConnection: close\r\n\r\n");
+        http_parser.reset();
+        sent = rtc;
+        stage = Stage::HTTP;
+        return true;
+    }
+    /**
+     * @brief  reads the time and UTC offset from a worldtimeapi.org response
+     * @retval true if the clock was synchronized or the UTC offset updated
+     */
+    bool readHttp(uint32_t rtc)
+    {
+        int32_t offset;
+        if (!http_parser.utcOffset(offset)) {
+            return false;
+        }
+        utc_offset = offset;
+        has_utc_offset = true;
+        utc_offset_rtc = rtc;
+        int32_t local = http_parser.localSeconds();
+        if (local != -1) {
+            uint32_t utc = (local - offset + SECONDS_PER_DAY) % SECONDS_PER_DAY;
+            uint32_t difference = (clock.seconds(rtc) + SECONDS_PER_DAY - utc) % SECONDS_PER_DAY;
+            if (!clock.isSet() || (difference > 2 && difference < SECONDS_PER_DAY - 2)) { // whole seconds, so it only steps a clock that is clearly wrong
+                clock.sync(rtc, utc, RTC_TICKS_PER_SECOND / 2, false); // the middle of the second
+            }
+        }
+        return true;
+    }
+    /**
+     * @brief  goes back to waiting, for resync_interval if the sync worked and retry_interval if it didn't
+     */
+    uint32_t finish(uint32_t rtc, bool synced)
+    {
+        if (synced) {
+            syncs++;
+        } else {
+            failures++;
+        }
+        stage = Stage::IDLE;
+        next_sync = rtc + (synced ? parameters.resync_interval : parameters.retry_interval) * RTC_TICKS_PER_SECOND;
+        return millisecondsUntil(rtc, next_sync);
+    }
+
+public:
+    TimeSync(Net& _net, const TimeSyncParameters& _parameters)
+        : net(_net)
+        , parameters(_parameters)
+    {
+        stage = Stage::IDLE;
+        next_sync = 0;
+        sent = 0;
+        cookie = 0;
+        attempts = 0;
+        ntp_ip = 0;
+        utc_offset = parameters.default_utc_offset;
+        has_utc_offset = false;
+        utc_offset_rtc = 0;
+        sntp_synced = false;
+        syncs = 0;
+        failures = 0;
+    }
+    /**
+     * @brief  Takes the next step of a sync, or starts one if it's time to. Never waits for the network.
+     * @param  rtc: the RTC's count
+     * @param  can_block: true if connecting to WiFi, looking up a host name or opening a TCP connection can take a few seconds right now
+     *      (ex: the motor is off). Otherwise syncs that need them wait, only SNTP through a connection that's already up runs.
+     * @retval milliseconds until update() should be called again
+     */
+    uint32_t update(uint32_t rtc, bool can_block)
+    {
+        clock.rebase(rtc);
+        switch (stage) {
+        case Stage::IDLE:
+            if ((int32_t)(rtc - next_sync) < 0) {
+                return millisecondsUntil(rtc, next_sync);
+            }
+            if (!net.connected() && !(can_block && net.connect())) {
+                return can_block ? finish(rtc, false) : parameters.reply_timeout; // try again when it can block
+            }
+            if (ntp_ip == 0 && can_block) {
+                ntp_ip = net.resolve(parameters.ntp_host);
+            }
+            attempts = 0;
+            sntp_synced = false;
+            if (ntp_ip != 0) {
+                sendSntp(rtc);
+                return POLL_INTERVAL;
+            }
+            if (can_block && startHttp(rtc)) {
+                return POLL_INTERVAL;
+            }
+            return can_block ? finish(rtc, false) : parameters.reply_timeout;
+        case Stage::SNTP: {
+            uint8_t packet[SNTP_PACKET_SIZE];
+            int length = net.receiveUdp(packet, SNTP_PACKET_SIZE);
+            uint32_t seconds;
+            uint32_t fraction;
+            if (length > 0 && readSntpReply(packet, length, cookie, seconds, fraction)) {
+                // the server's time is from about halfway through the round trip
+                uint32_t round_trip = rtc - sent;
+                uint32_t ticks = (((uint64_t)fraction * RTC_TICKS_PER_SECOND) >> 32) + round_trip / 2;
+                clock.sync(rtc, seconds, ticks, true);
+                sntp_synced = true;
+                if (needsHttp(rtc) && can_block && startHttp(rtc)) { // only for the UTC offset
+                    return POLL_INTERVAL;
+                }
+                return finish(rtc, true);
+            }
+            if (millisecondsUntil(rtc, after(sent, parameters.reply_timeout)) > 0) {
+                return POLL_INTERVAL;
+            }
+            if (attempts < parameters.sntp_attempts) {
+                sendSntp(rtc);
+                return POLL_INTERVAL;
+            }
+            ntp_ip = 0; // look the server up again next time, its address may have changed
+            if (can_block && startHttp(rtc)) {
+                return POLL_INTERVAL;
+            }
+            return finish(rtc, false);
+        }
+        case Stage::HTTP: {
+            int c;
+            while (!http_parser.finished() && (c = net.readTcp()) != -1) {
+                http_parser.feed(c);
+            }
+            if (!http_parser.finished() && net.tcpOpen() && millisecondsUntil(rtc, after(sent, parameters.http_timeout)) > 0) {
+                return POLL_INTERVAL;
+            }
+            net.closeTcp();
+            bool read = readHttp(rtc);
+            return finish(rtc, sntp_synced || (read && clock.isSet()));
+        }
+        }
+        return POLL_INTERVAL;
+    }
+    /**
+     * @brief  true once the clock has been set
+     */
+    bool synced()
+    {
+        return clock.isSet();
+    }
+    /**
+     * @brief  local time in seconds since a midnight, for TimeOfDayText
+     */
+    uint32_t localSeconds(uint32_t rtc)
+    {
+        return clock.seconds(rtc) + (uint32_t)(utc_offset + (int32_t)SECONDS_PER_DAY); // the offset is less than a day, so this stays on the same time of day
+    }
+    /**
+     * @brief  UTC offset in seconds, from the HTTP API or the default
+     */
+    int32_t utcOffset()
+    {
+        return utc_offset;
+    }
+    /**
+     * @brief  the time base and UTC offset, for restore()
+     */
+    TimeSyncState save()
+    {
+        return { clock.save(), utc_offset, has_utc_offset };
+    }
+    /**
+     * @brief  continues from a save() before a reset, the RTC has to have kept counting since
+     * @param  rtc: the RTC's count, the UTC offset is asked for again utc_offset_interval after it
+     * @note   The next update() still syncs, a reset can have lost a few ticks while the RTC's clock was being set up again.
+     */
+    void restore(const TimeSyncState& state, uint32_t rtc)
+    {
+        clock.restore(state.time_base);
+        utc_offset = state.utc_offset;
+        has_utc_offset = state.has_utc_offset;
+        utc_offset_rtc = rtc;
+    }
+    Stage currentStage()
+    {
+        return stage;
+    }
+    DisciplinedClock& timeBase()
+    {
+        return clock;
+    }
+    /**
+     * @brief  syncs that got the time
+     */
+    uint32_t syncCount()
+    {
+        return syncs;
+    }
+    /**
+     * @brief  syncs that didn't get the time from either source
+     */
+    uint32_t failureCount()
+    {
+        return failures;
+    }
+};
+
+#endif // TIME_SYNC_H
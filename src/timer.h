@@ -1,14 +1,42 @@
 /**
- * timer.h contains functions for configuring, starting, and stopping a timer interrupt. The code is based on work done in lab 4.
+ * timer.h contains functions for configuring a timer interrupt that runs once per column of the image. The code is based on work done in lab 4.
+ * TC3 counts freely and is never stopped or reconfigured, each column is scheduled by moving its compare value forward,
+ * so the columns of a revolution add up to exactly the measured rotation interval.
+ * TC3 also timestamps beam breaks: the pin's edge is routed through the event system to capture channel 1, so the timestamp is latched
+ * in hardware when the edge happens instead of when the beam break ISR gets to run.
  */
 #ifndef TIMER_H
 #define TIMER_H
 #include <Arduino.h>
 
-const int CLOCKFREQ = 1000000; // Unlike the lab, here we use a clock divider of 4 to allow for slower speeds
+const uint32_t CLOCKFREQ = 1000000; // Unlike the lab, here we use a clock divider of 4 to allow for slower speeds, one tick is one microsecond
+const uint16_t MIN_COMPARE_LEAD = 8; // a compare value set closer than this many ticks ahead of the count might be passed before it is written
+const uint8_t CAPTURE_EVSYS_CHANNEL = 1; // channel 0 is used by apa102_dma.h
+const uint8_t CAPTURE_WAIT_LOOPS = 100; // how long to wait for a capture that hasn't arrived yet when the beam break ISR runs, a few microseconds
+
+volatile uint16_t timer_overflows; // upper 16 bits of the 32 bit time, counted by TC3_Handler
+
+/**
+ * @brief  state of the column schedule, only used by beamBreakIsr and TC3_Handler
+ * @note   Both change it and CC[0], and beamBreakIsr switches READREQ away from COUNT, so they have to run at the same NVIC priority
+ *      (0, the EIC's priority from attachInterrupt()) where neither can interrupt the other.
+ * @note   The interval of a rotation rarely divides evenly by the number of columns. Like Bresenham's line algorithm,
+ *      error_accumulator adds up the remainder and makes a column one tick longer each time it overflows,
+ *      so no column is more than a tick off and the last column ends exactly one rotation interval after the first one started.
+ */
+struct ColumnSchedule {
+    uint32_t columns;
+    uint32_t period; // whole ticks in every column
+    uint32_t remainder; // ticks left over from rotation_ticks / columns
+    uint32_t error_accumulator;
+    uint32_t ticks_to_column; // ticks between the compare value that is set and the start of the next column
+    bool column_at_compare; // false if the compare value that is set is only part of a column that is longer than the 16 bit counter
+    uint16_t compare;
+};
+ColumnSchedule column_schedule;
 
 /**
- * @brief Call this on startup to initialize the timer, it doesn't start the interrupt running.
+ * @brief Call this on startup to initialize the timer, it starts counting but doesn't start the interrupt running.
  */
 void setupTimer()
 {
@@ -18,42 +46,182 @@ void setupTimer()
     GCLK->GENCTRL.reg = GCLK_GENCTRL_GENEN | GCLK_GENCTRL_IDC | GCLK_GENCTRL_ID(4) | GCLK_GENCTRL_SRC_OSC8M;
     while (GCLK->STATUS.bit.SYNCBUSY);
     GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(27) | GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN(4);
-    
-    // LAB STEP 6: Disable TC (for now)
+
+    // LAB STEP 6: Disable TC while configuring it
     TC3->COUNT16.CTRLA.reg &= ~TC_CTRLA_ENABLE;
     while (TC3->COUNT16.STATUS.bit.SYNCBUSY);
     TC3->COUNT16.INTENCLR.reg |= TC_INTENCLR_MC0;
+    // count from 0 to 0xFFFF and wrap around forever (normal frequency), CC[0] only generates the interrupt
+    TC3->COUNT16.CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_PRESCALER_DIV2 | TC_CTRLA_PRESCSYNC_PRESC | TC_CTRLA_WAVEGEN_NFRQ;
+    while (TC3->COUNT16.STATUS.bit.SYNCBUSY);
+    TC3->COUNT16.READREQ.reg = TC_READREQ_RCONT | TC_READREQ_ADDR(TC_COUNT16_COUNT_OFFSET); // keep COUNT synchronized so it can be read without waiting
+    TC3->COUNT16.INTENSET.reg = TC_INTENSET_OVF; // extends the counter to 32 bits, see readTimer32()
+    TC3->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+    while (TC3->COUNT16.STATUS.bit.SYNCBUSY);
     // Set up NVIC:
-    NVIC_SetPriority(TC3_IRQn, 0);
+    NVIC_SetPriority(TC3_IRQn, 0); // the same as the EIC, see column_schedule
     NVIC_EnableIRQ(TC3_IRQn);
 }
 
 /**
- * @brief  Sets correct TC timer value and enables TC interrupt at the desired frequency
- * @note  Depending on clock frequency and clock devisor there will be lower and upper limits for freq
- * Non-blocking: TC interrupts can happen while program executes
- * @param  freq: Frequency to run timer interrupt at, in hertz
+ * @brief  current value of the free running 16 bit counter, in ticks of 1/CLOCKFREQ seconds
  */
-void setTimerISRRate(int freq)
+inline uint16_t readTimerCount()
 {
-    // Turn off interrupts to TC3 on MC0 when configuring
-    TC3->COUNT16.INTENCLR.reg |= TC_INTENCLR_MC0;
-    // Configure TC3 to play note
-    TC3->COUNT16.CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_PRESCALER_DIV2 | TC_CTRLA_PRESCSYNC_PRESC | TC_CTRLA_WAVEGEN_MFRQ | TC_CTRLA_ENABLE;
-    while (TC3->COUNT16.STATUS.bit.SYNCBUSY);
-    TC3->COUNT16.CC[0].reg = CLOCKFREQ / freq;
+    return TC3->COUNT16.COUNT.reg;
+}
+
+/**
+ * @brief  current time in ticks of 1/CLOCKFREQ seconds, the 16 bit counter extended with the overflows counted by TC3_Handler. Wraps after 71 minutes
+ * @note   Safe to call from any ISR, including one that interrupted TC3_Handler before it counted an overflow.
+ */
+uint32_t readTimer32()
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint16_t count = readTimerCount();
+    uint32_t overflows = timer_overflows;
+    if (TC3->COUNT16.INTFLAG.bit.OVF && count < 0x8000) { // wrapped, but TC3_Handler hasn't counted it yet
+        overflows++;
+    }
+    __set_PRIMASK(primask);
+    return (overflows << 16) | count;
+}
+
+/**
+ * @brief  Call this on startup after attachInterrupt(pin, ...), so every edge that runs the pin's ISR is also captured by TC3.
+ * @param  pin: Arduino pin number of a pin with an external interrupt, ex: BEAM_BREAK_PIN
+ */
+void setupBeamBreakCapture(byte pin)
+{
+    uint32_t extint = g_APinDescription[pin].ulExtInt;
+
+    // the EIC generates an event whenever the interrupt condition (edge) set by attachInterrupt() is detected
+    EIC->CTRL.reg &= ~EIC_CTRL_ENABLE; // EVCTRL can only be written while the EIC is disabled
+    while (EIC->STATUS.bit.SYNCBUSY)
+        ;
+    EIC->EVCTRL.reg |= 1 << extint;
+    EIC->CTRL.reg |= EIC_CTRL_ENABLE;
+    while (EIC->STATUS.bit.SYNCBUSY)
+        ;
+
+    // route the event to TC3
+    PM->APBCMASK.reg |= PM_APBCMASK_EVSYS;
+    GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(GCLK_CLKCTRL_ID_EVSYS_0_Val + CAPTURE_EVSYS_CHANNEL) | GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN(0);
+    while (GCLK->STATUS.bit.SYNCBUSY)
+        ;
+    EVSYS->USER.reg = EVSYS_USER_USER(EVSYS_ID_USER_TC3_EVU) | EVSYS_USER_CHANNEL(CAPTURE_EVSYS_CHANNEL + 1); // USER.CHANNEL is the event channel + 1
+    EVSYS->CHANNEL.reg = EVSYS_CHANNEL_CHANNEL(CAPTURE_EVSYS_CHANNEL) | EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_EIC_EXTINT_0 + extint) | EVSYS_CHANNEL_PATH_RESYNCHRONIZED | EVSYS_CHANNEL_EDGSEL_RISING_EDGE;
+
+    // each event copies COUNT into CC[1], CC[0] keeps scheduling columns
+    TC3->COUNT16.CTRLA.reg &= ~TC_CTRLA_ENABLE; // EVCTRL and CTRLC can only be written while TC3 is disabled
+    while (TC3->COUNT16.STATUS.bit.SYNCBUSY)
+        ;
+    TC3->COUNT16.EVCTRL.reg |= TC_EVCTRL_TCEI | TC_EVCTRL_EVACT_OFF;
+    TC3->COUNT16.CTRLC.reg |= TC_CTRLC_CPTEN1;
+    while (TC3->COUNT16.STATUS.bit.SYNCBUSY)
+        ;
+    TC3->COUNT16.INTFLAG.reg = TC_INTFLAG_MC1;
+    TC3->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+    while (TC3->COUNT16.STATUS.bit.SYNCBUSY)
+        ;
+}
+
+/**
+ * @brief  Call from the beam break ISR, gets the time the edge that caused it was captured.
+ * @param  now: readTimer32() at the start of the ISR, after the edge
+ * @retval time of the edge in the same ticks as readTimer32(), or now if no capture happened (ex: setupBeamBreakCapture() wasn't called)
+ */
+uint32_t readBeamBreakCapture(uint32_t now)
+{
+    for (uint8_t i = 0; i < CAPTURE_WAIT_LOOPS && !TC3->COUNT16.INTFLAG.bit.MC1; i++) // the event goes through two clock domains, the interrupt can get here first
+        ;
+    if (!TC3->COUNT16.INTFLAG.bit.MC1) {
+        return now;
+    }
+    TC3->COUNT16.READREQ.reg = TC_READREQ_RREQ | TC_READREQ_ADDR(TC_COUNT16_CC_OFFSET + 2); // CC[1]
+    while (TC3->COUNT16.STATUS.bit.SYNCBUSY)
+        ;
+    uint16_t captured = TC3->COUNT16.CC[1].reg;
+    TC3->COUNT16.INTFLAG.reg = TC_INTFLAG_MC1;
+    TC3->COUNT16.READREQ.reg = TC_READREQ_RCONT | TC_READREQ_ADDR(TC_COUNT16_COUNT_OFFSET); // back to keeping COUNT synchronized
+    return now - (uint16_t)((uint16_t)now - captured); // the capture is less than one counter period (65 ms) before now
+}
+
+/**
+ * @brief  moves the compare value to the start of the next column (or part way there, for columns longer than the counter can time at once)
+ */
+void scheduleNextCompare()
+{
+    ColumnSchedule& s = column_schedule;
+    if (s.ticks_to_column == 0) {
+        s.ticks_to_column = s.period;
+        s.error_accumulator += s.remainder;
+        if (s.error_accumulator >= s.columns) {
+            s.error_accumulator -= s.columns;
+            s.ticks_to_column++;
+        }
+    }
+    uint32_t step = (s.ticks_to_column > 0xFFFF) ? 0x8000 : s.ticks_to_column; // 0x8000 so the step after this one is never tiny
+    s.ticks_to_column -= step;
+    s.column_at_compare = (s.ticks_to_column == 0);
+    s.compare += step; // relative to the last compare, not to when this ISR happened to run, so interrupt latency doesn't add up
+
+    uint16_t lead = s.compare - readTimerCount();
+    if (lead < MIN_COMPARE_LEAD || lead > step) { // already passed (ex: a column took longer than its period to send), don't wait for the counter to wrap
+        s.compare = readTimerCount() + MIN_COMPARE_LEAD;
+    }
+    TC3->COUNT16.CC[0].reg = s.compare;
     while (TC3->COUNT16.STATUS.bit.SYNCBUSY);
-    // Turn interrupts to TC3 on MC0 back on
-    TC3->COUNT16.INTENSET.reg |= TC_INTENSET_MC0;
 }
 
 /**
- * @brief Turns off TC timer
+ * @brief  Starts (or restarts) the timer interrupt, spreading columns evenly over the next rotation_ticks ticks. Call from the beam break ISR.
+ * @note  Non-blocking: TC interrupts can happen while program executes. There is no lower limit on the rotation speed.
+ * @param  rotation_ticks: expected interval of the next rotation, in ticks of 1/CLOCKFREQ seconds (microseconds)
+ * @param  columns: number of columns in a rotation, TC3_Handler runs once per column
+ * @param  start: time the rotation started (ex: readBeamBreakCapture()), the first column ends one column period after it
+ */
+void startColumnTimer(uint32_t rotation_ticks, uint32_t columns, uint32_t start)
+{
+    ColumnSchedule& s = column_schedule;
+    s.columns = columns;
+    s.period = rotation_ticks / columns;
+    s.remainder = rotation_ticks % columns;
+    s.error_accumulator = 0;
+    s.ticks_to_column = 0;
+    s.compare = start;
+    scheduleNextCompare();
+    TC3->COUNT16.INTFLAG.reg = TC_INTFLAG_MC0; // forget a compare from the last rotation
+    TC3->COUNT16.INTENSET.reg = TC_INTENSET_MC0;
+}
+
+/**
+ * @brief  Call at the start of TC3_Handler, counts an overflow and schedules the next compare.
+ * @retval true if a new column starts now, false if this interrupt was an overflow or only part way through a long column
+ */
+bool advanceColumnTimer()
+{
+    if (TC3->COUNT16.INTFLAG.bit.OVF) {
+        __disable_irq(); // the flag and the count must change together for readTimer32() in a higher priority ISR
+        TC3->COUNT16.INTFLAG.reg = TC_INTFLAG_OVF;
+        timer_overflows++;
+        __enable_irq();
+    }
+    if (!TC3->COUNT16.INTFLAG.bit.MC0 || !TC3->COUNT16.INTENSET.bit.MC0) { // the flag is also set while the interrupt is off
+        return false;
+    }
+    TC3->COUNT16.INTFLAG.reg = TC_INTFLAG_MC0; // Clear interrupt register flag
+    bool column = column_schedule.column_at_compare;
+    scheduleNextCompare();
+    return column;
+}
+
+/**
+ * @brief Turns off the timer interrupt, the counter keeps running
  */
 void stopTimerInterrupts()
 {
-    TC3->COUNT16.INTENCLR.reg |= TC_INTENCLR_MC0;
-    TC3->COUNT16.CTRLA.reg &= ~TC_CTRLA_ENABLE;
-    while (TC3->COUNT16.STATUS.bit.SYNCBUSY);
+    TC3->COUNT16.INTENCLR.reg = TC_INTENCLR_MC0;
 }
-#endif
\ No newline at end of file
+#endif
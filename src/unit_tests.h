@@ -1,7 +1,28 @@
 #ifndef UNIT_TESTS_H
 #define UNIT_TESTS_H
+#include "font.h"
+#include "autotune.h"
+#include "events.h"
+#include "fsm.h"
 #include "fsm_types.h"
+#include "ir_direction.h"
+#include "ir_remote.h"
+#include "motor_pwm.h"
+#include "palette.h"
+#include "framebuffer.h"
+#include "pid.h"
+#include "render_scheduler.h"
+#include "rotation.h"
+#include "spinup.h"
+#include "spsc.h"
+#include "supervisor.h"
+#include "text_renderer.h"
+#include "time_of_day.h"
+#include "time_sync.h"
+#include "warm_restart.h"
+#include "worldtime_parser.h"
 #include <Arduino.h>
+#include <FastLED.h>
 
 enum class Mock_Led {
     NONE = 0,
@@ -25,14 +46,23 @@ Mock_Tone mock_tone;
 enum class Mock_Motor {
     OFF = 0,
     RAMP = 1,
-    ON = 2
+    ON = 2,
+    RELAY = 3
 };
 Mock_Motor mock_motor;
+int32_t mock_motor_duty; // duty cycle the FSM set the motor to
 
 FsmInput test_input;
 
 extern State updateFSM(State state, FsmInput fsm_input);
-extern volatile unsigned long start_micros;
+extern TableFsm<State, FsmInput> clockFsm;
+extern unsigned long start_micros;
+extern volatile bool displaying;
+extern RelayTuner motorTuner;
+extern RotationEstimator rotationEstimator;
+extern SetpointSupervisor setpointSupervisor;
+extern int32_t speed_setpoint;
+extern const unsigned long fsm_poll_interval;
 
 /**
  * resets all variables used for tests (call between tests)
@@ -42,6 +72,7 @@ void resetInput()
     test_input.last_beam_break = micros();
     test_input.micros = micros();
     test_input.rotation_interval = 0;
+    test_input.rotation_jitter = 0;
     test_input.start_button = false;
     test_input.stop_button = false;
     test_input.bat_volt = 0;
@@ -52,215 +83,2100 @@ void resetInput()
 }
 
 /**
- * @brief  Runs unit tests of the FSM and prints results to the Serial monitor
- * @note  This function never exits, it ends with while(true)
+ * @brief  tests integerAtan2() against atan2(), and IrDirection on bursts of hits, including one around column 0
+ * @retval true if passed
  */
-void runAllTests()
+bool testIrDirection()
 {
     bool passed = true;
-    resetInput();
-    State retval;
-    State inputState;
-    // Test 1-1
-    inputState = State::s01_MOTOR_OFF;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s01_MOTOR_OFF) or (mock_builtin != Mock_Builtin::BLINK)) {
-        Serial.println("Test 1-1 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received builtin:");
-        Serial.println((int)mock_builtin);
+    for (int degrees = 0; degrees < 360; degrees++) {
+        for (double magnitude : { 3.0, 1000.0, 2000000000.0 }) {
+            double radians = degrees * TWO_PI / 360 + 0.3; // not exactly on an octant boundary
+            int32_t x = cos(radians) * magnitude;
+            int32_t y = sin(radians) * magnitude;
+            double expected = atan2(y, x) * 65536 / TWO_PI;
+            double error = fmod(integerAtan2(y, x) - expected + 65536 + 32768, 65536) - 32768;
+            if (abs(error) > (magnitude > 100 ? 41 : 1200)) { // 0.22 degrees, or the angle (x, y) can express at a magnitude of 3
+                Serial.println("Test integer atan2 failed");
+                Serial.println("Received angle:");
+                Serial.println(integerAtan2(y, x));
+                Serial.println("Expected angle:");
+                Serial.println(expected);
+                Serial.println();
+                passed = false;
+            }
+        }
+    }
+
+    IrDirection<125> ir;
+    unsigned long now = 1000000;
+    const int bursts[][10] = {
+        { 28, 29, 29, 30, 30, 30, 30, 31, 31, 32 },
+        { 123, 124, 124, 0, 0, 0, 0, 1, 1, 2 }, // around the beam break
+    };
+    const int expected[] = { 30, 0 };
+    for (uint8_t b = 0; b < 2; b++) {
+        now += 500000; // a new burst
+        for (uint8_t i = 0; i < 10; i++) {
+            if (ir.direction() != -1) { // not enough hits yet
+                Serial.println("Test ir direction too early failed");
+                Serial.println();
+                passed = false;
+            }
+            ir.addHit(bursts[b][i], now);
+            now += 800;
+        }
+        int direction = ir.direction(); // right away, not after the burst ends
+        if (direction != expected[b] || ir.direction() != -1) {
+            Serial.println("Test ir direction failed");
+            Serial.println("Received direction:");
+            Serial.println(direction);
+            Serial.println("Expected direction:");
+            Serial.println(expected[b]);
+            Serial.println();
+            passed = false;
+        }
+    }
+    ir.reset();
+    ir.addHit(60, now);
+    if (ir.direction() != -1) {
+        Serial.println("Test ir direction reset failed");
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 1-2
-    inputState = State::s01_MOTOR_OFF;
-    test_input.start_button = true;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s02_WAIT) or (mock_tone != Mock_Tone::WAIT) or (mock_builtin != Mock_Builtin::OFF)) {
-        Serial.println("Test 1-2 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received tone:");
-        Serial.println((int)mock_tone);
-        Serial.println("Received builtin:");
-        Serial.println((int)mock_builtin);
+    return passed;
+}
+
+/**
+ * @brief  appends the edges of a mark (light for mark microseconds) and the space after it, each off by up to error microseconds
+ */
+void addIrPulse(IrEdge* edges, uint8_t& count, uint32_t& ticks, uint16_t mark, uint16_t space, int16_t column, int16_t error)
+{
+    edges[count++] = { ticks, true, column };
+    ticks += mark + error;
+    edges[count++] = { ticks, false, column };
+    ticks += space - error;
+}
+
+/**
+ * @brief  the edges of a NEC frame with the marks alternately error microseconds too long and too short
+ * @retval number of edges
+ */
+uint8_t makeNecFrame(IrEdge* edges, uint32_t& ticks, uint32_t bits, int16_t column, int16_t error)
+{
+    uint8_t count = 0;
+    addIrPulse(edges, count, ticks, NecDecoder::LEADER_MARK, NecDecoder::LEADER_SPACE, column, error);
+    for (uint8_t i = 0; i < 32; i++) {
+        addIrPulse(edges, count, ticks, NecDecoder::BIT_MARK, (bits >> i) & 1 ? NecDecoder::ONE_SPACE : NecDecoder::ZERO_SPACE, column, (i % 2) ? error : -error);
+    }
+    addIrPulse(edges, count, ticks, NecDecoder::BIT_MARK, 40000, column, 0);
+    return count;
+}
+
+/**
+ * @brief  tests NecDecoder on clean, jittery, corrupted, cut off and repeated frames and the CircuitPython remote's bursts, and the ring of edges when it is full
+ * @retval true if passed
+ */
+bool testNecDecoder()
+{
+    bool passed = true;
+    struct Case {
+        const char* name;
+        uint8_t garbage_edges; // edges of another protocol (ex: the bursts of circuit_python_IR_remote) before the frame
+        uint8_t cut_off_edges; // edges of a frame that stops part way through, before the frame
+        uint32_t bits;
+        int16_t error;
+        bool expected;
+    };
+    const Case cases[] = {
+        { "clean", 0, 0, 0xBA45FF00, 0, true }, // address 0x00, command 0x45
+        { "jitter", 0, 0, 0xBA45FF00, 130, true },
+        { "too much jitter", 0, 0, 0xBA45FF00, 200, false },
+        { "inverse", 0, 0, 0xBB45FF00, 0, false },
+        { "after bursts", 10, 0, 0x00FF1234, 0, true }, // extended address 0x1234, command 0xFF
+        { "after cut off frame", 0, 40, 0xBA45FF00, 0, true },
+    };
+    IrEdge edges[80];
+    for (uint8_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        NecDecoder decoder;
+        NecFrame frame;
+        uint8_t frames = 0;
+        uint32_t ticks = 123456;
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < cases[c].garbage_edges / 2; i++) {
+            addIrPulse(edges, count, ticks, 1000, 1500, 7, 0);
+        }
+        for (uint8_t i = 0; i < count; i++) {
+            frames += decoder.addEdge(edges[i], frame);
+        }
+        if (cases[c].cut_off_edges != 0) {
+            makeNecFrame(edges, ticks, 0xBA45FF00, 7, 0);
+            for (uint8_t i = 0; i < cases[c].cut_off_edges; i++) {
+                frames += decoder.addEdge(edges[i], frame);
+            }
+            ticks = edges[cases[c].cut_off_edges - 1].ticks + 20000;
+        }
+        count = makeNecFrame(edges, ticks, cases[c].bits, 40, cases[c].error);
+        for (uint8_t i = 0; i < count; i++) {
+            frames += decoder.addEdge(edges[i], frame);
+        }
+        bool decoded = frames == 1 && frame.address == (cases[c].bits & 0xFFFF) && frame.command == ((cases[c].bits >> 16) & 0xFF) && !frame.repeat && frame.column == 40;
+        if (decoded != cases[c].expected || (!cases[c].expected && frames != 0)) {
+            Serial.println("Test nec decoder failed");
+            Serial.println(cases[c].name);
+            Serial.println("Received frames:");
+            Serial.println(frames);
+            Serial.println();
+            passed = false;
+        }
+        if (cases[c].expected) { // holding the key down
+            count = 0;
+            addIrPulse(edges, count, ticks, NecDecoder::LEADER_MARK, NecDecoder::REPEAT_SPACE, 90, 0);
+            addIrPulse(edges, count, ticks, NecDecoder::BIT_MARK, 40000, 90, 0);
+            frames = 0;
+            for (uint8_t i = 0; i < count; i++) {
+                frames += decoder.addEdge(edges[i], frame);
+            }
+            if (frames != 1 || !frame.repeat || frame.command != ((cases[c].bits >> 16) & 0xFF) || frame.column != 90) {
+                Serial.println("Test nec decoder repeat failed");
+                Serial.println(cases[c].name);
+                Serial.println();
+                passed = false;
+            }
+        }
+    }
+
+    SpscRing<IrEdge, 128> ring;
+    for (uint16_t i = 0; i < 200; i++) {
+        ring.push({ i, (i % 2) == 0, 0 });
+    }
+    IrEdge edge;
+    uint16_t popped = 0;
+    while (ring.pop(edge)) {
+        if (edge.ticks != popped) {
+            passed = false;
+        }
+        popped++;
+    }
+    if (popped != 127 || ring.dropped() != 73) {
+        Serial.println("Test ir edge ring failed");
+        Serial.println("Received edges and dropped edges:");
+        Serial.println(popped);
+        Serial.println(ring.dropped());
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 2-1
-    inputState = State::s02_WAIT;
-    test_input.stop_button = true;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s01_MOTOR_OFF) or (mock_tone != Mock_Tone::OFF)) {
-        Serial.println("Test 2-1 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received tone:");
-        Serial.println((int)mock_tone);
+    return passed;
+}
+
+/**
+ * @brief  the original per-pixel printString(), kept to check that the table driven one prints exactly the same pixels
+ */
+void printStringReference(const char* str, long x_pos, CRGB foreground, CRGB background, CRGB image[][8], int width)
+{
+    for (unsigned int i = 0; i <= strlen(str); i++) {
+        long p = x_pos + (long)(i * 6); // signed, an unsigned sum would wrap the negative positions to other columns where long is 32 bits
+        for (int x = 0; x < 6; x++) {
+            int column = ((p % width) + width + x) % width;
+            for (int y = 0; y < 8; y++) {
+                if (x < 5)
+                    image[column][y] = bitRead(font[(byte)str[i] * 5 + x], 7 - y) ? foreground : background;
+                else
+                    image[column][y] = background;
+            }
+        }
+    }
+}
+
+/**
+ * @brief  prints every character at wrapping, negative and huge positions with printString() and printStringReference() and compares the images
+ * @retval true if every image was identical
+ */
+bool testPrintString()
+{
+    const int width = 125;
+    static CRGB image[width][8];
+    static CRGB reference[width][8];
+    char str[22];
+    const long positions[] = { 0, 1, 119, 124, 125, 4000, -1, -6, -4000, 71582788 };
+    const int widths[] = { width, 7 }; // at width 7 the string wraps around onto itself
+    bool passed = true;
+    for (int w = 0; w < 2; w++) {
+        for (int first = 0; first < 256; first += 21) {
+            for (int i = 0; i < 21; i++) {
+                str[i] = (char)((first + i) % 255 + 1); // every character except null
+            }
+            str[21] = '\0';
+            for (unsigned int p = 0; p < sizeof(positions) / sizeof(positions[0]); p++) {
+                memset(image, 0, sizeof(image));
+                memset(reference, 0, sizeof(reference));
+                printString(str, positions[p], CRGB(255, 100, 0), CRGB(0, 0, 7), image, widths[w]);
+                printStringReference(str, positions[p], CRGB(255, 100, 0), CRGB(0, 0, 7), reference, widths[w]);
+                if (memcmp(image, reference, sizeof(image)) != 0) {
+                    Serial.println("Test printString failed");
+                    Serial.println("Received position:");
+                    Serial.println(positions[p]);
+                    Serial.println("Received first character:");
+                    Serial.println(first);
+                    Serial.println();
+                    passed = false;
+                }
+            }
+        }
+    }
+    return passed;
+}
+
+/**
+ * @brief  prints strings into a PaletteColumn image and a CRGB image with the palette's colors, and compares them after expanding
+ * @retval true if every pixel matched, and TextRenderer redrew nothing for a change of the palette
+ */
+template <uint8_t bits>
+bool checkPaletteImage()
+{
+    const int width = 125;
+    static PaletteColumn<bits> image[width];
+    static CRGB reference[width][8];
+    CRGB palette[PaletteColumn<bits>::COLORS];
+    for (uint8_t i = 0; i < PaletteColumn<bits>::COLORS; i++) {
+        palette[i] = CRGB(i * 16, 255 - i, i * 7 + 1);
+    }
+    const uint8_t foreground = bits == 1 ? 1 : PaletteColumn<bits>::MASK / 3; // 0101 and 1010 with 4 bits, so every bit of a pixel is checked
+    const uint8_t background = bits == 1 ? 0 : foreground * 2;
+    const long positions[] = { 0, 119, 124, -6, 4000, 71582788 };
+    const int widths[] = { width, 7 };
+    bool passed = true;
+    for (int w = 0; w < 2; w++) {
+        for (unsigned int p = 0; p < sizeof(positions) / sizeof(positions[0]); p++) {
+            memset((void*)image, 0, sizeof(image));
+            for (int x = 0; x < width; x++) { // index 0 everywhere, like image
+                for (uint8_t y = 0; y < 8; y++) {
+                    reference[x][y] = palette[0];
+                }
+            }
+            printString("12:34:56 A~", positions[p], foreground, background, image, widths[w]);
+            printString("12:34:56 A~", positions[p], palette[foreground], palette[background], reference, widths[w]);
+            for (int x = 0; x < widths[w]; x++) {
+                CRGB pixels[8];
+                image[x].expand(palette, pixels);
+                for (uint8_t y = 0; y < 8; y++) {
+                    if (pixels[y] != reference[x][y]) {
+                        passed = false;
+                    }
+                }
+            }
+        }
+    }
+
+    PaletteColumn<bits> column;
+    for (uint8_t y = 0; y < 8; y++) {
+        column.set(y, y * 3);
+    }
+    for (uint8_t y = 0; y < 8; y++) {
+        if (column.get(y) != ((y * 3) & PaletteColumn<bits>::MASK)) {
+            passed = false;
+        }
+    }
+
+    static PaletteColumn<bits> images[3][width];
+    memset((void*)images, 0, sizeof(images));
+    TextRenderer<3, PaletteColumn<bits>, uint8_t> renderer;
+    renderer.render(0, "12:34:56", 10, 1, 0, images[0], width);
+    renderer.render(0, "12:34:57", 10, 1, 0, images[0], width);
+    unsigned int changed = renderer.columnsTouched();
+    renderer.render(0, "12:34:57", 10, 1, 0, images[0], width); // the same string in a new color, only the palette changes
+    unsigned int recolored = renderer.columnsTouched();
+    memset((void*)image, 0, sizeof(image));
+    printString("12:34:57", 10, 1, 0, image, width);
+    if (changed != 6 || recolored != 0 || memcmp(image, images[0], sizeof(image)) != 0) {
+        passed = false;
+    }
+    return passed;
+}
+
+/**
+ * @brief  tests printString() and TextRenderer into images of 1, 2 and 4 bits per pixel
+ * @retval true if passed
+ */
+bool testPaletteFramebuffer()
+{
+    bool passed = true;
+    if (!checkPaletteImage<1>()) {
+        Serial.println("Test palette framebuffer failed with 1 bit per pixel");
+        passed = false;
+    }
+    if (!checkPaletteImage<2>()) {
+        Serial.println("Test palette framebuffer failed with 2 bits per pixel");
+        passed = false;
+    }
+    if (!checkPaletteImage<4>()) {
+        Serial.println("Test palette framebuffer failed with 4 bits per pixel");
+        passed = false;
+    }
+    return passed;
+}
+
+/**
+ * @brief  prints the RAM of a framebuffer's 3 images in a format, and the CPU cycles to draw a frame of the time with TextRenderer
+ *      (the color is a palette entry, so only the characters that changed are drawn) and to get one column ready for the LEDs
+ */
+template <typename Column, typename Color>
+void benchmarkImageFormat(const char* name, Column images[][125], Color foreground, Color background, unsigned long expand_micros)
+{
+    TextRenderer<3, Column, Color> renderer;
+    const int frames = 100;
+    unsigned long start = micros();
+    for (int i = 0; i < frames; i++) {
+        char text[9];
+        sprintf(text, "12:34:%02d", i / 10 % 60); // a new second every 10 frames
+        renderer.render(i % 3, text, 0, foreground, background, images[i % 3], 125);
+    }
+    unsigned long draw_micros = micros() - start;
+    Serial.println(name);
+    Serial.println(sizeof(Column) * 3 * 125);
+    Serial.println(draw_micros * (F_CPU / 1000000) / frames);
+    Serial.println(expand_micros);
+}
+
+/**
+ * @brief  prints benchmarkImageFormat() for CRGB[8] and PaletteColumn<1, 2 and 4>
+ */
+void benchmarkFramebufferFormats()
+{
+    static CRGB rgb[3][125][8];
+    static PaletteColumn<1> one[3][125];
+    static PaletteColumn<2> two[3][125];
+    static PaletteColumn<4> four[3][125];
+    CRGB palette[16] = {};
+    CRGB leds_out[8];
+    const int columns = 1000;
+    volatile uint8_t sink = 0; // so the copies aren't optimized out
+
+    Serial.println("Image format, bytes for 3 images of 125 columns, cycles per frame drawn, cycles per column shown:");
+    unsigned long start = micros();
+    for (int i = 0; i < columns; i++) {
+        const CRGB* column = rgb[0][i % 125];
+        for (int y = 0; y < 8; y++) {
+            leds_out[y] = column[y];
+        }
+        sink = leds_out[i & 7].r;
+    }
+    unsigned long rgb_expand = (micros() - start) * (F_CPU / 1000000) / columns;
+
+    TextRenderer<3, CRGB[8], CRGB> rgb_renderer;
+    start = micros();
+    for (int i = 0; i < 100; i++) {
+        char text[9];
+        sprintf(text, "12:34:%02d", i / 10 % 60);
+        rgb_renderer.render(i % 3, text, 0, CRGB(255, i * 2, 0), CRGB(0, 0, 0), rgb[i % 3], 125); // the color changes every frame
+    }
+    unsigned long rgb_draw = (micros() - start) * (F_CPU / 1000000) / 100;
+    Serial.println("CRGB[8]:");
+    Serial.println(sizeof(rgb));
+    Serial.println(rgb_draw);
+    Serial.println(rgb_expand);
+
+    start = micros();
+    for (int i = 0; i < columns; i++) {
+        one[0][i % 125].expand(palette, leds_out);
+        sink = leds_out[i & 7].r;
+    }
+    benchmarkImageFormat("PaletteColumn<1>:", one, (uint8_t)1, (uint8_t)0, (micros() - start) * (F_CPU / 1000000) / columns);
+    start = micros();
+    for (int i = 0; i < columns; i++) {
+        two[0][i % 125].expand(palette, leds_out);
+        sink = leds_out[i & 7].r;
+    }
+    benchmarkImageFormat("PaletteColumn<2>:", two, (uint8_t)1, (uint8_t)0, (micros() - start) * (F_CPU / 1000000) / columns);
+    start = micros();
+    for (int i = 0; i < columns; i++) {
+        four[0][i % 125].expand(palette, leds_out);
+        sink = leds_out[i & 7].r;
+    }
+    benchmarkImageFormat("PaletteColumn<4>:", four, (uint8_t)1, (uint8_t)0, (micros() - start) * (F_CPU / 1000000) / columns);
+    (void)sink;
+    Serial.println();
+}
+
+/**
+ * @brief  the bytes FastLED 3.5.0 sends for leds with FastLED.addLeds<APA102, data, clock, BGR>, brightness 255 and DISABLE_DITHER,
+ * written out from APA102Controller::showPixels() in its chipsets.h (with FASTLED_USE_GLOBAL_BRIGHTNESS left at 0)
+ * @param  out: filled with 4 + 4 * count + 4 * (count / 32 + 1) bytes
+ * @retval the number of bytes written
+ */
+uint16_t fastLedApa102Bytes(const CRGB* leds, uint16_t count, uint8_t* out)
+{
+    const uint8_t scale = 255; // PixelController's scale for brightness 255 and no color correction
+    const uint8_t brightness = 0x1F; // the constant global brightness when FASTLED_USE_GLOBAL_BRIGHTNESS is 0
+    uint16_t length = 0;
+    // startBoundary(): mSPI.writeWord(0) twice
+    for (uint8_t i = 0; i < 4; i++) {
+        out[length++] = 0x00;
+    }
+    for (uint16_t i = 0; i < count; i++) {
+        // loadAndScale0/1/2() read the channels in RGB_ORDER, scale8() is ((uint16_t)value * (1 + scale)) >> 8 with FASTLED_SCALE8_FIXED
+        const uint8_t bgr[3] = { leds[i].b, leds[i].g, leds[i].r };
+        // writeLed(): mSPI.writeWord(0xE000 | (brightness << 8) | b0) then mSPI.writeWord(b1 << 8 | b2), words go out high byte first
+        out[length++] = 0xE0 | brightness;
+        for (uint8_t c = 0; c < 3; c++) {
+            out[length++] = ((uint16_t)bgr[c] * (1 + scale)) >> 8;
+        }
+    }
+    // endBoundary(nLeds): int nDWords = nLeds / 32; do { 0xFF, 0x00, 0x00, 0x00 } while (nDWords--);
+    int dwords = count / 32;
+    do {
+        out[length++] = 0xFF;
+        out[length++] = 0x00;
+        out[length++] = 0x00;
+        out[length++] = 0x00;
+    } while (dwords--);
+    return length;
+}
+
+/**
+ * @brief  checks that an encoded Apa102Column is byte for byte what fastLedApa102Bytes() says FastLED sends for the same pixels,
+ * and that printing into an encoded image matches encoding a printed CRGB image
+ * @retval true if all bytes matched
+ */
+bool testApa102Encoding()
+{
+    const CRGB pixels[APA102_LEDS] = { CRGB(1, 2, 3), CRGB(255, 0, 0), CRGB(0, 255, 0), CRGB(0, 0, 255), CRGB(0, 0, 0), CRGB(255, 255, 255), CRGB(16, 32, 64), CRGB(200, 100, 50) };
+    // FastLED's bytes for these pixels, recorded so a change to fastLedApa102Bytes() itself is noticed too
+    const uint8_t recorded[APA102_COLUMN_BYTES] = {
+        0x00, 0x00, 0x00, 0x00,
+        0xFF, 3, 2, 1,
+        0xFF, 0, 0, 255,
+        0xFF, 0, 255, 0,
+        0xFF, 255, 0, 0,
+        0xFF, 0, 0, 0,
+        0xFF, 255, 255, 255,
+        0xFF, 64, 32, 16,
+        0xFF, 50, 100, 200,
+        0xFF, 0x00, 0x00, 0x00
+    };
+    uint8_t expected[APA102_COLUMN_BYTES + 4];
+    bool passed = true;
+    if (fastLedApa102Bytes(pixels, APA102_LEDS, expected) != APA102_COLUMN_BYTES || memcmp(expected, recorded, APA102_COLUMN_BYTES) != 0) {
+        Serial.println("Test FastLED APA102 reference failed");
+        passed = false;
+    }
+    Apa102Column column;
+    uint32_t random = 1;
+    for (uint16_t trial = 0; trial < 200; trial++) {
+        CRGB random_pixels[APA102_LEDS];
+        for (uint8_t i = 0; i < APA102_LEDS; i++) {
+            random = random * 1103515245 + 12345;
+            random_pixels[i] = CRGB(random >> 24, random >> 16, random >> 8);
+        }
+        encodeApa102Column(trial == 0 ? pixels : random_pixels, column);
+        fastLedApa102Bytes(trial == 0 ? pixels : random_pixels, APA102_LEDS, expected);
+        if (memcmp(column.bytes, expected, APA102_COLUMN_BYTES) != 0) {
+            Serial.println("Test APA102 encoding failed");
+            Serial.println("Received trial:");
+            Serial.println(trial);
+            Serial.println();
+            passed = false;
+        }
+    }
+
+    const int width = 13;
+    CRGB image[width][8];
+    Apa102Column encoded_image[width];
+    printString("hi!", -3, CRGB(255, 100, 0), CRGB(0, 0, 7), image, width);
+    printString("hi!", -3, CRGB(255, 100, 0), CRGB(0, 0, 7), encoded_image, width);
+    for (int x = 0; x < width; x++) {
+        encodeApa102Column(image[x], column);
+        if (memcmp(column.bytes, encoded_image[x].bytes, APA102_COLUMN_BYTES) != 0) {
+            Serial.println("Test APA102 printString failed");
+            Serial.println("Received column:");
+            Serial.println(x);
+            Serial.println();
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+/**
+ * @brief  replays noisy synthetic beam break timestamps through a RotationEstimator: jitter, a double trigger, a missed break,
+ * a late beam break, and then a steady acceleration
+ * @retval true if the estimates stayed within 1% and the bad beam breaks were rejected
+ */
+bool testRotationEstimator()
+{
+    RotationEstimator estimator;
+    bool passed = true;
+    unsigned long t = 123456;
+    uint32_t noise = 1;
+    for (int i = 0; i < 60; i++) {
+        noise = noise * 1103515245 + 12345; // deterministic pseudo random jitter of +-300us on a 100000us rotation
+        unsigned long jittered = t + (noise >> 16) % 601 - 300;
+        if (i == 30) { // missed beam break
+            t += 100000;
+            continue;
+        }
+        if (i == 40) { // beam break that was measured 30ms late
+            jittered += 30000;
+        }
+        estimator.addBeamBreak(jittered);
+        if (i == 20) {
+            if (estimator.addBeamBreak(jittered + 2000)) { // double trigger
+                Serial.println("Test rotation double trigger failed");
+                passed = false;
+            }
+        }
+        if (i >= 10 && (estimator.interval() < 99000 || estimator.interval() > 101000 || estimator.predictedInterval() < 99000 || estimator.predictedInterval() > 101000)) {
+            Serial.println("Test rotation steady failed");
+            Serial.println("Received revolution:");
+            Serial.println(i);
+            Serial.println("Received interval:");
+            Serial.println(estimator.interval());
+            Serial.println();
+            passed = false;
+        }
+        t += 100000;
+    }
+    if (estimator.confidenceLevel() < 128) {
+        Serial.println("Test rotation confidence failed");
+        Serial.println("Received confidence:");
+        Serial.println(estimator.confidenceLevel());
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 2-2
-    inputState = State::s02_WAIT;
-    test_input.micros = 1000;
-    start_micros = 0;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s02_WAIT) or (mock_led != Mock_Led::WARNING)) {
-        Serial.println("Test 2-2 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received led:");
-        Serial.println((int)mock_led);
+    // speeding up: every rotation is 1000us shorter than the one before
+    uint32_t interval = 150000;
+    for (int i = 0; i < 12; i++) {
+        t += interval;
+        estimator.addBeamBreak(t);
+        interval -= 1000;
+    }
+    if (estimator.intervalAcceleration() > -900 || estimator.intervalAcceleration() < -1100
+        || estimator.predictedInterval() < interval * 99 / 100 || estimator.predictedInterval() > interval * 101 / 100) {
+        Serial.println("Test rotation acceleration failed");
+        Serial.println("Received acceleration:");
+        Serial.println(estimator.intervalAcceleration());
+        Serial.println("Received prediction:");
+        Serial.println(estimator.predictedInterval());
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 2-3
-    inputState = State::s02_WAIT;
-    test_input.micros = 2000001;
-    start_micros = 0;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s03_SPINNING_UP) or (mock_tone != Mock_Tone::UP)) {
-        Serial.println("Test 2-3 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received tone:");
-        Serial.println((int)mock_tone);
+    // a reset asked for by loop() happens at the next beam break, the interval reads as 0 until then
+    estimator.requestReset();
+    bool pending = estimator.resetPending() && estimator.interval() == 0 && estimator.jitter() == 0;
+    t += interval;
+    estimator.addBeamBreak(t);
+    if (!pending || estimator.resetPending() || estimator.interval() != interval || estimator.jitter() != 0) { // a new history of one interval
+        Serial.println("Test rotation reset failed");
+        Serial.println("Received interval:");
+        Serial.println(estimator.interval());
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 3-3
-    inputState = State::s03_SPINNING_UP;
-    test_input.micros = 500;
-    start_micros = 0;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s03_SPINNING_UP) or (mock_led != Mock_Led::WARNING) or (mock_motor != Mock_Motor::RAMP)) {
-        Serial.println("Test 3-3 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received led:");
-        Serial.println((int)mock_led);
-        Serial.println("Received motor:");
-        Serial.println((int)mock_motor);
+    return passed;
+}
+
+/**
+ * @brief  tests that EventQueue takes ISR events by source before deadlines, expires deadlines in order (across the micros() wraparound),
+ * and that LoopStats adds up idle time and latency
+ * @retval true if every event came out in the expected order
+ */
+bool testEventQueue()
+{
+    bool passed = true;
+    EventQueue<2, 3, 4> queue;
+    Event event;
+    unsigned long now = 0xFFFFFF00; // the deadlines are after micros() wraps around
+    queue.arm(0, now + 300);
+    queue.arm(1, now + 200);
+    queue.arm(2, now + 100);
+    queue.disarm(2);
+    queue.push(1, { EventType::ADC_COMPLETE, 0, 512 });
+    queue.push(0, { EventType::BEAM_BREAK, 0, 7 });
+    queue.push(0, { EventType::BUTTON, 1, 0 });
+    const EventType expected_types[] = { EventType::BEAM_BREAK, EventType::BUTTON, EventType::ADC_COMPLETE };
+    for (uint8_t i = 0; i < 3; i++) {
+        passed = passed && queue.next(event, now) && event.type == expected_types[i];
+    }
+    passed = passed && !queue.next(event, now) && !queue.hasEvents(); // nothing left, no deadline expired yet
+    now += 400;
+    passed = passed && queue.next(event, now) && event.type == EventType::DEADLINE && event.id == 1 && event.value == (uint32_t)(now - 200);
+    passed = passed && queue.next(event, now) && event.type == EventType::DEADLINE && event.id == 0;
+    passed = passed && !queue.next(event, now) && !queue.isArmed(0) && !queue.isArmed(2); // deadline 2 was disarmed
+    for (uint8_t i = 0; i < 5; i++) {
+        queue.push(0, { EventType::BEAM_BREAK, 0, i });
+    }
+    passed = passed && queue.dropped() == 2; // a ring of 4 holds 3
+    if (!passed) {
+        Serial.println("Test event queue failed");
+        Serial.println();
+    }
+
+    LoopStats stats;
+    stats.start(1000);
+    stats.addIdle(2500);
+    stats.addLatency(100);
+    stats.addLatency(300);
+    LoopStats::Report report = stats.report(6000);
+    if (report.idle_permille != 500 || report.latency_mean != 200 || report.latency_max != 300 || report.latency_samples != 2
+        || stats.report(7000).latency_samples != 0) {
+        Serial.println("Test loop stats failed");
+        Serial.println("Received idle permille:");
+        Serial.println(report.idle_permille);
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 3-4
-    inputState = State::s03_SPINNING_UP;
-    test_input.rotation_interval = 1;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s04_RUNNING) or (mock_tone != Mock_Tone::OFF)) {
-        Serial.println("Test 3-4 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received tone:");
-        Serial.println((int)mock_tone);
+    return passed;
+}
+
+/**
+ * @brief  frames shown on a simulated rotor, see simulateRendering()
+ */
+struct RenderReport {
+    uint32_t revolutions;
+    uint32_t stale; // revolutions that showed the frame of the revolution before
+    uint32_t skipped; // frames that were published and replaced without being shown
+    uint32_t missed; // frames renderScheduler published after their beam break
+};
+
+/**
+ * @brief  Flips a TripleBuffer on the beam breaks of a rotor with a steady interval (plus jitter), while frames that take render_time to draw
+ * are published either every cadence microseconds like the old loop() did, or when a RenderScheduler schedules them (cadence 0).
+ */
+RenderReport simulateRendering(uint32_t interval, uint32_t jitter, uint32_t render_time, uint32_t cadence, uint8_t revolutions_per_frame, int seconds)
+{
+    TripleBuffer<uint8_t, 1> buffer;
+    RenderScheduler scheduler(revolutions_per_frame, 2000);
+    RenderReport report = { 0, 0, 0, 0 };
+    uint32_t noise = 1;
+    unsigned long next_beam_break = interval;
+    unsigned long render_start = cadence ? cadence : 0;
+    bool rendering = false;
+    bool render_armed = cadence != 0;
+    for (unsigned long now = 0; now < (unsigned long)seconds * 1000000; now += 100) {
+        if (now >= next_beam_break) {
+            if (report.revolutions > 2 && !buffer.flip()) { // the first revolutions don't have a frame yet
+                report.stale++;
+            } else if (report.revolutions <= 2) {
+                buffer.flip();
+            }
+            report.revolutions++;
+            unsigned long start;
+            if (cadence == 0 && scheduler.beamBreak(next_beam_break, interval, now, start)) {
+                render_start = start;
+                render_armed = true;
+            }
+            noise = noise * 1103515245 + 12345;
+            next_beam_break += interval + (jitter ? (noise >> 16) % (2 * jitter + 1) - jitter : 0);
+        }
+        if (render_armed && !rendering && (long)(now - render_start) >= 0) {
+            rendering = true;
+            render_armed = false;
+            scheduler.renderStarted(now);
+        }
+        if (rendering && now - render_start >= render_time) {
+            rendering = false;
+            buffer.publish();
+            scheduler.renderFinished(now);
+            if (cadence != 0) {
+                render_start += cadence;
+                render_armed = true;
+            }
+        }
+    }
+    report.skipped = buffer.framesSkipped();
+    report.missed = scheduler.framesMissed();
+    return report;
+}
+
+/**
+ * @brief  tests the BCD time of day against the divides for every second of a day, parsing, and TimeOfDayText across a jump
+ * @retval true if passed
+ */
+bool testTimeOfDay()
+{
+    bool passed = true;
+    uint32_t bcd = bcdTimeOfDay(0);
+    char text[9];
+    for (uint32_t seconds = 0; seconds < SECONDS_PER_DAY; seconds++) {
+        if (seconds != 0) {
+            bcd = nextBcdSecond(bcd);
+        }
+        formatBcdTime(bcd, text);
+        if (bcd != bcdTimeOfDay(seconds) || parseTimeOfDay(text) != (int32_t)seconds) {
+            Serial.print("Test time of day failed at ");
+            Serial.print(seconds);
+            Serial.print(" seconds, received: ");
+            Serial.println(text);
+            passed = false;
+            break;
+        }
+    }
+    if (nextBcdSecond(0x235959) != 0 || bcdTimeOfDay(SECONDS_PER_DAY + 59) != 0x000059) {
+        Serial.println("Test time of day failed, midnight didn't wrap around");
+        passed = false;
+    }
+    // the old parser passed atoi() two chars without a null terminator
+    const char* invalid[] = { "", "16:31:0", "1a:31:02", "16-31-02", "24:00:00", "12:60:00", "12:00:60" };
+    for (const char* time : invalid) {
+        if (parseTimeOfDay(time) != -1) {
+            Serial.print("Test time of day failed, parsed ");
+            Serial.println(time);
+            passed = false;
+        }
+    }
+    if (parseTimeOfDay("16:31:02.365-05:00") != 16 * 3600 + 31 * 60 + 2) {
+        Serial.println("Test time of day failed, didn't parse 16:31:02.365-05:00");
+        passed = false;
+    }
+
+    TimeOfDayText timeOfDay;
+    const uint32_t steps[] = { 100, 100, 101, 5000, SECONDS_PER_DAY * 3 - 1, SECONDS_PER_DAY * 3 };
+    const char* expected[] = { "00:01:40", "00:01:40", "00:01:41", "01:23:20", "23:59:59", "00:00:00" };
+    for (uint8_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        if (strcmp(timeOfDay.text(steps[i]), expected[i]) != 0) {
+            Serial.print("Test time of day text failed, expected ");
+            Serial.print(expected[i]);
+            Serial.print(" received ");
+            Serial.println(timeOfDay.text(steps[i]));
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+/**
+ * @brief  writes a worldtimeapi.org response with the fields in a random order among others that shouldn't be taken for them
+ *      (the same keys in nested objects and arrays, as values, and escaped quotes), chunked or not
+ * @param  random: state of the pseudo random generator, advanced
+ * @param  local: seconds since midnight written in "datetime"
+ * @param  offset: minutes written as "utc_offset"
+ * @retval length of the response
+ */
+uint16_t makeWorldTimeResponse(char* response, uint16_t size, uint32_t& random, uint32_t local, int32_t offset, bool chunked)
+{
+    char sign = offset < 0 ? '-' : '+';
+    unsigned offset_hours = abs(offset) / 60;
+    unsigned offset_minutes = abs(offset) % 60;
+    char fields[7][96];
+    snprintf(fields[0], sizeof(fields[0]), "\"abbreviation\":\"E\\\"DT\\\\\"");
+    snprintf(fields[1], sizeof(fields[1]), "\"datetime\":\"2023-06-01T%02u:%02u:%02u.123456%c%02u:%02u\"",
+        (unsigned)(local / 3600), (unsigned)(local / 60 % 60), (unsigned)(local % 60), sign, offset_hours, offset_minutes);
+    snprintf(fields[2], sizeof(fields[2]), "\"utc_offset\":\"%c%02u:%02u\"", sign, offset_hours, offset_minutes);
+    snprintf(fields[3], sizeof(fields[3]), "\"nested\":{\"datetime\":\"2000-01-01T11:11:11.000000+01:00\",\"utc_offset\":\"+01:00\"}");
+    snprintf(fields[4], sizeof(fields[4]), "\"list\":[\"datetime\",{\"utc_offset\":\"+02:00\"},[\"utc_offset\"]]");
+    snprintf(fields[5], sizeof(fields[5]), "\"timezone\":\"utc_offset\",\"week_number\":22");
+    snprintf(fields[6], sizeof(fields[6]), "\"datetimes\":\"2000-01-01T12:12:12\",\"utc\":\"+03:00\"");
+    uint8_t order[7] = { 0, 1, 2, 3, 4, 5, 6 };
+    for (uint8_t i = 6; i > 0; i--) {
+        random = random * 1103515245 + 12345;
+        uint8_t j = (random >> 16) % (i + 1);
+        uint8_t swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    char body[640];
+    uint16_t body_length = 0;
+    for (uint8_t i = 0; i < 7; i++) {
+        random = random * 1103515245 + 12345;
+        body_length += snprintf(body + body_length, sizeof(body) - body_length, "%s%s%s", i == 0 ? "{" : ",", (random >> 16) & 1 ? "\n  " : "", fields[order[i]]);
+    }
+    body_length += snprintf(body + body_length, sizeof(body) - body_length, "}");
+
+    const char* encodings[] = { "Transfer-Encoding: chunked", "transfer-encoding: Chunked", "TRANSFER-ENCODING:chunked", "Transfer-Encoding: gzip, chunked" };
+    random = random * 1103515245 + 12345;
+    uint16_t length = snprintf(response, size, "HTTP/1.1 200 OK\r\nContent-Type: application/json; charset=utf-8\r\nX-Transfer-Encoding: chunked\r\n%s%s\r\n",
+        chunked ? encodings[(random >> 16) % 4] : "Connection: close", "\r\n");
+    if (!chunked) {
+        memcpy(response + length, body, body_length);
+        return length + body_length;
+    }
+    for (uint16_t start = 0; start < body_length;) {
+        random = random * 1103515245 + 12345;
+        uint16_t chunk = min((uint16_t)(4 + (random >> 16) % 29), (uint16_t)(body_length - start));
+        length += snprintf(response + length, size - length, (random >> 8) & 1 ? "%X%s\r\n" : "%x%s\r\n", chunk, (random >> 9) & 1 ? ";name=value" : "");
+        memcpy(response + length, body + start, chunk);
+        length += chunk;
+        length += snprintf(response + length, size - length, "\r\n");
+        start += chunk;
+    }
+    return length + snprintf(response + length, size - length, "0\r\n\r\n");
+}
+
+/**
+ * @brief  fuzzes WorldTimeParser with random responses, and with bytes of them changed at random
+ * @note   The parser only sees bytes, so this could run anywhere, it runs on the board with the rest of RUN_UNIT_TESTS
+ * @retval true if it found the right values in every response, and never returned one that isn't a time of day or UTC offset
+ */
+bool testWorldTimeParser()
+{
+    bool passed = true;
+    const int32_t offsets[] = { -5 * 60, -4 * 60, 0, 5 * 60 + 30, 14 * 60, -(9 * 60 + 30) };
+    uint32_t random = 1;
+    char response[1024];
+    WorldTimeParser parser;
+    uint16_t wrong = 0;
+    uint16_t unfinished = 0;
+    uint16_t invalid = 0;
+    uint16_t still_found = 0;
+    for (uint16_t i = 0; i < 500; i++) {
+        random = random * 1103515245 + 12345;
+        uint32_t local = (random >> 8) % SECONDS_PER_DAY;
+        int32_t offset = offsets[i % 6];
+        uint16_t length = makeWorldTimeResponse(response, sizeof(response), random, local, offset, i & 1);
+        parser.reset();
+        for (uint16_t j = 0; j < length; j++) {
+            parser.feed(response[j]);
+        }
+        parser.feed('}'); // after the end
+        int32_t parsed_offset = 0;
+        if (parser.localSeconds() != (int32_t)local || !parser.utcOffset(parsed_offset) || parsed_offset != offset * 60 || parser.statusCode() != 200) {
+            wrong++;
+        }
+        if (!parser.finished()) {
+            unfinished++;
+        }
+
+        // change a few bytes, whatever is found has to be a time of day and a UTC offset
+        for (uint8_t changes = 1 + i % 4; changes > 0; changes--) {
+            random = random * 1103515245 + 12345;
+            response[(random >> 16) % length] = (random >> 8) & 1 ? (char)(random >> 24) : "\"{}[],:\\\r\n0aF"[(random >> 24) % 13];
+        }
+        parser.reset();
+        for (uint16_t j = 0; j < length; j++) {
+            parser.feed(response[j]);
+        }
+        int32_t seconds = parser.localSeconds();
+        if (seconds < -1 || seconds >= (int32_t)SECONDS_PER_DAY || (parser.utcOffset(parsed_offset) && abs(parsed_offset) > 14 * 3600 + 59 * 60)) {
+            invalid++;
+        }
+        if (seconds == (int32_t)local) {
+            still_found++;
+        }
+    }
+    Serial.println("Parser fuzz, responses with bytes changed that still had the time:");
+    Serial.println(still_found);
+    if (wrong != 0 || unfinished != 0 || invalid != 0) {
+        Serial.println("Test worldtime parser fuzz failed, wrong, unfinished and invalid:");
+        Serial.println(wrong);
+        Serial.println(unfinished);
+        Serial.println(invalid);
+        passed = false;
+    }
+
+    // responses without the values
+    const char* missing[] = {
+        "HTTP/1.1 404 Not Found\r\n\r\n{\"datetime\":\"2023-06-01T16:31:02.365-04:00\",\"utc_offset\":\"-04:00\"}",
+        "HTTP/1.1 200 OK\r\n\r\n{\"datetime\":\"2023-06-01T16:31\",\"utc_offset\":\"-04\"}",
+        "HTTP/1.1 200 OK\r\n\r\n{\"datetime\":\"2023-06-01T16:31:02.365-04:0",
+        "HTTP/1.1 200 OK\r\n\r\n[\"datetime\",\"2023-06-01T16:31:02.365-04:00\",\"utc_offset\",\"-04:00\"]",
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\n{\"dat\r\n0\r\n\r\n\"datetime\":\"2023-06-01T16:31:02.365-04:00\"}",
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nFFFFFFFFF\r\n{\"datetime\":\"2023-06-01T16:31:02.365-04:00\",\"utc_offset\":\"-04:00\"}",
+    };
+    for (uint8_t i = 0; i < sizeof(missing) / sizeof(missing[0]); i++) {
+        parser.reset();
+        for (const char* c = missing[i]; *c != '\0'; c++) {
+            parser.feed(*c);
+        }
+        int32_t offset;
+        if (parser.localSeconds() != -1 || parser.utcOffset(offset)) {
+            Serial.println("Test worldtime parser failed, found a value in response:");
+            Serial.println(i);
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+/**
+ * @brief  prints how many CPU cycles WorldTimeParser takes per byte of a response, plain and chunked, and its size
+ */
+void benchmarkWorldTimeParser()
+{
+    char response[1024];
+    uint32_t random = 7;
+    WorldTimeParser parser;
+    volatile int32_t sink = 0; // so the parsing isn't optimized out
+    for (uint8_t chunked = 0; chunked < 2; chunked++) {
+        uint16_t length = makeWorldTimeResponse(response, sizeof(response), random, 59462, -4 * 60, chunked);
+        const int runs = 100;
+        unsigned long start = micros();
+        for (int i = 0; i < runs; i++) {
+            parser.reset();
+            for (uint16_t j = 0; j < length; j++) {
+                parser.feed(response[j]);
+            }
+            sink = parser.localSeconds();
+        }
+        unsigned long parse_micros = micros() - start;
+        Serial.println(chunked ? "WorldTimeParser cycles per byte, chunked:" : "WorldTimeParser cycles per byte:");
+        Serial.println(parse_micros * (F_CPU / 1000000) / ((unsigned long)runs * length));
+    }
+    (void)sink;
+    Serial.println("WorldTimeParser bytes:");
+    Serial.println(sizeof(WorldTimeParser));
+    Serial.println();
+}
+
+/**
+ * @brief  A stand-in for the network and the time servers, for testing TimeSync.
+ * @note   The true UTC runs ppm slower than the RTC's count. SNTP replies arrive round_trip ticks after the request, stamped halfway through,
+ *      and the HTTP API answers with the local time and a UTC offset of -04:00, chunked if chunked is set, and with only bytes_per_read bytes
+ *      arriving between the reads that find nothing (0 for all of them at once). It counts the calls that can block.
+ */
+class StandInNet {
+    uint8_t reply[SNTP_PACKET_SIZE];
+    bool reply_pending = false;
+    uint32_t reply_at = 0;
+    char response[400];
+    uint16_t response_length = 0;
+    uint16_t response_read = 0;
+    uint16_t arrived = 0; // bytes read since the last read that found nothing
+
+public:
+    uint32_t rtc = 0;
+    double ppm = 0;
+    double utc_at_zero = 1685620000; // true UTC when the RTC's count was 0
+    uint32_t round_trip = 40;
+    bool wifi_up = false;
+    bool sntp_answers = true;
+    bool http_answers = true;
+    bool chunked = false;
+    uint16_t bytes_per_read = 0;
+    uint16_t blocking_calls = 0;
+    uint16_t sntp_requests = 0;
+    uint16_t http_requests = 0;
+
+    double trueSeconds(uint32_t at)
+    {
+        return utc_at_zero + at / (RTC_TICKS_PER_SECOND * (1 + ppm / 1000000));
+    }
+    bool connected()
+    {
+        return wifi_up;
+    }
+    bool connect()
+    {
+        blocking_calls++;
+        wifi_up = true;
+        return true;
+    }
+    uint32_t resolve(const char* host)
+    {
+        blocking_calls++;
+        return 0x0A000001;
+    }
+    bool sendUdp(uint32_t ip, uint16_t port, const uint8_t* data, uint8_t length)
+    {
+        sntp_requests++;
+        if (!sntp_answers || ip != 0x0A000001 || port != SNTP_PORT || length != SNTP_PACKET_SIZE || (data[0] & 0x07) != 3) {
+            return true;
+        }
+        double now = trueSeconds(rtc + round_trip / 2);
+        uint32_t seconds = (uint32_t)now + NTP_UNIX_OFFSET;
+        uint32_t fraction = (uint32_t)((now - (uint32_t)now) * 4294967296.0);
+        memset(reply, 0, SNTP_PACKET_SIZE);
+        reply[0] = 0x24; // version 4, mode 4 (server)
+        reply[1] = 2; // stratum
+        memcpy(reply + 24, data + 40, 8); // originate timestamp
+        for (uint8_t i = 0; i < 4; i++) {
+            reply[40 + i] = seconds >> (24 - 8 * i);
+            reply[44 + i] = fraction >> (24 - 8 * i);
+        }
+        reply_pending = true;
+        reply_at = rtc + round_trip;
+        return true;
+    }
+    int receiveUdp(uint8_t* data, uint8_t size)
+    {
+        if (!reply_pending || (int32_t)(rtc - reply_at) < 0) {
+            return 0;
+        }
+        reply_pending = false;
+        memcpy(data, reply, min(size, SNTP_PACKET_SIZE));
+        return SNTP_PACKET_SIZE;
+    }
+    bool openTcp(const char* host, uint16_t port)
+    {
+        blocking_calls++;
+        http_requests++;
+        if (!http_answers) {
+            return false;
+        }
+        uint32_t local = (uint32_t)trueSeconds(rtc) - 4 * 3600;
+        char body[120];
+        int body_length = snprintf(body, sizeof(body), "{\"abbreviation\":\"EDT\",\"datetime\":\"2023-06-01T%02u:%02u:%02u.123456-04:00\",\"utc_offset\":\"-04:00\"}",
+            (unsigned)(local / 3600 % 24), (unsigned)(local / 60 % 60), (unsigned)(local % 60));
+        response_length = snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n%s\r\n",
+            chunked ? "Transfer-Encoding: chunked\r\n" : "");
+        for (int start = 0; start < body_length; start += 16) {
+            int length = min(body_length - start, 16);
+            if (chunked) {
+                response_length += snprintf(response + response_length, sizeof(response) - response_length, "%x\r\n", length);
+            }
+            memcpy(response + response_length, body + start, length);
+            response_length += length;
+            if (chunked) {
+                response_length += snprintf(response + response_length, sizeof(response) - response_length, "\r\n");
+            }
+        }
+        if (chunked) {
+            response_length += snprintf(response + response_length, sizeof(response) - response_length, "0\r\n\r\n");
+        }
+        response_read = 0;
+        arrived = 0;
+        return true;
+    }
+    void writeTcp(const char* text)
+    {
+    }
+    int readTcp()
+    {
+        if (bytes_per_read != 0 && arrived == bytes_per_read) {
+            arrived = 0;
+            return -1;
+        }
+        arrived++;
+        return response_read < response_length ? response[response_read++] : -1;
+    }
+    bool tcpOpen()
+    {
+        return response_read < response_length;
+    }
+    void closeTcp()
+    {
+        response_length = 0;
+    }
+};
+
+/**
+ * @brief  steps sync like loop() would (at least once a minute) until the stand-in's RTC reaches until
+ * @retval the largest error of the clock in ticks at the end of each step, from when it was first set
+ */
+template <typename Sync>
+uint32_t runTimeSync(Sync& sync, StandInNet& net, uint32_t until, bool can_block)
+{
+    uint32_t max_error = 0;
+    while ((int32_t)(net.rtc - until) < 0) {
+        uint32_t wait = min(sync.update(net.rtc, can_block), (uint32_t)60000);
+        net.rtc += max((uint32_t)((uint64_t)wait * RTC_TICKS_PER_SECOND / 1000), (uint32_t)1);
+        if (sync.synced()) {
+            const int32_t day = SECONDS_PER_DAY * RTC_TICKS_PER_SECOND;
+            int32_t error = sync.timeBase().ticksOfDay(net.rtc) - (int32_t)fmod(net.trueSeconds(net.rtc) * RTC_TICKS_PER_SECOND, day);
+            error = error > day / 2 ? error - day : (error < -day / 2 ? error + day : error);
+            max_error = max(max_error, (uint32_t)abs(error));
+        }
+    }
+    return max_error;
+}
+
+/**
+ * @brief  runs TimeSync against StandInNet: SNTP with an RTC that is 50 ppm fast, the HTTP fallback, and not blocking while the motor runs
+ * @note   StandInNet replaces WiFi101 and the RTC's count is simulated, so nothing here needs the WINC1500, but it runs on the board with RUN_UNIT_TESTS
+ * @retval true if passed
+ */
+bool testTimeSync()
+{
+    bool passed = true;
+    const TimeSyncParameters parameters = { "ntp", "api", "/api/timezone/America/New_York", -5 * 3600, 1000, 3, 5000, 3600, 60, SECONDS_PER_DAY };
+    const uint32_t hour = 3600 * RTC_TICKS_PER_SECOND;
+
+    // SNTP, with the UTC offset from the API
+    StandInNet net;
+    net.ppm = 50;
+    TimeSync<StandInNet> sync(net, parameters);
+    runTimeSync(sync, net, RTC_TICKS_PER_SECOND, true);
+    if (!sync.synced() || sync.utcOffset() != -4 * 3600 || net.http_requests != 1 || net.blocking_calls != 3) {
+        Serial.println("Test time sync failed to sync at startup");
+        passed = false;
+    }
+    uint32_t local = sync.localSeconds(net.rtc) % SECONDS_PER_DAY;
+    uint32_t true_local = ((uint32_t)net.trueSeconds(net.rtc) - 4 * 3600) % SECONDS_PER_DAY;
+    if (local != true_local && local != (true_local + 1) % SECONDS_PER_DAY && true_local != (local + 1) % SECONDS_PER_DAY) {
+        Serial.println("Test time sync failed, wrong local time");
+        passed = false;
+    }
+    uint32_t first_hour_error = runTimeSync(sync, net, hour + RTC_TICKS_PER_SECOND, true);
+    runTimeSync(sync, net, 5 * hour, true);
+    uint32_t disciplined_error = runTimeSync(sync, net, 6 * hour, true);
+    Serial.print("time sync, RTC 50 ppm fast: worst error over the first hour ");
+    Serial.print(first_hour_error * 1000 / RTC_TICKS_PER_SECOND);
+    Serial.print(" ms, over the sixth hour ");
+    Serial.print(disciplined_error * 1000 / RTC_TICKS_PER_SECOND);
+    Serial.print(" ms, estimated ppb ");
+    Serial.println(sync.timeBase().frequencyError());
+    if (disciplined_error > 5 || abs(sync.timeBase().frequencyError() - 50000) > 2000 || first_hour_error < 150 || sync.failureCount() != 0) {
+        Serial.println("Test time sync failed to correct the drift");
+        passed = false;
+    }
+
+    // the SNTP server doesn't answer, the API's whole seconds are used
+    StandInNet no_sntp;
+    no_sntp.sntp_answers = false;
+    TimeSync<StandInNet> fallback(no_sntp, parameters);
+    uint32_t fallback_error = runTimeSync(fallback, no_sntp, 10 * RTC_TICKS_PER_SECOND, true);
+    if (!fallback.synced() || no_sntp.sntp_requests != 3 || fallback_error > RTC_TICKS_PER_SECOND || fallback.failureCount() != 0) {
+        Serial.println("Test time sync failed to fall back to HTTP");
+        passed = false;
+    }
+
+    // the same, with the response chunked and arriving a few bytes at a time
+    StandInNet trickle;
+    trickle.sntp_answers = false;
+    trickle.chunked = true;
+    trickle.bytes_per_read = 5;
+    TimeSync<StandInNet> chunked(trickle, parameters);
+    uint32_t chunked_error = runTimeSync(chunked, trickle, 10 * RTC_TICKS_PER_SECOND, true);
+    if (!chunked.synced() || chunked.utcOffset() != -4 * 3600 || chunked_error > RTC_TICKS_PER_SECOND || chunked.failureCount() != 0) {
+        Serial.println("Test time sync failed, chunked response split across reads");
+        passed = false;
+    }
+
+    // nothing answers, tries again after retry_interval
+    StandInNet offline;
+    offline.sntp_answers = false;
+    offline.http_answers = false;
+    TimeSync<StandInNet> failing(offline, parameters);
+    runTimeSync(failing, offline, 90 * RTC_TICKS_PER_SECOND, true);
+    if (failing.synced() || failing.failureCount() != 2 || offline.sntp_requests != 6) {
+        Serial.println("Test time sync failed, wrong retries without a server");
+        passed = false;
+    }
+
+    // while the motor runs, nothing that blocks
+    StandInNet running;
+    TimeSync<StandInNet> waiting(running, parameters);
+    runTimeSync(waiting, running, hour, false);
+    if (waiting.synced() || running.blocking_calls != 0) {
+        Serial.println("Test time sync failed, blocked while it couldn't");
+        passed = false;
+    }
+
+    // replies that aren't for the request
+    uint8_t packet[SNTP_PACKET_SIZE];
+    makeSntpRequest(packet, 1234);
+    packet[0] = 0x24;
+    packet[1] = 2;
+    memcpy(packet + 24, packet + 40, 8);
+    packet[40] = 0xE8;
+    uint32_t seconds;
+    uint32_t fraction;
+    bool accepted = readSntpReply(packet, SNTP_PACKET_SIZE, 1234, seconds, fraction);
+    bool wrong_cookie = readSntpReply(packet, SNTP_PACKET_SIZE, 1235, seconds, fraction);
+    packet[1] = 0; // kiss-o'-death
+    bool kiss = readSntpReply(packet, SNTP_PACKET_SIZE, 1234, seconds, fraction);
+    if (!accepted || wrong_cookie || kiss) {
+        Serial.println("Test time sync failed, SNTP reply checks");
+        passed = false;
+    }
+    return passed;
+}
+
+/**
+ * @brief  tests that a WarmRestartBlock only loads what was saved, and that the time base, PID, setpoint and rotation estimator
+ *      continue from their saved state as if there had been no reset
+ * @retval true if passed
+ */
+bool testWarmRestart()
+{
+    bool passed = true;
+    if (crc32((const uint8_t*)"123456789", 9) != 0xCBF43926) {
+        Serial.println("Test warm restart CRC-32 failed");
+        passed = false;
+    }
+
+    struct Saved {
+        int64_t integral;
+        uint32_t interval;
+        State state;
+    };
+    WarmRestartBlock<Saved> block;
+    memset(&block, 0xA5, sizeof(block)); // RAM after a power on reset
+    Saved loaded = { 0, 0, State::s01_MOTOR_OFF };
+    bool garbage = block.load(loaded);
+    block.save({ -123456789012LL, 97000, State::s04_RUNNING });
+    bool saved = block.load(loaded) && loaded.integral == -123456789012LL && loaded.interval == 97000 && loaded.state == State::s04_RUNNING;
+    uint16_t corruptions_loaded = 0;
+    uint16_t length = (uint8_t*)(&block.crc + 1) - (uint8_t*)&block; // not the padding at the end
+    for (uint16_t i = 0; i < length; i++) { // every bit flip is caught
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            ((uint8_t*)&block)[i] ^= 1 << bit;
+            corruptions_loaded += block.load(loaded);
+            ((uint8_t*)&block)[i] ^= 1 << bit;
+        }
+    }
+    block.saved.interval = 100000; // a reset in the middle of save()
+    bool interrupted = block.load(loaded);
+    block.save(loaded);
+    block.invalidate();
+    bool invalidated = block.load(loaded);
+    if (garbage || !saved || corruptions_loaded != 0 || interrupted || invalidated) {
+        Serial.println("Test warm restart block failed");
+        passed = false;
+    }
+
+    // the time base, with the RTC counting on through the reset
+    const TimeSyncParameters parameters = { "ntp", "api", "/api/timezone/America/New_York", -5 * 3600, 1000, 3, 5000, 3600, 60, SECONDS_PER_DAY };
+    StandInNet net;
+    net.ppm = 50;
+    TimeSync<StandInNet> before(net, parameters);
+    runTimeSync(before, net, 2 * 3600 * RTC_TICKS_PER_SECOND, true);
+    TimeSyncState time_sync = before.save();
+    TimeSync<StandInNet> after(net, parameters);
+    after.restore(time_sync, net.rtc);
+    uint32_t later = net.rtc + 1800 * RTC_TICKS_PER_SECOND;
+    if (!after.synced() || after.localSeconds(later) != before.localSeconds(later) || after.timeBase().ticksOfDay(later) != before.timeBase().ticksOfDay(later)
+        || after.utcOffset() != -4 * 3600 || after.timeBase().frequencyError() != before.timeBase().frequencyError()) {
+        Serial.println("Test warm restart time base failed");
+        passed = false;
+    }
+
+    // the PID continues with the same output
+    const PidGains gains[] = { { 38912, 0, 288, 1600, 0, 0 }, { INT32_MAX, 0, 288, 1600, 320, 0 } }; // the motor_gains in src.ino
+    FixedPid<12, 0, 4095> running(gains, 2);
+    running.initialize_time(0);
+    running.transferOutput(2000, 40960, 40000);
+    for (uint32_t t = 100000; t <= 2000000; t += 100000) {
+        running.calculate(40960, 40500 + (t / 100000 % 3) * 100, t);
+    }
+    FixedPid<12, 0, 4095> resumed(gains, 2);
+    resumed.initialize_time(5000000);
+    resumed.restoreIntegral(running.integralTerm());
+    running.initialize_time(5000000);
+    int32_t running_output = running.calculate(40960, 40600, 5100000);
+    int32_t resumed_output = resumed.calculate(40960, 40600, 5100000);
+    if (running_output != resumed_output) {
+        Serial.println("Test warm restart PID failed, outputs:");
+        Serial.println(running_output);
+        Serial.println(resumed_output);
+        passed = false;
+    }
+
+    const SupervisorParameters limits = { 4096 * 39 / 4, 4096 * 12, 4096 / 4, 4096 / 2, 4, 3685, 0.3, 5000000, 2000000 };
+    SetpointSupervisor supervisor(limits, 40960);
+    supervisor.restoreSetpoint(45056);
+    supervisor.start(0, INT32_MAX, 0, 0);
+    int32_t setpoint = supervisor.update(45056, 10, 1000000UL * 4096 / 45056, 2000, 8.0, 1000);
+    supervisor.restoreSetpoint(1000000); // out of range
+    int32_t limited = supervisor.update(45056, 10, 1000000UL * 4096 / 45056, 2000, 8.0, 2000);
+    if (setpoint != 45056 || limited != limits.max_setpoint) {
+        Serial.println("Test warm restart setpoint failed");
+        passed = false;
+    }
+
+    // the first beam break after the reset already has a prediction
+    RotationEstimator cold;
+    RotationEstimator seeded;
+    seeded.seed(97000);
+    cold.addBeamBreak(3000000);
+    seeded.addBeamBreak(3000000);
+    bool first = cold.predictedInterval() == 0 && seeded.predictedInterval() == 97000 && seeded.interval() == 97000;
+    seeded.addBeamBreak(3000000 + 97400);
+    bool second = seeded.interval() == 97400 && seeded.predictedInterval() > 97000;
+    if (!first || !second) {
+        Serial.println("Test warm restart rotation seed failed");
+        passed = false;
+    }
+    return passed;
+}
+
+/**
+ * @brief  compares the frames shown with the old 100 ms cadence and with RenderScheduler at 10.3 rotations per second, and prints a report
+ * @retval true if the scheduler showed a fresh frame every revolution (or every second one) without skipping or missing any,
+ *      and kept going with renders that are slower than a revolution
+ */
+bool testRenderScheduler()
+{
+    bool passed = true;
+    RenderReport cadence = simulateRendering(97000, 300, 8000, 100000, 1, 20);
+    RenderReport every = simulateRendering(97000, 300, 8000, 0, 1, 20);
+    RenderReport second = simulateRendering(97000, 300, 8000, 0, 2, 20);
+    RenderReport slow = simulateRendering(97000, 300, 150000, 0, 1, 20);
+    Serial.println("Revolutions, stale revolutions and skipped frames with a 100 ms cadence:");
+    Serial.println(cadence.revolutions);
+    Serial.println(cadence.stale);
+    Serial.println(cadence.skipped);
+    Serial.println("Stale revolutions, skipped and missed frames with the render scheduler:");
+    Serial.println(every.stale);
+    Serial.println(every.skipped);
+    Serial.println(every.missed);
+    Serial.println();
+    // only the first scheduled frame can be missed, there hasn't been a render to measure before it (loop() renders while spinning up)
+    if (cadence.stale == 0 || every.stale != 0 || every.skipped != 0 || every.missed > 1
+        || second.stale < second.revolutions / 2 - 2 || second.stale > second.revolutions / 2 + 2 || second.skipped != 0 || second.missed > 1
+        || slow.missed == 0 || slow.stale == 0 || slow.skipped != 0) {
+        Serial.println("Test render scheduler failed");
+        Serial.println("Received stale revolutions every second revolution, and with slow renders:");
+        Serial.println(second.stale);
+        Serial.println(slow.stale);
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 3-5a
-    inputState = State::s03_SPINNING_UP;
-    test_input.stop_button = true;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s05_SPINNING_DOWN) or (mock_tone != Mock_Tone::DOWN) or (mock_motor != Mock_Motor::OFF)) {
-        Serial.println("Test 3-5a failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received tone:");
-        Serial.println((int)mock_tone);
-        Serial.println("Received motor:");
-        Serial.println((int)mock_motor);
+    return passed;
+}
+
+/**
+ * @brief  tests SpscRing through many wraparounds and when it is full, and that Seqlock counts its writes
+ * @note   On the host nothing interrupts a read, the retry when the writer does is the same loop as a read that isn't interrupted.
+ * @retval true if every item came out once and in order, and every snapshot read was the last one written
+ */
+bool testSpscChannels()
+{
+    bool passed = true;
+    SpscRing<uint16_t, 8> ring;
+    uint16_t pushed = 0;
+    uint16_t expected = 0;
+    uint16_t item;
+    for (int round = 0; round < 100; round++) { // pushes a few more than it pops each round until it is full, then drains it
+        for (int i = 0; i < (round % 5) + 1; i++) {
+            if (ring.push(pushed)) {
+                pushed++;
+            }
+        }
+        if (round % 10 == 9) {
+            while (ring.pop(item)) {
+                passed = passed && item == expected++;
+            }
+        } else if (ring.pop(item)) {
+            passed = passed && item == expected++;
+        }
+        passed = passed && ring.available() == pushed - expected && ring.available() <= 7;
+    }
+    if (!passed || ring.dropped() == 0) {
+        Serial.println("Test spsc ring failed");
+        Serial.println("Received pushed, popped and dropped items:");
+        Serial.println(pushed);
+        Serial.println(expected);
+        Serial.println(ring.dropped());
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 3-5b
-    inputState = State::s03_SPINNING_UP;
-    test_input.micros = 6000000;
-    start_micros = 0;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s05_SPINNING_DOWN) or (mock_tone != Mock_Tone::DOWN) or (mock_motor != Mock_Motor::OFF)) {
-        Serial.println("Test 3-5b failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received tone:");
-        Serial.println((int)mock_tone);
-        Serial.println("Received motor:");
-        Serial.println((int)mock_motor);
+
+    Seqlock<RotationSnapshot> snapshot;
+    RotationSnapshot copy;
+    if (snapshot.read(copy) != 0 || copy.interval != 0) {
+        Serial.println("Test seqlock initial failed");
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 4-4
-    inputState = State::s04_RUNNING;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s04_RUNNING) or (mock_motor != Mock_Motor::ON)) {
-        Serial.println("Test 4-4 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received motor:");
-        Serial.println((int)mock_motor);
+    for (uint32_t i = 1; i <= 300; i++) {
+        snapshot.write({ i * 100000, 100000 - i, 100000 + i, i });
+        if (snapshot.read(copy) != i || snapshot.version() != i || copy.last_beam_break != i * 100000 || copy.interval != 100000 - i
+            || copy.predicted_interval != 100000 + i || copy.jitter != i) {
+            Serial.println("Test seqlock failed");
+            Serial.println("Received version:");
+            Serial.println(snapshot.version());
+            Serial.println();
+            passed = false;
+            break;
+        }
+    }
+    return passed;
+}
+
+/**
+ * @brief  runs FixedPid with extreme gains, setpoints, inputs and times, and compares it to PID at normal motor speeds
+ * @retval true if every output was in range, had the sign of the error, and matched PID within 1
+ */
+bool testFixedPid()
+{
+    bool passed = true;
+    const int32_t values[] = { INT32_MIN, -1000000000, -4096, -1, 0, 1, 4096, 1000000000, INT32_MAX };
+    const unsigned long times[] = { 0, 1, 1023, 100000, 4000000000UL, 0xFFFFFFFF };
+    const uint8_t count = sizeof(values) / sizeof(values[0]);
+
+    const PidGains proportional[] = { { 0, 0, 0, INT32_MAX, 0, 0 } };
+    FixedPid<12, 0, 255> proportional_pid(proportional, 1);
+    const PidGains extreme[] = { { 0, INT32_MIN, INT32_MAX, INT32_MAX, INT32_MAX, INT32_MIN }, { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MAX, INT32_MAX, INT32_MAX } };
+    FixedPid<30, -1000, 1000> extreme_pid(extreme, 2);
+    for (uint8_t s = 0; s < count; s++) {
+        for (uint8_t i = 0; i < count; i++) {
+            for (uint8_t t = 0; t < sizeof(times) / sizeof(times[0]); t++) {
+                int64_t error = (int64_t)values[s] - values[i];
+                int32_t output = proportional_pid.calculate(values[s], values[i], times[t]);
+                int32_t expected = error > 0 ? 255 : 0;
+                if ((error != 0 && output != expected) || (error == 0 && output != 0)) {
+                    Serial.println("Test fixed pid sign failed");
+                    Serial.println("Received output:");
+                    Serial.println(output);
+                    Serial.println();
+                    passed = false;
+                }
+                output = extreme_pid.calculate(values[s], values[i], times[t]);
+                if (output < -1000 || output > 1000) {
+                    Serial.println("Test fixed pid range failed");
+                    Serial.println("Received output:");
+                    Serial.println(output);
+                    Serial.println();
+                    passed = false;
+                }
+            }
+        }
+    }
+
+    // the motor's gains at the speeds the motor runs at, compared to the same calculation in floating point
+    // (not to PID, whose I * error * dt overflows 32 bits once the error is more than a quarter rotation per second)
+    const PidGains motor[] = { { INT32_MAX, 0, 18, 100, 20, 0 } };
+    FixedPid<12, 0, 255> fixed_pid(motor, 1);
+    fixed_pid.initialize_time(0);
+    double integral = 0;
+    unsigned long now = 0;
+    for (int32_t input = 30000; input < 50000; input += 250) {
+        now += 100000;
+        int32_t output = fixed_pid.calculate(40960, input, now);
+        int32_t error = 40960 - input;
+        integral = constrain(integral + 20.0 * error * 0.1, -255.0 * 4096 / 2, 255.0 * 4096 / 2);
+        int32_t expected = constrain((int32_t)floor((100.0 * error + integral + 18.0 * 40960) / 4096), 0, 255);
+        if (abs(output - expected) > 1) {
+            Serial.println("Test fixed pid floating point failed");
+            Serial.println("Received input:");
+            Serial.println(input);
+            Serial.println("Received output:");
+            Serial.println(output);
+            Serial.println("Expected output:");
+            Serial.println(expected);
+            Serial.println();
+            passed = false;
+        }
+    }
+
+    // the schedule chooses the gains by input
+    if (&extreme_pid.gains() != &extreme[1] || (extreme_pid.calculate(0, -1, 0), &extreme_pid.gains() != &extreme[0])) {
+        Serial.println("Test fixed pid schedule failed");
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 4-5
-    inputState = State::s04_RUNNING;
-    test_input.stop_button = true;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s05_SPINNING_DOWN) or (mock_tone != Mock_Tone::DOWN) or (mock_motor != Mock_Motor::OFF) or (mock_led != Mock_Led::NONE)) {
-        Serial.println("Test 4-5 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received tone:");
-        Serial.println((int)mock_tone);
-        Serial.println("Received led:");
-        Serial.println((int)mock_led);
-        Serial.println("Received motor:");
-        Serial.println((int)mock_motor);
+    return passed;
+}
+
+/**
+ * @brief  prints how many CPU cycles PID::calculate() and FixedPid::calculate() take per call, with the motor's gains
+ */
+void benchmarkPid()
+{
+    const int calls = 1000;
+    volatile int32_t sink = 0; // so the calls aren't optimized out
+    PID pid(0, 18, 100, 20, 0, 0, 255, 12);
+    const PidGains motor[] = { { 38912, 0, 18, 100, 0, 0 }, { INT32_MAX, 0, 18, 100, 20, 0 } };
+    FixedPid<12, 0, 255> fixed_pid(motor, 2);
+
+    unsigned long start = micros();
+    for (int i = 0; i < calls; i++) {
+        sink = pid.calculate(40960, 40000 + (i & 1023), (i + 1) * 100003UL);
+    }
+    unsigned long pid_micros = micros() - start;
+    start = micros();
+    for (int i = 0; i < calls; i++) {
+        sink = fixed_pid.calculate(40960, 40000 + (i & 1023), (i + 1) * 100003UL);
+    }
+    unsigned long fixed_pid_micros = micros() - start;
+    (void)sink;
+
+    Serial.println("PID cycles per call:");
+    Serial.println(pid_micros * (F_CPU / 1000000) / calls);
+    Serial.println("FixedPid cycles per call:");
+    Serial.println(fixed_pid_micros * (F_CPU / 1000000) / calls);
+    Serial.println();
+}
+
+/**
+ * @brief  tests that the spin up trajectory stops at the setpoint, the current limit holds before the rotor moves, and a weak battery gets a higher duty cycle
+ * @retval true if passed
+ */
+bool testSpinUpController()
+{
+    bool passed = true;
+    const SpinUpParameters parameters = { 4096 * 6, 4096 / 2, 18, 27, 120, 100, 8.4 };
+    SpinUpController<12, 255> spin_up(parameters);
+
+    spin_up.start(0, 0);
+    int32_t duty = spin_up.calculate(40960, 0, 8.4, 100000); // trajectory at 0.6 rotations per second, no measurement yet
+    int32_t expected = (18 * 4096 * 6 / 10 >> 12) + 120; // limited to the stall duty above the trajectory's back EMF
+    if (duty != expected || spin_up.reference() != 4096 * 6 / 10) {
+        Serial.println("Test spin up current limit failed");
+        Serial.println("Received duty:");
+        Serial.println(duty);
+        Serial.println("Expected duty:");
+        Serial.println(expected);
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 5-1
-    inputState = State::s05_SPINNING_DOWN;
-    test_input.micros = 1600000;
-    test_input.last_beam_break = 500;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s01_MOTOR_OFF) or (mock_tone != Mock_Tone::OFF) or (mock_led != Mock_Led::NONE)) {
-        Serial.println("Test 5-1 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received tone:");
-        Serial.println((int)mock_tone);
-        Serial.println("Received led:");
-        Serial.println((int)mock_led);
+
+    spin_up.start(0, 0);
+    int32_t weak = spin_up.calculate(40960, 0, 7.0, 100000);
+    if (weak <= duty) {
+        Serial.println("Test spin up battery compensation failed");
+        Serial.println("Received duty:");
+        Serial.println(weak);
         Serial.println();
         passed = false;
     }
-    resetInput();
-    // Test 5-5
-    inputState = State::s05_SPINNING_DOWN;
-    test_input.micros = 1000;
-    test_input.last_beam_break = 0;
-    retval = updateFSM(inputState, test_input);
-    if ((retval != State::s05_SPINNING_DOWN) or (mock_led != Mock_Led::WARNING)) {
-        Serial.println("Test 5-5 failed");
-        Serial.println("Received state:");
-        Serial.println(retval);
-        Serial.println("Received led:");
-        Serial.println((int)mock_led);
+
+    spin_up.start(0, 0);
+    for (unsigned long now = 100000; now <= 3000000; now += 100000) {
+        duty = spin_up.calculate(40960, spin_up.reference(), 8.4, now); // a rotor that follows the trajectory exactly
+    }
+    expected = 18 * 40960 >> 12; // only the feedforward of the setpoint is left
+    if (spin_up.reference() != 40960 || duty != expected) {
+        Serial.println("Test spin up trajectory failed");
+        Serial.println("Received reference:");
+        Serial.println(spin_up.reference());
+        Serial.println("Received duty:");
+        Serial.println(duty);
+        Serial.println();
+        passed = false;
+    }
+    return passed;
+}
+
+/**
+ * @brief  a simple model of the motor and rotor for testing the speed control without hardware: first order speed response to the duty cycle,
+ * a load that can be added, a battery whose voltage sags with the duty cycle, and beam breaks once per revolution that are only seen by the controller at the next loop
+ */
+struct SimulatedRotor {
+    double rps = 0;
+    double angle = 0; // in revolutions
+    double load = 0; // rotations per second per second of deceleration, ex: air resistance from a gust or friction
+    double rps_per_duty = 10.0 / 2880; // steady state speed per duty cycle unit, with the battery at 8.4 volts
+    double time_constant = 1.5; // seconds
+    double battery_volts = 8.4; // with the motor off, lower for a weak pack
+    double battery_sag = 0; // volts lost at full duty, the motor's torque drops with the voltage
+    unsigned long jitter = 0; // beam break timestamps are off by up to this many microseconds
+    unsigned long micros = 0;
+    unsigned long last_beam_break = 0; // measured, with jitter
+    unsigned long rotation_interval = 0;
+    unsigned long beam_breaks = 0;
+    uint32_t noise = 1;
+
+    /**
+     * @brief  battery voltage while the motor runs at duty
+     */
+    double batteryVoltage(int32_t duty)
+    {
+        return battery_volts - battery_sag * duty / MOTOR_DUTY_MAX;
+    }
+
+    /**
+     * @brief  runs the model for dt microseconds in 1 ms steps with the motor at duty (0 to MOTOR_DUTY_MAX)
+     */
+    void run(int32_t duty, unsigned long dt)
+    {
+        for (unsigned long t = 0; t < dt; t += 1000) {
+            rps += ((rps_per_duty * duty * batteryVoltage(duty) / 8.4 - rps) / time_constant - load) * 0.001;
+            rps = max(rps, 0.0);
+            angle += rps * 0.001;
+            micros += 1000;
+            if (angle >= 1) { // the beam break happened part way through this step
+                angle -= 1;
+                unsigned long beam_break = micros - (unsigned long)(angle / rps * 1000000);
+                if (jitter != 0) {
+                    noise = noise * 1103515245 + 12345;
+                    beam_break -= (noise >> 16) % (2 * jitter + 1); // +-jitter around a constant delay, so the timestamp is never in the future
+                }
+                rotation_interval = beam_break - last_beam_break;
+                last_beam_break = beam_break;
+                beam_breaks++;
+            }
+        }
+    }
+    /**
+     * @brief  measured speed in the units of speed_setpoint, 0 before the second beam break
+     */
+    int32_t speed()
+    {
+        return rotation_interval == 0 ? 0 : (int64_t)1000000 * 4096 / rotation_interval;
+    }
+};
+
+/**
+ * @brief  runs a FixedPid on a SimulatedRotor at a 100 ms loop, starting at 10 rotations per second,
+ * with a load added after 2 seconds and removed after 7
+ * @retval integral of the absolute speed error over the 12 seconds, in rotations
+ */
+double simulateLoadStep(const PidGains* schedule, uint8_t length)
+{
+    SimulatedRotor rotor;
+    FixedPid<12, 0, MOTOR_DUTY_MAX> pid(schedule, length);
+    rotor.rps = 10;
+    rotor.run(2880, 300000); // a few beam breaks at the starting speed
+    pid.initialize_time(rotor.micros);
+    double error = 0;
+    for (int step = 0; step < 120; step++) {
+        rotor.load = (step >= 20 && step < 70) ? 1.0 : 0.0;
+        rotor.run(pid.calculate(40960, rotor.speed(), rotor.micros), 100000);
+        error += abs(rotor.rps - 10) * 0.1;
+    }
+    return error;
+}
+
+/**
+ * @brief  runs a RelayTuner on a SimulatedRotor, then compares the tuned gains to the default ones on a load step
+ * @retval true if the experiment succeeded and the tuned gains had less speed error than the default ones
+ */
+bool testRelayTuner()
+{
+    bool passed = true;
+    const PidGains defaults[] = { { 38912, 0, 288, 1600, 0, 0 }, { INT32_MAX, 0, 288, 1600, 320, 0 } }; // the motor_gains in src.ino
+
+    SimulatedRotor rotor;
+    RelayTuner tuner;
+    rotor.rps = 10;
+    rotor.run(2880, 300000);
+    tuner.start(40960, 2880, 480, 128, 30000000, rotor.micros);
+    while (tuner.isRunning()) {
+        rotor.run(tuner.update(rotor.speed(), rotor.micros), 100000);
+    }
+    PidGains tuned[] = { tuner.gains(defaults[0], 12), tuner.gains(defaults[1], 12) };
+    double default_error = simulateLoadStep(defaults, 2);
+    double tuned_error = simulateLoadStep(tuned, 2);
+    Serial.println("Relay tuner ultimate gain and period:");
+    Serial.println(tuner.ultimateGain(12));
+    Serial.println(tuner.ultimatePeriod());
+    Serial.println("Tuned p and i:");
+    Serial.println(tuned[1].p);
+    Serial.println(tuned[1].i);
+    Serial.println("Load step speed error with default and tuned gains:");
+    Serial.println(default_error);
+    Serial.println(tuned_error);
+    Serial.println();
+    if (!tuner.succeeded() || tuned[0].i != 0 || tuned_error >= default_error) {
+        Serial.println("Test relay tuner failed");
+        Serial.println();
+        passed = false;
+    }
+    return passed;
+}
+
+/**
+ * @brief  results of simulateClosedLoop()
+ */
+struct ClosedLoopReport {
+    double time_to_running; // seconds from pressing start to s04_RUNNING, negative if it never got there
+    double overshoot; // highest speed in s04_RUNNING above the setpoint, in rotations per second
+    double deviation; // standard deviation of the speed over the last 10 seconds, in rotations per second
+    int spurious_spin_downs; // transitions to s05_SPINNING_DOWN, the stop button is never pressed
+    double final_setpoint; // speed_setpoint at the end, in rotations per second
+    double sample_age; // average time from the beam break that measured the interval to the updateFSM() that used it while running, in milliseconds
+    double max_sample_age;
+};
+
+/**
+ * @brief  presses start and runs the real updateFSM(), motorPid and rotationEstimator on a SimulatedRotor for a number of seconds,
+ * scheduled like loop() does: on every beam break (added to rotationEstimator like beamBreakIsr() does), and fsm_poll_interval after
+ * the last run when there isn't one
+ */
+ClosedLoopReport simulateClosedLoop(SimulatedRotor rotor, int seconds)
+{
+    ClosedLoopReport report = { -1, 0, 0, 0, 0, 0, 0 };
+    speed_setpoint = setpointSupervisor.chosenSetpoint();
+    State sim_state = State::s01_MOTOR_OFF;
+    FsmInput input;
+    input.start_button = true;
+    input.stop_button = false;
+    mock_motor_duty = 0;
+    unsigned long beam_breaks = rotor.beam_breaks;
+    double sum = 0;
+    double sum_squares = 0;
+    int samples = 0;
+    double age_sum = 0;
+    int ages = 0;
+    unsigned long last_run = rotor.micros;
+    for (unsigned long ms = 0; ms < (unsigned long)seconds * 1000; ms++) {
+        rotor.run(mock_motor_duty, 1000);
+        if (ms % 100 == 99 && ms >= (unsigned long)(seconds - 10) * 1000) { // the speed every 100 ms over the last 10 seconds
+            sum += rotor.rps;
+            sum_squares += rotor.rps * rotor.rps;
+            samples++;
+        }
+        if (rotor.beam_breaks != beam_breaks) {
+            beam_breaks = rotor.beam_breaks;
+            rotationEstimator.addBeamBreak(rotor.last_beam_break);
+        } else if (rotor.micros - last_run < fsm_poll_interval) {
+            continue;
+        }
+        last_run = rotor.micros;
+        input.micros = rotor.micros;
+        input.last_beam_break = rotationEstimator.lastBeamBreak();
+        input.rotation_interval = rotationEstimator.interval();
+        input.rotation_jitter = rotationEstimator.jitter();
+        input.bat_volt = rotor.batteryVoltage(mock_motor_duty);
+        State next = updateFSM(sim_state, input);
+        input.start_button = false;
+        if (sim_state == State::s04_RUNNING) {
+            double age = (rotor.micros - rotor.last_beam_break) / 1000.0;
+            age_sum += age;
+            ages++;
+            report.max_sample_age = max(report.max_sample_age, age);
+        }
+        if (next == State::s04_RUNNING && sim_state != State::s04_RUNNING && report.time_to_running < 0) {
+            report.time_to_running = ms / 1000.0;
+        }
+        if (next == State::s05_SPINNING_DOWN && sim_state != State::s05_SPINNING_DOWN) {
+            report.spurious_spin_downs++;
+        }
+        if (next == State::s04_RUNNING) {
+            report.overshoot = max(report.overshoot, rotor.rps - speed_setpoint / 4096.0);
+        }
+        sim_state = next;
+    }
+    if (samples > 0) {
+        report.deviation = sqrt(max(sum_squares / samples - (sum / samples) * (sum / samples), 0.0));
+    }
+    if (ages > 0) {
+        report.sample_age = age_sum / ages;
+    }
+    report.final_setpoint = speed_setpoint / 4096.0;
+    return report;
+}
+
+/**
+ * @brief  benchmarks the speed control on a simulated rotor with a sagging battery and beam break jitter, on a full and a weak pack, and prints a report
+ * @retval true if the clock got to s04_RUNNING and stayed there, without overshooting by more than 1 rotation per second or
+ * varying by more than 0.05 rotations per second once settled (a regression gate for changes to the control code)
+ */
+bool testClosedLoop()
+{
+    bool passed = true;
+    setpointSupervisor.setRange(40960, 40960); // the speed loop is benchmarked at 10 rotations per second
+    const double packs[] = { 8.4, 7.6 }; // a full battery, and a weak one that needs a higher duty cycle to spin up as fast
+    for (uint8_t b = 0; b < sizeof(packs) / sizeof(packs[0]); b++) {
+        SimulatedRotor rotor;
+        rotor.battery_volts = packs[b];
+        rotor.battery_sag = 0.8;
+        rotor.jitter = 200;
+        ClosedLoopReport report = simulateClosedLoop(rotor, 30);
+        Serial.println("Closed loop benchmark, battery volts:");
+        Serial.println(packs[b]);
+        Serial.println("Seconds to running:");
+        Serial.println(report.time_to_running);
+        Serial.println("Overshoot (rotations per second):");
+        Serial.println(report.overshoot);
+        Serial.println("Speed standard deviation (rotations per second):");
+        Serial.println(report.deviation);
+        Serial.println("Spurious spin downs:");
+        Serial.println(report.spurious_spin_downs);
+        Serial.println("Age of the speed the PID used, average and highest (milliseconds):");
+        Serial.println(report.sample_age);
+        Serial.println(report.max_sample_age);
+        Serial.println();
+        if (report.time_to_running < 0 || report.spurious_spin_downs != 0 || report.overshoot > 1 || report.deviation > 0.05) {
+            Serial.println("Test closed loop failed");
+            Serial.println();
+            passed = false;
+        }
+    }
+    setpointSupervisor.setRange(INT32_MIN, INT32_MAX);
+    return passed;
+}
+
+/**
+ * @brief  tests SetpointSupervisor's decisions on made up statistics, then lets it choose the setpoint of a steady and an unsteady simulated rotor
+ * @retval true if passed
+ */
+bool testSetpointSupervisor()
+{
+    bool passed = true;
+    const SupervisorParameters parameters = { 4096 * 39 / 4, 4096 * 12, 4096 / 4, 4096 / 2, 4, 3685, 0.3, 5000000, 2000000 };
+    const int32_t slow = 4096 * 9;
+    const int32_t fast = 4096 * 13;
+    struct Case {
+        const char* name;
+        uint32_t jitter; // microseconds at a 100000 microsecond interval
+        int32_t effort;
+        float battery;
+        int32_t speed_offset; // from the setpoint
+        SupervisorDecision expected;
+        int32_t expected_setpoint;
+    };
+    const Case cases[] = {
+        { "steady", 100, 2880, 8.0, 0, SupervisorDecision::RAISE, 40960 + 1024 },
+        { "jitter", 500, 2880, 8.0, 0, SupervisorDecision::BACK_OFF, 40960 - 1024 },
+        { "jitter margin", 300, 2880, 8.0, 0, SupervisorDecision::HOLD, 40960 },
+        { "effort", 100, 3700, 8.0, 0, SupervisorDecision::BACK_OFF, 40960 - 1024 },
+        { "battery", 100, 2880, 6.7, 0, SupervisorDecision::BACK_OFF, 40960 - 1024 },
+        { "guard", 100, 2880, 8.0, -4096 * 3 / 2 + 1, SupervisorDecision::BACK_OFF, 40960 - 1024 },
+    };
+    for (uint8_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        SetpointSupervisor supervisor(parameters, 40960);
+        supervisor.start(slow, fast, 6.5, 0);
+        int32_t setpoint = 40960;
+        for (unsigned long now = 0; now <= 7000000; now += 100000) {
+            setpoint = supervisor.update(40960 + cases[c].speed_offset, cases[c].jitter, 100000, cases[c].effort, cases[c].battery, now);
+        }
+        if (supervisor.lastStats().decision != cases[c].expected || setpoint != cases[c].expected_setpoint || supervisor.chosenSetpoint() != setpoint) {
+            Serial.println("Test setpoint supervisor failed");
+            Serial.println(cases[c].name);
+            Serial.println("Received setpoint:");
+            Serial.println(setpoint);
+            Serial.println();
+            passed = false;
+        }
+    }
+
+    // a setpoint that was backed off from isn't tried again, and the setpoint stays in range
+    SetpointSupervisor supervisor(parameters, 4096 * 12);
+    supervisor.start(slow, fast, 6.5, 0);
+    unsigned long now = 0;
+    for (; now <= 7000000; now += 100000) {
+        supervisor.update(4096 * 12, 500, 100000, 2880, 8.0, now);
+    }
+    for (; now <= 60000000; now += 100000) {
+        supervisor.update(supervisor.chosenSetpoint(), 100, 100000, 2880, 8.0, now);
+    }
+    if (supervisor.chosenSetpoint() != 4096 * 12 - 1024 || supervisor.lastStats().back_offs != 1 || supervisor.lastStats().raises != 0) {
+        Serial.println("Test setpoint supervisor ceiling failed");
+        Serial.println("Received setpoint:");
+        Serial.println(supervisor.chosenSetpoint());
         Serial.println();
         passed = false;
     }
+
+    // on the simulated rotor, a steady one speeds up and an unsteady one slows down, without ever stopping the clock
+    const unsigned long jitters[] = { 200, 2000 };
+    for (uint8_t j = 0; j < 2; j++) {
+        SimulatedRotor rotor;
+        rotor.battery_sag = 0.8;
+        rotor.jitter = jitters[j];
+        ClosedLoopReport report = simulateClosedLoop(rotor, 90);
+        Serial.println("Supervised setpoint with beam break jitter:");
+        Serial.println(jitters[j]);
+        Serial.println(report.final_setpoint);
+        Serial.println("Jitter (thousandths of a revolution) and peak duty cycle of the last window:");
+        Serial.println(setpointSupervisor.lastStats().jitter);
+        Serial.println(setpointSupervisor.lastStats().peak_effort);
+        Serial.println();
+        bool expected_speed = (j == 0) ? report.final_setpoint > 10 : report.final_setpoint < 10;
+        if (report.time_to_running < 0 || report.spurious_spin_downs != 0 || !expected_speed) {
+            Serial.println("Test supervised closed loop failed");
+            Serial.println();
+            passed = false;
+        }
+        speed_setpoint = 40960;
+        setpointSupervisor.setRange(40960, 40960); // back to the starting setpoint for the next test
+        setpointSupervisor.setRange(INT32_MIN, INT32_MAX);
+    }
+    return passed;
+}
+
+/**
+ * @brief  an input that takes one row of the FSM's table, and what that row's action should have done
+ */
+struct FsmWitness {
+    const char* row; // name of the row
+    void (*setup)(); // called after resetInput(), sets test_input and anything else the row's guard and the ones before it read
+    bool (*check)(); // true if the mocks show that the row's action ran
+};
+const FsmWitness fsm_witnesses[] = {
+    { "1-2", []() { test_input.start_button = true; },
+        []() { return mock_tone == Mock_Tone::WAIT && mock_builtin == Mock_Builtin::OFF; } },
+    { "1-1", []() {},
+        []() { return mock_builtin == Mock_Builtin::BLINK; } },
+    { "2-1", []() { test_input.stop_button = true; },
+        []() { return mock_tone == Mock_Tone::OFF; } },
+    { "2-3", []() { test_input.micros = 2000001; start_micros = 0; },
+        []() { return mock_tone == Mock_Tone::UP; } },
+    { "2-2", []() { test_input.micros = 1000; start_micros = 0; },
+        []() { return mock_led == Mock_Led::WARNING; } },
+    { "3-5a", []() { test_input.stop_button = true; },
+        []() { return mock_tone == Mock_Tone::DOWN && mock_motor == Mock_Motor::OFF; } },
+    { "3-4", []() { test_input.rotation_interval = 1; },
+        []() { return mock_tone == Mock_Tone::OFF && displaying; } },
+    { "3-5b", []() { test_input.micros = 6000000; start_micros = 0; },
+        []() { return mock_tone == Mock_Tone::DOWN && mock_motor == Mock_Motor::OFF; } },
+    { "3-3", []() { test_input.micros = 500; start_micros = 0; },
+        []() { return mock_led == Mock_Led::WARNING && mock_motor == Mock_Motor::RAMP; } },
+    { "4-5", []() { test_input.stop_button = true; displaying = true; },
+        []() { return mock_tone == Mock_Tone::DOWN && mock_motor == Mock_Motor::OFF && mock_led == Mock_Led::NONE && !displaying; } },
+    { "4-6", []() { test_input.start_button = true; test_input.rotation_interval = 100000; test_input.bat_volt = 8; },
+        []() { return motorTuner.isRunning(); } },
+    { "4-4", []() { test_input.rotation_interval = 100000; test_input.bat_volt = 8; }, // 10 rotations per second, with a charged battery
+        []() { return mock_motor == Mock_Motor::ON; } },
+    { "5-1", []() { test_input.micros = 1600000; test_input.last_beam_break = 500; },
+        []() { return mock_tone == Mock_Tone::OFF && mock_led == Mock_Led::NONE; } },
+    { "5-5", []() { test_input.micros = 1000; test_input.last_beam_break = 0; },
+        []() { return mock_led == Mock_Led::WARNING; } },
+    { "6-5", []() { test_input.stop_button = true; },
+        []() { return mock_tone == Mock_Tone::DOWN && mock_motor == Mock_Motor::OFF; } },
+    { "6-4", []() {
+            test_input.rotation_interval = 100000;
+            test_input.bat_volt = 8;
+            motorTuner.start(speed_setpoint, 0, 480, 128, 30000000, test_input.micros);
+            test_input.micros += 40000000; // the experiment times out
+            test_input.last_beam_break = test_input.micros;
+            motorTuner.update(speed_setpoint, test_input.micros); },
+        []() { return !motorTuner.isRunning(); } },
+    { "6-6", []() {
+            test_input.rotation_interval = 100000;
+            test_input.bat_volt = 8;
+            motorTuner.start(speed_setpoint, 0, 480, 128, 30000000, test_input.micros); },
+        []() { return mock_motor == Mock_Motor::RELAY; } },
+};
+const uint8_t fsm_witness_count = sizeof(fsm_witnesses) / sizeof(fsm_witnesses[0]);
+
+/**
+ * @brief  walks every row of the FSM's table: takes it with its witness, and checks the next state, the action, and the trace
+ * @note   The actions are the MOCK_FUNCTIONS ones, so this needs no hardware, but like the rest of this file it runs on the board with RUN_UNIT_TESTS
+ * @retval true if passed
+ */
+bool testFsmTable()
+{
+    bool passed = true;
+    bool tested[fsm_witness_count] = {};
+    for (uint8_t i = 0; i < clockFsm.rowCount(); i++) {
+        const FsmRow<State, FsmInput>& row = clockFsm.row(i);
+        int8_t w = -1;
+        for (uint8_t j = 0; j < fsm_witness_count; j++) {
+            if (strcmp(fsm_witnesses[j].row, row.name) == 0) {
+                w = j;
+            }
+        }
+        if (w == -1) {
+            Serial.print("Test ");
+            Serial.print(row.name);
+            Serial.println(" failed, the row has no witness");
+            passed = false;
+            continue;
+        }
+        tested[w] = true;
+        resetInput();
+        fsm_witnesses[w].setup();
+        uint32_t transitions = clockFsm.transitionCount();
+        State retval = updateFSM(row.from, test_input);
+        FsmTraceEntry entry;
+        bool traced = row.to == row.from ? clockFsm.transitionCount() == transitions // self loops aren't traced
+                                         : clockFsm.transitionCount() == transitions + 1 && clockFsm.traced(0, entry) && entry.row == i
+                && entry.micros == test_input.micros && entry.from == row.from && entry.to == row.to;
+        if (retval != row.to || clockFsm.lastRow() != i || !traced || !fsm_witnesses[w].check()) {
+            Serial.print("Test ");
+            Serial.print(row.name);
+            Serial.println(" failed");
+            Serial.println("Received state:");
+            Serial.println(retval);
+            Serial.println("Received row:");
+            Serial.println(clockFsm.lastRow());
+            Serial.println("Traced:");
+            Serial.println(traced);
+            Serial.println("Received tone, led, builtin, motor:");
+            Serial.println((int)mock_tone);
+            Serial.println((int)mock_led);
+            Serial.println((int)mock_builtin);
+            Serial.println((int)mock_motor);
+            Serial.println();
+            passed = false;
+        }
+    }
+    for (uint8_t j = 0; j < fsm_witness_count; j++) {
+        if (!tested[j]) {
+            Serial.print("Test ");
+            Serial.print(fsm_witnesses[j].row);
+            Serial.println(" failed, the row isn't in the table");
+            passed = false;
+        }
+    }
+    // a state that isn't in the table stops the motor
+    const State invalid_states[] = { (State)0, (State)(State::s06_AUTO_TUNING + 1), (State)0xFF };
+    for (State invalid : invalid_states) {
+        resetInput();
+        mock_motor_duty = 1;
+        displaying = true;
+        State retval = updateFSM(invalid, test_input);
+        if (retval != State::s05_SPINNING_DOWN || clockFsm.lastRow() != FSM_INVALID_ROW || mock_motor_duty != 0 || displaying) {
+            Serial.println("Test invalid state failed");
+            Serial.println("Received state:");
+            Serial.println(retval);
+            passed = false;
+        }
+    }
     resetInput();
+    return passed;
+}
+
+/**
+ * @brief  Runs unit tests of the FSM and prints results to the Serial monitor
+ * @note  This function never exits, it ends with while(true)
+ */
+void runAllTests()
+{
+    bool passed = true;
+    resetInput();
+    // Test every row of the FSM's table
+    if (!testFsmTable()) {
+        passed = false;
+    }
+    // Test printString
+    if (!testPrintString()) {
+        passed = false;
+    }
+    // Test palette framebuffer
+    if (!testPaletteFramebuffer()) {
+        passed = false;
+    }
+    benchmarkFramebufferFormats();
+    // Test APA102 encoding
+    if (!testApa102Encoding()) {
+        passed = false;
+    }
+    // Test IR direction
+    if (!testIrDirection()) {
+        passed = false;
+    }
+    // Test NEC decoder
+    if (!testNecDecoder()) {
+        passed = false;
+    }
+    // Test rotation estimator
+    if (!testRotationEstimator()) {
+        passed = false;
+    }
+    // Test ISR to loop() channels
+    if (!testSpscChannels()) {
+        passed = false;
+    }
+    // Test event queue
+    if (!testEventQueue()) {
+        passed = false;
+    }
+    // Test render scheduler
+    if (!testRenderScheduler()) {
+        passed = false;
+    }
+    // Test time of day
+    if (!testTimeOfDay()) {
+        passed = false;
+    }
+    // Test worldtimeapi.org response parser
+    if (!testWorldTimeParser()) {
+        passed = false;
+    }
+    benchmarkWorldTimeParser();
+    // Test time sync
+    if (!testTimeSync()) {
+        passed = false;
+    }
+    // Test warm restart
+    if (!testWarmRestart()) {
+        passed = false;
+    }
+    // Test fixed point PID
+    if (!testFixedPid()) {
+        passed = false;
+    }
+    benchmarkPid();
+    // Test spin up controller
+    if (!testSpinUpController()) {
+        passed = false;
+    }
+    // Test relay auto-tuner
+    if (!testRelayTuner()) {
+        passed = false;
+    }
+    // Closed loop benchmark on a simulated rotor
+    if (!testClosedLoop()) {
+        passed = false;
+    }
+    // Adaptive setpoint on a simulated rotor
+    if (!testSetpointSupervisor()) {
+        passed = false;
+    }
 
     if (passed) {
         Serial.println("All tests passed!");
@@ -0,0 +1,74 @@
+/**
+ * warm_restart.h contains a block of RAM that survives a watchdog reset, for carrying the clock's state across one.
+ * The startup code only copies .data and clears .bss, so a variable in the .noinit section keeps whatever it held before the reset.
+ * After a power on reset that is garbage, which the block's magic number and CRC tell apart from a saved state.
+ */
+#ifndef WARM_RESTART_H
+#define WARM_RESTART_H
+#include <Arduino.h>
+
+const uint32_t WARM_RESTART_MAGIC = 0x57524D31; // "WRM1", change it when the saved state's layout changes
+
+/**
+ * @brief  CRC-32 (the polynomial of Ethernet and zip), bit by bit since the blocks it checks are a few dozen bytes
+ */
+uint32_t crc32(const uint8_t* bytes, uint16_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint16_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+/**
+ * @brief  A saved copy of a T with a magic number and a CRC, meant to be put in .noinit RAM:
+ *      WarmRestartBlock<T> block __attribute__((section(".noinit")));
+ * @note   It has no constructor on purpose, a constructor would run at startup and overwrite what was saved before the reset.
+ *      T has to be plain data for the same reason (no constructors, no pointers into RAM that moves between builds).
+ */
+template <typename T>
+struct WarmRestartBlock {
+    uint32_t magic;
+    T saved;
+    uint32_t crc;
+
+    uint32_t checksum()
+    {
+        return crc32((const uint8_t*)this, (const uint8_t*)&crc - (const uint8_t*)this);
+    }
+    /**
+     * @brief  saves state, replacing what was saved before
+     */
+    void save(const T& state)
+    {
+        magic = WARM_RESTART_MAGIC;
+        saved = state;
+        crc = checksum();
+    }
+    /**
+     * @brief  reads the saved state
+     * @param  state: set to the saved state, unchanged if there isn't one
+     * @retval false if nothing valid was saved (ex: after a power on reset, or a save that was interrupted by the reset)
+     */
+    bool load(T& state)
+    {
+        if (magic != WARM_RESTART_MAGIC || crc != checksum()) {
+            return false;
+        }
+        state = saved;
+        return true;
+    }
+    /**
+     * @brief  forgets the saved state, the next load() fails
+     */
+    void invalidate()
+    {
+        magic = 0;
+    }
+};
+
+#endif // WARM_RESTART_H
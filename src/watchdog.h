@@ -55,6 +55,29 @@ void petWatchdog()
     WDT->CLEAR.reg = WDT_CLEAR_CLEAR_KEY;
 }
 
+/**
+ * @brief  stops the watchdog around a library call that can block for seconds (ex: WiFi101 connecting), only call while the motor is off
+ */
+void suspendWatchdog()
+{
+    WDT->CTRL.reg = 0;
+    while (WDT->STATUS.bit.SYNCBUSY)
+        ;
+}
+
+/**
+ * @brief  starts the watchdog again after suspendWatchdog(), with a full timeout
+ */
+void resumeWatchdog()
+{
+    WDT->CLEAR.reg = WDT_CLEAR_CLEAR_KEY;
+    while (WDT->STATUS.bit.SYNCBUSY)
+        ;
+    WDT->CTRL.reg = WDT_CTRL_ENABLE;
+    while (WDT->STATUS.bit.SYNCBUSY)
+        ;
+}
+
 /**
  * This function is called when the watchdog is not pet
  */
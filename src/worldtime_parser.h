@@ -0,0 +1,318 @@
+/**
+ * worldtime_parser.h contains a parser for worldtimeapi.org's HTTP response that takes one byte at a time as it arrives,
+ * and keeps only the two values the clock needs (the time of day of "datetime" and "utc_offset"), instead of buffering the whole response.
+ * It handles the status line, headers, chunked transfer encoding and enough JSON to only take the top level keys.
+ */
+#ifndef WORLDTIME_PARSER_H
+#define WORLDTIME_PARSER_H
+#include "time_of_day.h"
+#include <Arduino.h>
+
+/**
+ * @brief  Streaming parser of a worldtimeapi.org timezone response, ex: {"datetime":"2022-12-10T16:31:02.365-05:00","utc_offset":"-05:00",...}
+ * @note   feed() never looks back at earlier bytes, so a response can be split anywhere between reads.
+ *      Malformed input can't make it read or write outside of its fields, at worst the values aren't found.
+ */
+class WorldTimeParser {
+    enum Stage : uint8_t {
+        STATUS_LINE,
+        HEADER_LINE,
+        BODY, // JSON, until the connection closes
+        CHUNK_SIZE, // hex digits of a chunk's size
+        CHUNK_EXTENSION, // rest of the chunk size line
+        CHUNK_DATA,
+        CHUNK_DATA_END, // CRLF after a chunk
+        FINISHED
+    };
+    enum Field : uint8_t {
+        DATETIME = 1,
+        UTC_OFFSET = 2,
+        NO_FIELD = 0
+    };
+    enum Flag : uint8_t {
+        STATUS_CODE = 1, // reading the digits of the status code
+        TRANSFER_ENCODING = 2, // the header line is Transfer-Encoding
+        CHUNKED = 4,
+        IN_STRING = 8,
+        ESCAPED = 16,
+        AFTER_COLON = 32, // a string at the top level is a value, not a key
+        STARTED = 64 // the JSON object has been opened
+    };
+    static const uint8_t TIME_START = 11; // the time of day starts after "2022-12-10T"
+    static const uint8_t TIME_LENGTH = 8;
+    static const uint8_t OFFSET_LENGTH = 6;
+
+    Stage stage;
+    uint8_t flags;
+    uint16_t status;
+    uint8_t line_position; // of the header line, stops counting at 255
+    uint8_t matched; // characters of "chunked" matched in a Transfer-Encoding header
+    uint32_t chunk_remaining;
+    uint8_t depth; // of JSON objects and arrays
+    uint8_t key_position;
+    uint8_t candidates; // Fields that the key being read could still be
+    Field key; // the last key that was a Field, its value is captured
+    uint8_t value_position;
+    uint8_t found; // Fields whose values were captured
+    char time[TIME_LENGTH]; // HH:MM:SS, without a null terminator
+    char offset[OFFSET_LENGTH]; // +HH:MM
+
+    static char lower(char c)
+    {
+        return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+    static const char* fieldName(uint8_t field)
+    {
+        return field == DATETIME ? "datetime" : "utc_offset";
+    }
+    void header(char c)
+    {
+        if (c == '\r') {
+            return;
+        }
+        if (c == '\n') {
+            if (line_position == 0) { // the empty line after the headers
+                stage = (flags & CHUNKED) ? CHUNK_SIZE : BODY;
+                chunk_remaining = 0;
+            }
+            line_position = 0;
+            matched = 0;
+            flags &= ~TRANSFER_ENCODING;
+            return;
+        }
+        const char name[] = "transfer-encoding:";
+        const uint8_t name_length = sizeof(name) - 1;
+        if (line_position < name_length) {
+            if (lower(c) != name[line_position]) {
+                line_position = 255; // not this header, count the line as non-empty and stop matching
+                return;
+            }
+            if (line_position == name_length - 1) {
+                flags |= TRANSFER_ENCODING;
+            }
+        } else if (flags & TRANSFER_ENCODING) {
+            const char value[] = "chunked"; // no character repeats at its start, so a mismatch only has to restart the match
+            matched = lower(c) == value[matched] ? matched + 1 : (lower(c) == value[0] ? 1 : 0);
+            if (matched == sizeof(value) - 1) {
+                flags |= CHUNKED;
+                matched = 0;
+            }
+        }
+        if (line_position < 255) {
+            line_position++;
+        }
+    }
+    void statusLine(char c)
+    {
+        if (c == '\n') {
+            stage = HEADER_LINE;
+            line_position = 0;
+            flags &= ~STATUS_CODE;
+        } else if (c == ' ') {
+            flags = status == 0 ? flags | STATUS_CODE : flags & ~STATUS_CODE; // the code follows the first space
+        } else if ((flags & STATUS_CODE) && c >= '0' && c <= '9' && status < 1000) {
+            status = status * 10 + (c - '0');
+        }
+    }
+    void chunked(char c)
+    {
+        if (stage == CHUNK_DATA) {
+            json(c);
+            if (--chunk_remaining == 0) {
+                stage = CHUNK_DATA_END;
+            }
+            return;
+        }
+        if (c == '\n') {
+            if (stage == CHUNK_DATA_END) {
+                stage = CHUNK_SIZE;
+                chunk_remaining = 0;
+            } else { // end of the size line, a size of 0 is the last chunk
+                stage = chunk_remaining == 0 ? FINISHED : CHUNK_DATA;
+            }
+            return;
+        }
+        if (stage == CHUNK_SIZE) {
+            char l = lower(c);
+            uint8_t digit = (c >= '0' && c <= '9') ? c - '0' : ((l >= 'a' && l <= 'f') ? l - 'a' + 10 : 16);
+            if (digit < 16) {
+                if (chunk_remaining >> 27) {
+                    stage = FINISHED; // bigger than any response, the framing is broken
+                    return;
+                }
+                chunk_remaining = chunk_remaining * 16 + digit;
+            } else if (c != '\r') {
+                stage = CHUNK_EXTENSION;
+            }
+        }
+    }
+    void json(char c)
+    {
+        if (flags & IN_STRING) {
+            if (flags & ESCAPED) {
+                flags &= ~ESCAPED;
+            } else if (c == '\\') {
+                flags |= ESCAPED;
+                c = 0; // the escape itself isn't part of the string
+            } else if (c == '"') {
+                endString();
+                return;
+            }
+            if (c != 0) {
+                stringCharacter(c);
+            }
+            return;
+        }
+        switch (c) {
+        case '"':
+            flags |= IN_STRING;
+            key_position = 0;
+            value_position = 0;
+            candidates = (depth == 1 && !(flags & AFTER_COLON)) ? (DATETIME | UTC_OFFSET) : 0;
+            break;
+        case ':':
+            flags |= AFTER_COLON;
+            break;
+        case ',':
+            flags &= ~AFTER_COLON;
+            key = NO_FIELD;
+            break;
+        case '{':
+        case '[':
+            flags = (flags | STARTED) & ~AFTER_COLON;
+            key = NO_FIELD;
+            if (depth < 255) {
+                depth++;
+            }
+            break;
+        case '}':
+        case ']':
+            key = NO_FIELD;
+            if (depth > 0) {
+                depth--;
+            }
+            if (depth == 0 && (flags & STARTED)) {
+                stage = FINISHED;
+            }
+            break;
+        }
+    }
+    void stringCharacter(char c)
+    {
+        if (candidates != 0) { // a key
+            for (uint8_t field = DATETIME; field <= UTC_OFFSET; field <<= 1) {
+                if ((candidates & field) && fieldName(field)[key_position] != c) { // the null terminator doesn't match any character
+                    candidates &= ~field;
+                }
+            }
+            key_position++;
+        } else if (depth == 1 && (flags & AFTER_COLON) && key == DATETIME) {
+            if (value_position >= TIME_START && value_position < TIME_START + TIME_LENGTH) {
+                time[value_position - TIME_START] = c;
+            }
+            value_position++;
+        } else if (depth == 1 && (flags & AFTER_COLON) && key == UTC_OFFSET) {
+            if (value_position < OFFSET_LENGTH) {
+                offset[value_position] = c;
+            }
+            value_position++;
+        }
+    }
+    void endString()
+    {
+        flags &= ~IN_STRING;
+        if (candidates != 0) {
+            key = NO_FIELD;
+            for (uint8_t field = DATETIME; field <= UTC_OFFSET; field <<= 1) {
+                if ((candidates & field) && fieldName(field)[key_position] == '\0') {
+                    key = (Field)field;
+                }
+            }
+            candidates = 0;
+        } else if (key == DATETIME && value_position >= TIME_START + TIME_LENGTH) {
+            found |= DATETIME;
+        } else if (key == UTC_OFFSET && value_position >= OFFSET_LENGTH) {
+            found |= UTC_OFFSET;
+        }
+    }
+
+public:
+    WorldTimeParser()
+    {
+        reset();
+    }
+    /**
+     * @brief  starts over, call before each response
+     */
+    void reset()
+    {
+        stage = STATUS_LINE;
+        flags = 0;
+        status = 0;
+        line_position = 0;
+        matched = 0;
+        chunk_remaining = 0;
+        depth = 0;
+        key_position = 0;
+        candidates = 0;
+        key = NO_FIELD;
+        value_position = 0;
+        found = 0;
+    }
+    /**
+     * @brief  parses the next byte of the response
+     */
+    void feed(char c)
+    {
+        switch (stage) {
+        case STATUS_LINE:
+            statusLine(c);
+            break;
+        case HEADER_LINE:
+            header(c);
+            break;
+        case BODY:
+            json(c);
+            break;
+        case FINISHED:
+            break;
+        default:
+            chunked(c);
+            break;
+        }
+    }
+    /**
+     * @brief  true once the JSON object (or the last chunk) has ended, the rest of the response can be ignored
+     */
+    bool finished()
+    {
+        return stage == FINISHED;
+    }
+    /**
+     * @brief  the HTTP status code, 0 until it has been read
+     */
+    uint16_t statusCode()
+    {
+        return status;
+    }
+    /**
+     * @brief  the local time of day of "datetime"
+     * @retval seconds since midnight, -1 if it wasn't found, isn't a time, or the status wasn't 200
+     */
+    int32_t localSeconds()
+    {
+        return (status == 200 && (found & DATETIME)) ? parseTimeOfDay(time) : -1;
+    }
+    /**
+     * @brief  reads "utc_offset"
+     * @param  seconds: set to the offset, ex: -18000 for -05:00
+     * @retval false if it wasn't found, isn't an offset, or the status wasn't 200
+     */
+    bool utcOffset(int32_t& seconds)
+    {
+        return status == 200 && (found & UTC_OFFSET) && parseUtcOffset(offset, seconds);
+    }
+};
+static_assert(sizeof(WorldTimeParser) < 64, "the parser replaces a 5 KB buffer, it should stay small");
+
+#endif // WORLDTIME_PARSER_H